@@ -0,0 +1,41 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _ALLOCSTATS_H
+#define _ALLOCSTATS_H
+
+#include <stdint.h>
+
+// calls to malloc, calloc and realloc and the bytes they asked for
+
+typedef struct
+{
+    uint64_t calls;
+    uint64_t bytes;
+} AllocStats;
+
+// make ALLOC_STATS=1 counts every allocation in the process, glib and gtk included. Each step of a spellcheck
+// pass adds what it allocated, on whichever thread it ran, and the total is printed once the pass is over.
+// Otherwise the macros compile to nothing.
+
+#ifdef ALLOC_STATS
+
+AllocStats alloc_stats_thread(void);
+void alloc_stats_add_since(AllocStats *start);
+void alloc_stats_report(const char *name);
+
+#define ALLOC_COUNT_SCOPE() \
+    AllocStats allocScope __attribute__((cleanup(alloc_stats_add_since), unused)) = alloc_stats_thread()
+#define ALLOC_COUNT_REPORT(name) alloc_stats_report(name)
+
+#else
+
+#define ALLOC_COUNT_SCOPE()
+#define ALLOC_COUNT_REPORT(name) ((void) 0)
+
+#endif
+
+#endif // _ALLOCSTATS_H
@@ -0,0 +1,41 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _BUKFILE_H
+#define _BUKFILE_H
+
+#include <glib.h>
+
+// the extension of documents saved in the native format
+
+#define BUKFILE_EXTENSION ".buk"
+
+typedef struct BukFile BukFile;
+typedef struct BukWriter BukWriter;
+
+gboolean bukfile_sniff(const void *data, gsize len);
+BukFile *bukfile_open(const gchar *path, GError **err);
+void bukfile_close(BukFile *file);
+guint bukfile_tag_count(BukFile *file);
+const gchar *bukfile_tag(BukFile *file, guint index, gint *priority, GPtrArray *attrs);
+const guint32 *bukfile_style(BukFile *file, guint index, guint *count);
+guint bukfile_run_count(BukFile *file);
+const gchar *bukfile_run(BukFile *file, guint index, gsize *len, guint *style);
+guint bukfile_image_count(BukFile *file);
+const gchar *bukfile_image(BukFile *file, guint index, gint *width, gint *height);
+GBytes *bukfile_image_data(BukFile *file, guint index);
+guint bukfile_anchor_count(BukFile *file);
+gboolean bukfile_anchor(BukFile *file, guint index, guint64 *chars, guint *image);
+
+BukWriter *bukwriter_new(void);
+void bukwriter_add_tag(BukWriter *writer, const gchar *name, gint priority, GPtrArray *attrs);
+void bukwriter_add_style(BukWriter *writer, const guint32 *tags, guint count);
+void bukwriter_add_run(BukWriter *writer, const gchar *text, gsize len, guint style);
+guint bukwriter_add_image(BukWriter *writer, const gchar *hash, gint width, gint height, GBytes *data);
+void bukwriter_add_anchor(BukWriter *writer, guint image);
+GBytes *bukwriter_finish(BukWriter *writer);
+
+#endif // _BUKFILE_H
@@ -7,7 +7,8 @@
 #ifndef _DEBUGMSG_H
 #define _DEBUGMSG_H
 
-#define DEBUG_MSG
+// debug messages are printed as they happen, which is slow enough to change how the editor behaves, so they
+// are only built in with make DEBUG=1. Use trace.h to time things.
 
 #if defined(DEBUG_MSG)
 
@@ -15,7 +16,7 @@
 
 #else
 
-#define DEB(message) 
+#define DEB(...)
 
 #endif // DEBUG_MSG
 
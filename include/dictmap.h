@@ -0,0 +1,23 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _DICTMAP_H
+#define _DICTMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// a precompiled word list mapped read only into memory, see dictmap_compile for how one is made
+
+typedef struct DictMap DictMap;
+
+DictMap *dictmap_open(const char *path);
+void dictmap_close(DictMap *map);
+bool dictmap_contains(const DictMap *map, const char *word, size_t len);
+size_t dictmap_count(const DictMap *map);
+bool dictmap_compile(const char *wordlist, const char *path);
+
+#endif // _DICTMAP_H
@@ -0,0 +1,55 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _FILEIO_H
+#define _FILEIO_H
+
+#include <gtk/gtk.h>
+
+// called on the main loop as a load makes progress, fraction runs from 0 to 1
+
+typedef void (*FileioProgressFunc)(gdouble fraction, gpointer data);
+
+// called on the main loop once a load or save has finished, error is NULL on success
+
+typedef void (*FileioDoneFunc)(const gchar *error, gpointer data);
+
+// the error a load reports when it was cancelled, whether by fileio_cancel or by another load starting
+
+#define FILEIO_CANCELLED "Cancelled"
+
+// an image as documents store it, the hex sha256 of its encoded data, its own size and the encoded data
+
+typedef struct
+{
+    gchar *hash;
+    gint width;
+    gint height;
+    GBytes *data;
+} FileioImage;
+
+// places an image loaded from a document at an iter, and finds the image shown at an anchor for a save. The
+// image found is borrowed, false means the anchor holds no image to save.
+
+typedef void (*FileioImagePlaceFunc)(GtkTextBuffer *buff, GtkTextIter *iter, const FileioImage *image);
+typedef gboolean (*FileioImageFindFunc)(GtkTextChildAnchor *anchor, FileioImage *image);
+
+void fileio_open_async(GtkTextBuffer *buff, const gchar *path, FileioProgressFunc progress, FileioDoneFunc done,
+                       gpointer data);
+gboolean fileio_loading(void);
+gboolean fileio_inserting(void);
+void fileio_set_inserting(gboolean active);
+gboolean fileio_is_plain(const gchar *data, gsize len);
+void fileio_cancel(void);
+void fileio_save_async(GtkTextBuffer *buff, const gchar *path, FileioDoneFunc done, gpointer data);
+void fileio_exclude_tag(GtkTextTag *tag);
+gboolean fileio_tag_excluded(GtkTextTag *tag);
+void fileio_image_handlers(FileioImagePlaceFunc place, FileioImageFindFunc find);
+GPtrArray *fileio_tag_attrs(GtkTextTag *tag);
+GtkTextTag *fileio_define_tag(GtkTextBuffer *buff, const gchar *name, GPtrArray *attrs);
+gboolean fileio_convert(const gchar *src, const gchar *dst, GError **err);
+
+#endif // _FILEIO_H
@@ -0,0 +1,42 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _FORMAT_H
+#define _FORMAT_H
+
+#include <gtk/gtk.h>
+
+#include "styles.h"
+
+// the formatting commands behind the toolbar buttons
+
+typedef enum
+{
+    FORMAT_BOLD,
+    FORMAT_ITALIC,
+    FORMAT_UNDERLINE,
+    FORMAT_STRIKETHROUGH,
+    FORMAT_LJUST,
+    FORMAT_RJUST,
+    FORMAT_CJUST,
+    FORMAT_FJUST,
+    FORMAT_INDENT,
+    FORMAT_UNINDENT,
+    FORMAT_COUNT
+} FormatCommand;
+
+// a half open range of character offsets to format
+
+typedef struct
+{
+    gint start;
+    gint end;
+} FormatRange;
+
+void format_apply(EditorContext *editor, FormatCommand command, const FormatRange *ranges, guint count);
+void format_selection(EditorContext *editor, FormatCommand command);
+
+#endif // _FORMAT_H
@@ -0,0 +1,29 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _IMAGES_H
+#define _IMAGES_H
+
+#include <gtk/gtk.h>
+
+#include "fileio.h"
+
+// memory the cache of scaled images may use before the least recently shown are dropped
+
+#define IMAGES_CACHE_BYTES (64 << 20)
+
+// images within this many screens of the visible text are kept decoded, so scrolling finds them ready
+
+#define IMAGES_PREFETCH_SCREENS 1
+
+void images_attach(GtkTextView *view);
+void images_detach(void);
+void images_insert(GdkPixbuf *pixbuf);
+void images_place(GtkTextBuffer *buff, GtkTextIter *iter, const FileioImage *image);
+gboolean images_find(GtkTextChildAnchor *anchor, FileioImage *image);
+void images_set_zoom(gdouble zoom);
+
+#endif // _IMAGES_H
@@ -0,0 +1,23 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <gtk/gtk.h>
+
+#include "fileio.h"
+
+void journal_attach(GtkTextBuffer *buff);
+void journal_detach(void);
+void journal_track(const gchar *path);
+const gchar *journal_path(void);
+gboolean journal_replay(const gchar *path);
+void journal_full_save(const gchar *path, FileioDoneFunc done, gpointer data);
+gboolean journal_save(FileioDoneFunc done, gpointer data);
+gboolean journal_busy(void);
+
+#endif // _JOURNAL_H
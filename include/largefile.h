@@ -0,0 +1,36 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _LARGEFILE_H
+#define _LARGEFILE_H
+
+#include <gtk/gtk.h>
+
+#include "fileio.h"
+#include "styles.h"
+
+// plain text files bigger than this are mapped and shown through a window of chunks instead of being loaded
+
+#define LARGEFILE_THRESHOLD (64 << 20)
+
+// the file is indexed into chunks of about this many bytes, each ending after a newline where one is near
+
+#define LARGEFILE_CHUNK_BYTES (256 << 10)
+
+// the number of chunks kept in the buffer at once
+
+#define LARGEFILE_WINDOW_CHUNKS 4
+
+gboolean largefile_wanted(const gchar *path);
+void largefile_open(EditorContext *editor, const gchar *path, FileioDoneFunc done, gpointer data);
+void largefile_close(void);
+gboolean largefile_active(void);
+gboolean largefile_indexing(void);
+guint64 largefile_lines(void);
+void largefile_find(const gchar *needle);
+void largefile_next_misspelling(void);
+
+#endif // _LARGEFILE_H
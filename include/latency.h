@@ -0,0 +1,53 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdio.h>
+#include <gtk/gtk.h>
+
+#include "styles.h"
+
+// histograms hold microseconds. Values below 2^LATENCY_SUB_BITS are exact, above that each power of two is
+// split into 2^LATENCY_SUB_BITS buckets, so every value is within about 3% of the one recorded.
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_BUCKETS 1024
+
+// an input still waiting for a paint after this long had nothing to show and is dropped
+
+#define LATENCY_STALE_US 1000000
+
+// counts of values in log-linear buckets, with enough kept to report an exact maximum
+
+typedef struct
+{
+    guint32 counts[LATENCY_BUCKETS];
+    guint64 total;
+    guint64 max;
+} LatencyHistogram;
+
+// what is measured, each into its own histogram
+
+typedef enum
+{
+    LATENCY_KEY_TO_PAINT,
+    LATENCY_CHANGE_TO_PAINT,
+    LATENCY_HANDLER,
+    LATENCY_LAYOUT,
+    LATENCY_PAINT,
+    LATENCY_COUNT
+} LatencyMetric;
+
+void latency_attach(EditorContext *editor);
+void latency_detach(void);
+void latency_record(LatencyMetric metric, guint64 us);
+guint64 latency_percentile(LatencyMetric metric, gdouble percent);
+void latency_report(FILE *out);
+void latency_reset(void);
+
+#endif // _LATENCY_H
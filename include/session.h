@@ -0,0 +1,52 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <gtk/gtk.h>
+
+// session files start with this and a byte order mark, as .buk files do, and hold records of fixed size each
+// followed by its payload
+
+#define SESSION_MAGIC "BUKSESS\0"
+#define SESSION_BOM 0x01020304
+#define SESSION_VERSION 1
+
+// what a record holds. Toolbar actions and file operations are recorded as what they did rather than as
+// clicks, so a replay does not depend on where the buttons were or on answering dialogs.
+
+typedef enum
+{
+    SESSION_KEY_PRESS,
+    SESSION_KEY_RELEASE,
+    SESSION_BOLD,
+    SESSION_ITALIC,
+    SESSION_UNDERLINE,
+    SESSION_STRIKETHROUGH,
+    SESSION_INDENT,
+    SESSION_UNINDENT,
+    SESSION_LJUST,
+    SESSION_RJUST,
+    SESSION_CJUST,
+    SESSION_FJUST,
+    SESSION_PASTE,
+    SESSION_SAVE,
+    SESSION_SAVE_AS,
+    SESSION_OPEN,
+    SESSION_RECORD_TYPES
+} SessionRecordType;
+
+// performs a recorded action other than a key event, path is set for file operations
+
+typedef void (*SessionActionFunc)(SessionRecordType type, const gchar *path);
+
+void session_parse_args(int *argc, char **argv);
+void session_attach(GtkWidget *window, GtkWidget *focus, SessionActionFunc action);
+void session_detach(void);
+void session_record(SessionRecordType type, const gchar *path);
+
+#endif // _SESSION_H
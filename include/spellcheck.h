@@ -8,10 +8,63 @@
 #define _SPELLCHECK_H
 
 #include <stdbool.h>
+#include <stddef.h>
+
+// counters for the word verdict cache which sits in front of hunspell
+
+typedef struct
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned int entries;
+} SpellcheckCacheStats;
+
+// a misspelt word found by spellcheck_checkstring, in bytes from the start of the checked string
+
+typedef struct
+{
+    size_t offset;
+    size_t length;
+} SpellcheckSpan;
+
+// the spans found by one spellcheck_checkstring call, the array is kept between calls and only grows
+
+typedef struct
+{
+    SpellcheckSpan *spans;
+    size_t count;
+    size_t capacity;
+} SpellcheckResult;
+
+// where the dictionary has got to, checks only find misspellings once it is ready
+
+typedef enum
+{
+    SPELLCHECK_UNLOADED,
+    SPELLCHECK_LOADING,
+    SPELLCHECK_READY,
+    SPELLCHECK_FAILED
+} SpellcheckState;
+
+// called on the suggestion thread with the suggestions for a request, see spellcheck_suggest_async
+
+typedef void (*SpellcheckSuggestFunc)(unsigned long ticket, char *list, void *data);
 
 void spellcheck_init(void);
+void spellcheck_init_async(void);
+SpellcheckState spellcheck_state(void);
+void spellcheck_notify_ready(void (*func)(void *), void *data);
 void spellcheck_deinit(void);
 bool spellcheck_isvalidword(const char *word);
-bool spellcheck_checkstring(const char *string);
+size_t spellcheck_checkstring(const char *string, size_t len, SpellcheckResult *result);
+void spellcheck_result_free(SpellcheckResult *result);
+void spellcheck_cache_stats(SpellcheckCacheStats *stats);
+char *spellcheck_suggest(const char *word);
+char *spellcheck_suggest_cached(const char *word);
+unsigned long spellcheck_suggest_async(const char *word, SpellcheckSuggestFunc func, void *data);
+void spellcheck_suggest_cancel(unsigned long ticket);
+bool spellcheck_add_word(const char *word);
+bool spellcheck_ignore_word(const char *word);
 
 #endif // _SPELLCHECK_H
\ No newline at end of file
@@ -0,0 +1,20 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _SPELLVIEW_H
+#define _SPELLVIEW_H
+
+#include <gtk/gtk.h>
+
+void spellview_attach(GtkTextView *view, GtkTextTag *tag);
+void spellview_attach_buffer(GtkTextBuffer *buff, GtkTextTag *tag);
+void spellview_detach(void);
+void spellview_mark_dirty(gint start, gint end);
+void spellview_accept_word(const gchar *word);
+void spellview_flush(void);
+gboolean spellview_idle(void);
+
+#endif // _SPELLVIEW_H
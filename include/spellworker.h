@@ -0,0 +1,49 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _SPELLWORKER_H
+#define _SPELLWORKER_H
+
+#include <gtk/gtk.h>
+
+// a misspelt word, as character offsets relative to the start of the job text
+
+typedef struct
+{
+    gint start;
+    gint end;
+} SpellSpan;
+
+// finished jobs kept for reuse, so a steady stream of edits allocates no job structs or span arrays
+
+#define SPELLWORKER_POOL_JOBS 32
+
+// a snapshot of buffer text sent to the worker thread. The marks are owned by the main thread and
+// track where the text lives in the buffer, the worker only reads text and fills misspelt. Jobs with a
+// lower priority value are checked first. link belongs to the owner, for keeping the job in a GQueue
+// without allocating a node.
+
+typedef struct
+{
+    gchar *text;
+    GArray *misspelt;
+    GtkTextMark *start;
+    GtkTextMark *end;
+    gint priority;
+    gint cancelled;
+    GList link;
+} SpellJob;
+
+void spellworker_start(GSourceFunc ready);
+void spellworker_stop(void);
+SpellJob *spellworker_new_job(void);
+void spellworker_submit(SpellJob *job);
+guint spellworker_queued(void);
+void spellworker_cancel(SpellJob *job);
+SpellJob *spellworker_pop_result(void);
+void spellworker_free_job(SpellJob *job);
+
+#endif // _SPELLWORKER_H
@@ -0,0 +1,50 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _STYLES_H
+#define _STYLES_H
+
+#include <gtk/gtk.h>
+
+// indents go up in steps of this many pixels, to at most this many levels
+
+#define STYLES_INDENT_STEP 25
+#define STYLES_INDENT_LEVELS 16
+
+// the widgets and tags the editor works with, looked up once when the window is built. Indent tags are
+// made the first time a level is used and removed again once no text uses them, slot 0 stands for no indent
+// and is always NULL.
+
+typedef struct
+{
+    GtkWindow *window;
+    GtkTextView *view;
+    GtkTextBuffer *buff;
+    GtkTextTagTable *table;
+
+    GtkTextTag *bold;
+    GtkTextTag *ital;
+    GtkTextTag *uline;
+    GtkTextTag *sthru;
+
+    GtkTextTag *ljust;
+    GtkTextTag *rjust;
+    GtkTextTag *cjust;
+    GtkTextTag *fjust;
+
+    GtkTextTag *misspelt;
+
+    GtkTextTag *indent[STYLES_INDENT_LEVELS + 1];
+} EditorContext;
+
+void styles_init(EditorContext *editor, GtkBuilder *builder);
+void styles_create_tags(EditorContext *editor);
+GtkTextTag *styles_indent_tag(EditorContext *editor, gint level);
+gint styles_indent_level(EditorContext *editor, GtkTextIter *iter);
+void styles_clear_indent(EditorContext *editor, GtkTextIter *start, GtkTextIter *end);
+void styles_schedule_collect(EditorContext *editor);
+
+#endif // _STYLES_H
@@ -0,0 +1,25 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _SUGGEST_H
+#define _SUGGEST_H
+
+#include <gtk/gtk.h>
+
+// the most suggestions offered in the context menu
+
+#define SUGGEST_MENU_ITEMS 8
+
+// once the view has been still this long suggestions are worked out for the misspelt words on screen, this
+// many at a time
+
+#define SUGGEST_PREFETCH_MS 500
+#define SUGGEST_PREFETCH_WORDS 32
+
+void suggest_attach(GtkTextView *view, GtkTextTag *tag);
+void suggest_detach(void);
+
+#endif // _SUGGEST_H
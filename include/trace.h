@@ -0,0 +1,89 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+// how much is traced, set at build time with make TRACE=n. Events above TRACE_LEVEL compile to nothing, so
+// the default build carries no tracing at all.
+
+#define TRACE_OFF 0
+#define TRACE_SPAN 1
+#define TRACE_DETAIL 2
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_OFF
+#endif
+
+// events each thread keeps, once its ring is full the oldest are overwritten
+
+#define TRACE_RING_EVENTS 8192
+
+// a span which is recorded when the variable holding it goes out of scope
+
+typedef struct
+{
+    const char *name;
+    uint64_t start;
+} TraceScope;
+
+#if TRACE_LEVEL > TRACE_OFF
+
+void trace_init(const char *path);
+uint64_t trace_now(void);
+void trace_complete(const char *name, uint64_t start);
+void trace_instant(const char *name);
+void trace_async(const char *name, char phase, const void *id);
+void trace_scope_end(TraceScope *scope);
+int trace_dump(const char *path);
+
+#define TRACE_INIT(path) trace_init(path)
+#define TRACE_DUMP(path) trace_dump(path)
+
+#else
+
+#define TRACE_INIT(path)
+#define TRACE_DUMP(path)
+
+#endif // TRACE_LEVEL > TRACE_OFF
+
+// the macros take the level as their first argument, e.g. TRACE_SCOPE(TRACE_SPAN, "open"), and the name must
+// be a string literal as only the pointer is stored. A scope lasts until the end of the enclosing block, async
+// spans pair a begin and an end with the same name and id, which may be on different threads.
+
+#define TRACE_SCOPE(level, name) TRACE_SCOPE_##level(name)
+#define TRACE_INSTANT(level, name) TRACE_INSTANT_##level(name)
+#define TRACE_ASYNC_BEGIN(level, name, id) TRACE_ASYNC_##level(name, 'b', id)
+#define TRACE_ASYNC_END(level, name, id) TRACE_ASYNC_##level(name, 'e', id)
+
+#define TRACE_JOIN(a, b) a##b
+#define TRACE_VAR(line) TRACE_JOIN(traceScope, line)
+#define TRACE_SCOPE_ON(name) \
+    TraceScope TRACE_VAR(__LINE__) __attribute__((cleanup(trace_scope_end), unused)) = { name, trace_now() }
+
+#if TRACE_LEVEL >= TRACE_SPAN
+#define TRACE_SCOPE_TRACE_SPAN(name) TRACE_SCOPE_ON(name)
+#define TRACE_INSTANT_TRACE_SPAN(name) trace_instant(name)
+#define TRACE_ASYNC_TRACE_SPAN(name, phase, id) trace_async(name, phase, id)
+#else
+#define TRACE_SCOPE_TRACE_SPAN(name)
+#define TRACE_INSTANT_TRACE_SPAN(name)
+#define TRACE_ASYNC_TRACE_SPAN(name, phase, id)
+#endif
+
+#if TRACE_LEVEL >= TRACE_DETAIL
+#define TRACE_SCOPE_TRACE_DETAIL(name) TRACE_SCOPE_ON(name)
+#define TRACE_INSTANT_TRACE_DETAIL(name) trace_instant(name)
+#define TRACE_ASYNC_TRACE_DETAIL(name, phase, id) trace_async(name, phase, id)
+#else
+#define TRACE_SCOPE_TRACE_DETAIL(name)
+#define TRACE_INSTANT_TRACE_DETAIL(name)
+#define TRACE_ASYNC_TRACE_DETAIL(name, phase, id)
+#endif
+
+#endif // _TRACE_H
@@ -0,0 +1,35 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _UNDO_H
+#define _UNDO_H
+
+#include <gtk/gtk.h>
+
+// memory the history may use unless told otherwise, the oldest steps are dropped to stay inside it
+
+#define UNDO_DEFAULT_BYTES (8 << 20)
+
+// what the history is using, bytes counts the payload arena and the delta ring together
+
+typedef struct
+{
+    gsize bytes;
+    gsize capacity;
+    guint deltas;
+    guint undoSteps;
+    guint redoSteps;
+    guint64 evicted;
+} UndoStats;
+
+void undo_attach(GtkTextBuffer *buff, gsize capacity);
+void undo_detach(void);
+void undo_clear(void);
+gboolean undo_undo(void);
+gboolean undo_redo(void);
+void undo_stats(UndoStats *stats);
+
+#endif // _UNDO_H
@@ -0,0 +1,32 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#ifndef _USERDICT_H
+#define _USERDICT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// the user's own words, kept sorted in a file which is mapped read only, see userdict_write for the format
+
+typedef struct UserDict UserDict;
+
+// a word to write, which need not be nul terminated
+
+typedef struct
+{
+    const char *word;
+    size_t len;
+} UserDictWord;
+
+UserDict *userdict_open(const char *path);
+void userdict_close(UserDict *dict);
+bool userdict_contains(const UserDict *dict, const char *word, size_t len);
+size_t userdict_count(const UserDict *dict);
+const char *userdict_word(const UserDict *dict, size_t i, size_t *len);
+bool userdict_write(const char *path, UserDictWord *words, size_t count);
+
+#endif // _USERDICT_H
@@ -0,0 +1,82 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "allocstats.h"
+
+#ifdef ALLOC_STATS
+
+// glibc's allocator. Defining malloc here takes the place of the C library's for every caller in the process,
+// each call is counted and passed on. Memory still goes back through the usual free.
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+// counts of the calling thread, so the allocator itself takes no locks
+
+static __thread uint64_t threadCalls, threadBytes;
+
+// what the current pass has allocated so far, added to from the main loop and the spellcheck worker
+
+static uint64_t passCalls, passBytes;
+
+void *malloc(size_t size)
+{
+    threadCalls++;
+    threadBytes += size;
+
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    threadCalls++;
+    threadBytes += count * size;
+
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    threadCalls++;
+    threadBytes += size;
+
+    return __libc_realloc(ptr, size);
+}
+
+// returns what the calling thread has allocated since it started
+
+AllocStats alloc_stats_thread(void)
+{
+    AllocStats stats = { threadCalls, threadBytes };
+
+    return stats;
+}
+
+// cleanup handler of ALLOC_COUNT_SCOPE, adds what the thread allocated since start to the pass
+
+void alloc_stats_add_since(AllocStats *start)
+{
+    __atomic_fetch_add(&passCalls, threadCalls - start->calls, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&passBytes, threadBytes - start->bytes, __ATOMIC_RELAXED);
+}
+
+// prints what the pass allocated and starts counting the next, nothing is printed for a pass which did nothing
+
+void alloc_stats_report(const char *name)
+{
+    uint64_t calls = __atomic_exchange_n(&passCalls, 0, __ATOMIC_RELAXED);
+    uint64_t bytes = __atomic_exchange_n(&passBytes, 0, __ATOMIC_RELAXED);
+
+    if (calls)
+        fprintf(stderr, "%s: %lu allocations, %lu bytes\n", name, (unsigned long) calls, (unsigned long) bytes);
+}
+
+#endif
@@ -0,0 +1,452 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gtk/gtk.h>
+
+#include "spellcheck.h"
+#include "spellview.h"
+#include "fileio.h"
+#include "styles.h"
+#include "format.h"
+
+// generated documents go up to this size unless a smaller limit is given on the command line
+
+#define BENCH_MAX_BYTES (50 << 20)
+
+// single word edits timed per document for the incremental spellcheck
+
+#define BENCH_EDITS 100
+
+// words looked up per timed batch when measuring spellcheck_isvalidword
+
+#define BENCH_WORD_BATCH 10000
+#define BENCH_WORD_BATCHES 100
+
+// the document sizes benchmarked, every size up to the limit is run
+
+static const gsize benchSizes[] = { 1 << 10, 64 << 10, 1 << 20, 10 << 20, 50 << 20 };
+
+// documents are made from common words with a sprinkling of misspellings, so the spellchecker sees the mix
+// of cache hits and misses it would in real text
+
+static const gchar *benchWords[] = {
+    "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with", "be", "by", "on", "not",
+    "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had", "they", "you", "were",
+    "their", "one", "all", "we", "can", "her", "has", "there", "been", "if", "more", "when", "will", "would",
+    "who", "so", "no", "editor", "document", "paragraph", "sentence", "language", "dictionary", "formatting",
+    "background", "keyboard", "window", "character", "spelling", "journal", "benchmark", "throughput"
+};
+
+static const gchar *benchTypos[] = {
+    "teh", "recieve", "seperate", "definately", "occured", "wich", "untill", "becuase", "accomodate", "goverment"
+};
+
+// one in this many words is misspelt
+
+#define BENCH_TYPO_RATE 40
+
+// set once the first result is printed, so the rest are separated by commas
+
+static gboolean reported;
+
+// set by the callbacks of whatever asynchronous operation is being waited for
+
+static gboolean finished;
+
+// builds a document of about the given size, in lines of a few sentences each
+
+static GString *generate_document(GRand *rand, gsize size)
+{
+    GString *text = g_string_sized_new(size + 64);
+    guint words = 0;
+
+    while (text->len < size)
+    {
+        const gchar *word;
+
+        if (g_rand_int_range(rand, 0, BENCH_TYPO_RATE) == 0)
+            word = benchTypos[g_rand_int_range(rand, 0, G_N_ELEMENTS(benchTypos))];
+        else
+            word = benchWords[g_rand_int_range(rand, 0, G_N_ELEMENTS(benchWords))];
+
+        g_string_append(text, word);
+        words++;
+
+        if (words % 60 == 0)
+            g_string_append(text, ".\n");
+        else if (words % 12 == 0)
+            g_string_append(text, ". ");
+        else
+            g_string_append_c(text, ' ');
+    }
+
+    return text;
+}
+
+// returns the time in milliseconds since some fixed point
+
+static gdouble now_ms(void)
+{
+    return g_get_monotonic_time() / 1000.0;
+}
+
+// records the milliseconds since begin as a sample and returns them
+
+static gdouble add_sample(GArray *samples, gdouble begin)
+{
+    gdouble ms = now_ms() - begin;
+
+    g_array_append_val(samples, ms);
+
+    return ms;
+}
+
+// returns a percentile of sorted samples, interpolating between the nearest two
+
+static gdouble percentile(GArray *samples, gdouble p)
+{
+    gdouble rank = p / 100 * (samples->len - 1);
+    guint low = (guint) rank;
+    guint high = MIN(low + 1, samples->len - 1);
+    gdouble lowValue = g_array_index(samples, gdouble, low);
+
+    return lowValue + (g_array_index(samples, gdouble, high) - lowValue) * (rank - low);
+}
+
+// orders samples for the percentiles
+
+static gint compare_samples(gconstpointer a, gconstpointer b)
+{
+    gdouble da = *(const gdouble *) a, db = *(const gdouble *) b;
+
+    return da > db ? 1 : da < db ? -1 : 0;
+}
+
+// prints one benchmark's timings as a json object and empties the samples. bytes is the size of document the
+// samples were taken on, rate is work per second worked out by the caller or 0 if it has none to give.
+
+static void report(const gchar *name, gsize bytes, GArray *samples, gdouble rate, const gchar *rateUnit)
+{
+    gdouble total = 0;
+    guint i;
+
+    if (!samples->len)
+        return;
+
+    g_array_sort(samples, compare_samples);
+    for (i = 0; i < samples->len; i++)
+        total += g_array_index(samples, gdouble, i);
+
+    printf("%s\n    {\"name\": \"%s\", \"bytes\": %zu, \"unit\": \"ms\", \"samples\": %u, \"min\": %.4f, "
+           "\"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f, \"mean\": %.4f",
+           reported ? "," : "", name, bytes, samples->len, g_array_index(samples, gdouble, 0),
+           percentile(samples, 50), percentile(samples, 90), percentile(samples, 99),
+           g_array_index(samples, gdouble, samples->len - 1), total / samples->len);
+    if (rate > 0)
+        printf(", \"%s\": %.1f", rateUnit, rate);
+    printf("}");
+
+    reported = TRUE;
+    g_array_set_size(samples, 0);
+}
+
+// the number of times to repeat a whole document operation, fewer for bigger documents
+
+static guint runs_for(gsize size)
+{
+    return size <= (1 << 20) ? 20 : size <= (10 << 20) ? 5 : 3;
+}
+
+// checks a whole document in one pass, as a freshly loaded file is
+
+static void bench_spell_full(const GString *text, GArray *samples)
+{
+    SpellcheckResult result = { 0 };
+    guint i, runs = runs_for(text->len);
+    gdouble total = 0;
+
+    for (i = 0; i < runs; i++)
+    {
+        gdouble start = now_ms();
+
+        spellcheck_checkstring(text->str, text->len, &result);
+        total += add_sample(samples, start);
+    }
+
+    spellcheck_result_free(&result);
+    report("spell_full", text->len, samples, (gdouble) text->len / (1 << 20) / (total / runs / 1000),
+           "mb_per_second");
+}
+
+// runs the main loop until a callback sets finished
+
+static void wait_finished(void)
+{
+    while (!finished)
+        g_main_context_iteration(NULL, TRUE);
+}
+
+// runs the main loop until spellview has checked every edit and the tag is up to date. A pass waiting on the
+// debounce is started straight away, as the delay is there for typing and not worth timing.
+
+static void wait_spellview(void)
+{
+    spellview_flush();
+
+    while (!spellview_idle())
+        g_main_context_iteration(NULL, TRUE);
+}
+
+// rechecks the whole document through spellview once it is already tagged. Nothing has changed, so this times
+// the checking and the comparison with the tagged words, and the tag itself is left alone.
+
+static void bench_spell_recheck(EditorContext *editor, GArray *samples)
+{
+    gint chars = gtk_text_buffer_get_char_count(editor->buff);
+    guint i, runs = runs_for(chars);
+
+    for (i = 0; i < runs; i++)
+    {
+        gdouble begin = now_ms();
+
+        spellview_mark_dirty(0, chars);
+        wait_spellview();
+        add_sample(samples, begin);
+    }
+
+    report("spell_recheck", chars, samples, 0, NULL);
+}
+
+// types a word at random places and times until spellview has rechecked around it and the result is back in
+// the buffer, which is the path a keystroke takes apart from the debounce
+
+static void bench_spell_incremental(EditorContext *editor, GRand *rand, GArray *samples)
+{
+    gint chars = gtk_text_buffer_get_char_count(editor->buff);
+    guint i;
+
+    for (i = 0; i < BENCH_EDITS; i++)
+    {
+        const gchar *word = benchTypos[g_rand_int_range(rand, 0, G_N_ELEMENTS(benchTypos))];
+        GtkTextIter at;
+        gdouble begin = now_ms();
+
+        gtk_text_buffer_get_iter_at_offset(editor->buff, &at, g_rand_int_range(rand, 0, chars));
+        gtk_text_buffer_insert(editor->buff, &at, word, -1);
+        wait_spellview();
+
+        add_sample(samples, begin);
+        chars += g_utf8_strlen(word, -1);
+    }
+
+    report("spell_incremental", gtk_text_buffer_get_char_count(editor->buff), samples, 0, NULL);
+}
+
+// looks up every word of the document list in batches, most are answered from the verdict cache
+
+static void bench_isvalidword(GRand *rand, GArray *samples)
+{
+    const gchar **words = g_new(const gchar *, BENCH_WORD_BATCH);
+    gdouble total = 0;
+    guint i, j;
+
+    for (i = 0; i < BENCH_WORD_BATCHES; i++)
+    {
+        gdouble start;
+
+        for (j = 0; j < BENCH_WORD_BATCH; j++)
+            words[j] = g_rand_int_range(rand, 0, BENCH_TYPO_RATE) == 0
+                ? benchTypos[g_rand_int_range(rand, 0, G_N_ELEMENTS(benchTypos))]
+                : benchWords[g_rand_int_range(rand, 0, G_N_ELEMENTS(benchWords))];
+
+        start = now_ms();
+        for (j = 0; j < BENCH_WORD_BATCH; j++)
+            spellcheck_isvalidword(words[j]);
+        total += add_sample(samples, start);
+    }
+
+    g_free(words);
+    report("spell_isvalidword_batch", 0, samples, BENCH_WORD_BATCH * BENCH_WORD_BATCHES / (total / 1000),
+           "words_per_second");
+}
+
+// times every formatting command over the whole document, toggles are run twice so both applying and
+// removing are measured
+
+static void bench_format(EditorContext *editor, gsize bytes, GArray *samples)
+{
+    static const struct
+    {
+        FormatCommand command;
+        const gchar *name;
+    } commands[] = {
+        { FORMAT_BOLD, "format_bold" },
+        { FORMAT_ITALIC, "format_italic" },
+        { FORMAT_UNDERLINE, "format_underline" },
+        { FORMAT_CJUST, "format_cjust" },
+        { FORMAT_INDENT, "format_indent" },
+        { FORMAT_UNINDENT, "format_unindent" }
+    };
+    guint i, j, runs = runs_for(bytes) * 2;
+    FormatRange range;
+
+    range.start = 0;
+    range.end = gtk_text_buffer_get_char_count(editor->buff);
+
+    for (i = 0; i < G_N_ELEMENTS(commands); i++)
+    {
+        for (j = 0; j < runs; j++)
+        {
+            gdouble begin = now_ms();
+
+            format_apply(editor, commands[i].command, &range, 1);
+            add_sample(samples, begin);
+        }
+
+        report(commands[i].name, bytes, samples, 0, NULL);
+    }
+}
+
+// called when a save or load has finished
+
+static void operation_done(const gchar *error, gpointer data)
+{
+    if (error)
+        fprintf(stderr, "%s failed: %s\n", (const gchar *) data, error);
+
+    finished = TRUE;
+}
+
+// saves the formatted document as gtk tagset markup and loads it back into an empty buffer, each through the
+// same worker thread and idle insertion the editor uses. These are whole round trips: a save includes the
+// snapshot, serialising, writing and the fsyncs, a load the read, parse and insertion.
+
+static void bench_tagset(EditorContext *editor, gsize bytes, GArray *samples)
+{
+    gchar *path = g_strdup_printf("%s/buk-bench-%d.txt", g_get_tmp_dir(), (int) getpid());
+    guint i, runs = runs_for(bytes);
+    GArray *loads = g_array_new(FALSE, FALSE, sizeof(gdouble));
+
+    for (i = 0; i < runs; i++)
+    {
+        GtkTextBuffer *buff = gtk_text_buffer_new(NULL);
+        gdouble begin = now_ms();
+
+        finished = FALSE;
+        fileio_save_async(editor->buff, path, operation_done, "save");
+        wait_finished();
+        add_sample(samples, begin);
+
+        begin = now_ms();
+        finished = FALSE;
+        fileio_open_async(buff, path, NULL, operation_done, "load");
+        wait_finished();
+        add_sample(loads, begin);
+
+        g_object_unref(buff);
+    }
+
+    report("tagset_save", bytes, samples, 0, NULL);
+    report("tagset_load", bytes, loads, 0, NULL);
+
+    unlink(path);
+    g_array_free(loads, TRUE);
+    g_free(path);
+}
+
+// parses a size such as 4096, 64k or 10m
+
+static gsize parse_size(const gchar *text)
+{
+    gchar *end;
+    gsize size = strtoull(text, &end, 10);
+
+    if (*end == 'k' || *end == 'K')
+        size <<= 10;
+    else if (*end == 'm' || *end == 'M')
+        size <<= 20;
+
+    return size;
+}
+
+// benchmarks the editor's hot paths without a window, on documents generated from a fixed seed so runs are
+// comparable. Results go to stdout as json, progress to stderr, e.g.
+//     make bench && ./bench 10m > before.json
+
+int main(int argc, char **argv)
+{
+    gsize limit = argc > 1 ? parse_size(argv[1]) : BENCH_MAX_BYTES;
+    GRand *rand = g_rand_new_with_seed(argc > 2 ? atoi(argv[2]) : 1);
+    GArray *samples = g_array_new(FALSE, FALSE, sizeof(gdouble));
+    EditorContext editor;
+    guint i;
+
+    if (argc > 3 || !limit)
+    {
+        fprintf(stderr, "usage: %s [max document size, e.g. 10m] [seed]\n", argv[0]);
+        return 1;
+    }
+
+    spellcheck_init();
+    if (spellcheck_state() != SPELLCHECK_READY)
+    {
+        fprintf(stderr, "the dictionary could not be loaded, run from the src directory\n");
+        return 1;
+    }
+
+    printf("{\n  \"benchmarks\": [");
+
+    bench_isvalidword(rand, samples);
+
+    for (i = 0; i < G_N_ELEMENTS(benchSizes) && benchSizes[i] <= limit; i++)
+    {
+        GString *text = generate_document(rand, benchSizes[i]);
+
+        fprintf(stderr, "benchmarking a %zu byte document\n", text->len);
+
+        memset(&editor, 0, sizeof(editor));
+        editor.buff = gtk_text_buffer_new(NULL);
+        editor.table = gtk_text_buffer_get_tag_table(editor.buff);
+        editor.misspelt = gtk_text_buffer_create_tag(editor.buff, "misspelt", "underline", PANGO_UNDERLINE_ERROR,
+                                                     NULL);
+        styles_create_tags(&editor);
+        fileio_exclude_tag(editor.misspelt);
+        gtk_text_buffer_set_text(editor.buff, text->str, text->len);
+
+        bench_spell_full(text, samples);
+
+        // the first pass tags the document, later ones only compare against the tag
+
+        spellview_attach_buffer(editor.buff, editor.misspelt);
+        wait_spellview();
+        bench_spell_recheck(&editor, samples);
+        bench_spell_incremental(&editor, rand, samples);
+        spellview_detach();
+
+        bench_format(&editor, text->len, samples);
+        bench_tagset(&editor, text->len, samples);
+
+        // let idle work queued by the formatting, such as collecting unused indent tags, finish with the buffer
+
+        while (g_main_context_iteration(NULL, FALSE))
+            ;
+
+        g_object_unref(editor.buff);
+        g_string_free(text, TRUE);
+    }
+
+    printf("\n  ]\n}\n");
+
+    g_array_free(samples, TRUE);
+    g_rand_free(rand);
+    spellcheck_deinit();
+
+    return 0;
+}
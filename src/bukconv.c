@@ -0,0 +1,35 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gtk/gtk.h>
+
+#include "fileio.h"
+
+// converts documents between the gtk tagset format and the native format, the output format follows the
+// extension of the output file, e.g.
+//     ./bukconv notes.txt notes.buk && ./bukconv notes.buk notes.txt
+
+int main(int argc, char **argv)
+{
+    GError *err = NULL;
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <input> <output>\n", argv[0]);
+        return 1;
+    }
+
+    if (!fileio_convert(argv[1], argv[2], &err))
+    {
+        fprintf(stderr, "failed to convert %s: %s\n", argv[1], err->message);
+        g_error_free(err);
+        return 1;
+    }
+
+    return 0;
+}
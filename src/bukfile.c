@@ -0,0 +1,575 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "bukfile.h"
+#include "debugmsg.h"
+
+// The native document format is a fixed header followed by sections, each found through an offset in the
+// header so a reader only touches the pages it needs. Tags and their attributes are stored as offsets into a
+// blob of nul terminated strings. A style is a list of tag indexes and a run is a byte range of the text blob
+// with one style applied. Everything is in host byte order, the byte order mark lets a file from another
+// machine be rejected rather than misread. Early files also carry an index of run and character counts, which
+// nothing reads, so it is no longer written and the header fields for it are left empty.
+//
+// Images are stored once each however often they appear, keyed by the hash of their encoded data, which is
+// kept as it was pasted and never decoded to be saved. Their encoded data sits in a section of its own
+// after the text, so opening a document only reads the image table. Each image in the text is a U+FFFC
+// character with an anchor entry giving its character offset and which image it shows. Version 1 files
+// have no images and a shorter header.
+
+#define BUKFILE_MAGIC "BUKDOC"
+#define BUKFILE_VERSION 2
+#define BUKFILE_BOM 0x01020304u
+
+typedef struct
+{
+    char magic[8];
+    uint32_t bom;
+    uint32_t version;
+    uint32_t tagCount;
+    uint32_t styleCount;
+    uint32_t styleTagCount;
+    uint32_t runCount;
+    uint32_t indexCount;
+    uint32_t reserved;
+    uint64_t tagsOffset;
+    uint64_t stylesOffset;
+    uint64_t styleTagsOffset;
+    uint64_t runsOffset;
+    uint64_t indexOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t textOffset;
+    uint64_t textSize;
+    uint64_t textChars;
+    uint32_t imageCount;
+    uint32_t anchorCount;
+    uint64_t imagesOffset;
+    uint64_t anchorsOffset;
+    uint64_t imageDataOffset;
+    uint64_t imageDataSize;
+} BukHeader;
+
+// the header as version 1 wrote it
+
+#define BUKFILE_V1_HEADER offsetof(BukHeader, imageCount)
+
+// attrs is the offset of the first of attrCount name, type, value triples, stored one after another
+
+typedef struct
+{
+    uint32_t name;
+    int32_t priority;
+    uint32_t attrs;
+    uint32_t attrCount;
+} BukTag;
+
+typedef struct
+{
+    uint32_t first;
+    uint32_t count;
+} BukStyle;
+
+typedef struct
+{
+    uint64_t offset;
+    uint32_t length;
+    uint32_t style;
+} BukRun;
+
+// hash is a string holding the hex sha256 of the encoded data, width and height are the image's own size
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+} BukImage;
+
+typedef struct
+{
+    uint64_t chars;
+    uint32_t image;
+    uint32_t reserved;
+} BukAnchor;
+
+// a file stays mapped while image data handed out from it is in use, so references are counted
+
+struct BukFile
+{
+    void *base;
+    size_t size;
+    gint refs;
+    BukHeader headerCopy;
+    const BukHeader *header;
+    const BukTag *tags;
+    const BukStyle *styles;
+    const uint32_t *styleTags;
+    const BukRun *runs;
+    const char *strings;
+    const char *text;
+    const BukImage *images;
+    const BukAnchor *anchors;
+    const char *imageData;
+};
+
+struct BukWriter
+{
+    GByteArray *tags;
+    GByteArray *styles;
+    GByteArray *styleTags;
+    GByteArray *runs;
+    GByteArray *strings;
+    GByteArray *text;
+    GByteArray *images;
+    GByteArray *anchors;
+    GByteArray *imageData;
+    GHashTable *imageIndex;
+    guint64 chars;
+};
+
+// returns true if data starts like a native document
+
+gboolean bukfile_sniff(const void *data, gsize len)
+{
+    return len >= sizeof(BUKFILE_MAGIC) && memcmp(data, BUKFILE_MAGIC, sizeof(BUKFILE_MAGIC)) == 0;
+}
+
+// true if a section of count entries of the given size lies inside the file
+
+static gboolean section_fits(uint64_t offset, uint64_t count, size_t size, size_t fileSize)
+{
+    return offset <= fileSize && count <= (fileSize - offset) / size;
+}
+
+// maps a native document and checks its sections lie inside the file. Runs are checked as they are read.
+
+BukFile *bukfile_open(const gchar *path, GError **err)
+{
+    BukFile *file;
+    struct stat st;
+    void *base;
+    BukHeader copy;
+    const BukHeader *header = &copy;
+    const uint32_t *styleTags;
+    guint i;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno), "%s: %s", path, g_strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    base = (size_t) st.st_size < BUKFILE_V1_HEADER ? MAP_FAILED
+        : mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+    {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is not a document", path);
+        return NULL;
+    }
+
+    // older headers are shorter, the fields they lack read as empty sections
+
+    memset(&copy, 0, sizeof(copy));
+    memcpy(&copy, base, BUKFILE_V1_HEADER);
+    if (copy.version >= 2 && (size_t) st.st_size >= sizeof(BukHeader))
+        memcpy(&copy, base, sizeof(BukHeader));
+
+    if (!bukfile_sniff(header->magic, sizeof(header->magic)) || header->bom != BUKFILE_BOM
+        || header->version < 1 || header->version > BUKFILE_VERSION
+        || (header->version >= 2 && (size_t) st.st_size < sizeof(BukHeader))
+        || !section_fits(header->tagsOffset, header->tagCount, sizeof(BukTag), st.st_size)
+        || !section_fits(header->stylesOffset, header->styleCount, sizeof(BukStyle), st.st_size)
+        || !section_fits(header->styleTagsOffset, header->styleTagCount, sizeof(uint32_t), st.st_size)
+        || !section_fits(header->runsOffset, header->runCount, sizeof(BukRun), st.st_size)
+        || !section_fits(header->stringsOffset, header->stringsSize, 1, st.st_size)
+        || !section_fits(header->textOffset, header->textSize, 1, st.st_size)
+        || !section_fits(header->imagesOffset, header->imageCount, sizeof(BukImage), st.st_size)
+        || !section_fits(header->anchorsOffset, header->anchorCount, sizeof(BukAnchor), st.st_size)
+        || !section_fits(header->imageDataOffset, header->imageDataSize, 1, st.st_size)
+        || (header->stringsSize && ((const char *) base)[header->stringsOffset + header->stringsSize - 1] != '\0'))
+    {
+        munmap(base, st.st_size);
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is not a document this version can read", path);
+        return NULL;
+    }
+
+    // styles and tags are few, so they are checked here and never again
+
+    styleTags = (const uint32_t *) ((const char *) base + header->styleTagsOffset);
+    for (i = 0; i < header->styleTagCount; i++)
+        if (styleTags[i] >= header->tagCount)
+            break;
+
+    if (i < header->styleTagCount)
+    {
+        munmap(base, st.st_size);
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is damaged", path);
+        return NULL;
+    }
+
+    file = g_new0(BukFile, 1);
+    file->base = base;
+    file->size = st.st_size;
+    file->refs = 1;
+    file->headerCopy = copy;
+    file->header = &file->headerCopy;
+    file->tags = (const BukTag *) ((const char *) base + header->tagsOffset);
+    file->styles = (const BukStyle *) ((const char *) base + header->stylesOffset);
+    file->styleTags = styleTags;
+    file->runs = (const BukRun *) ((const char *) base + header->runsOffset);
+    file->strings = (const char *) base + header->stringsOffset;
+    file->text = (const char *) base + header->textOffset;
+    file->images = (const BukImage *) ((const char *) base + header->imagesOffset);
+    file->anchors = (const BukAnchor *) ((const char *) base + header->anchorsOffset);
+    file->imageData = (const char *) base + header->imageDataOffset;
+
+    return file;
+}
+
+// drops a reference to a native document, unmapping it once no image data from it is in use either. Image
+// data may be released on any thread.
+
+void bukfile_close(BukFile *file)
+{
+    if (!file || !g_atomic_int_dec_and_test(&file->refs))
+        return;
+
+    munmap(file->base, file->size);
+    g_free(file);
+}
+
+guint bukfile_tag_count(BukFile *file)
+{
+    return file->header->tagCount;
+}
+
+// returns the string at an offset into the blob, or NULL if it lies outside it
+
+static const gchar *string_at(BukFile *file, uint64_t offset)
+{
+    return offset < file->header->stringsSize ? file->strings + offset : NULL;
+}
+
+// returns the name of a tag and adds its attribute triples to attrs, which does not own them. NULL means
+// the tag is damaged.
+
+const gchar *bukfile_tag(BukFile *file, guint index, gint *priority, GPtrArray *attrs)
+{
+    const BukTag *tag = &file->tags[index];
+    uint64_t offset = tag->attrs;
+    guint i;
+
+    for (i = 0; i < tag->attrCount * 3; i++)
+    {
+        const gchar *field = string_at(file, offset);
+
+        if (!field)
+            return NULL;
+
+        g_ptr_array_add(attrs, (gpointer) field);
+        offset += strlen(field) + 1;
+    }
+
+    *priority = tag->priority;
+
+    return string_at(file, tag->name);
+}
+
+// returns the tag indexes making up a style, or NULL if the style is damaged
+
+const guint32 *bukfile_style(BukFile *file, guint index, guint *count)
+{
+    const BukStyle *style = &file->styles[index];
+
+    if (style->first > file->header->styleTagCount || style->count > file->header->styleTagCount - style->first)
+        return NULL;
+
+    *count = style->count;
+
+    return file->styleTags + style->first;
+}
+
+guint bukfile_run_count(BukFile *file)
+{
+    return file->header->runCount;
+}
+
+// returns the text of a run, which is not nul terminated, or NULL if the run is damaged
+
+const gchar *bukfile_run(BukFile *file, guint index, gsize *len, guint *style)
+{
+    const BukRun *run = &file->runs[index];
+
+    if (run->offset > file->header->textSize || run->length > file->header->textSize - run->offset
+        || run->style >= file->header->styleCount)
+        return NULL;
+
+    *len = run->length;
+    *style = run->style;
+
+    return file->text + run->offset;
+}
+
+guint bukfile_image_count(BukFile *file)
+{
+    return file->header->imageCount;
+}
+
+// returns the hash of an image and its size, or NULL if the image is damaged. Nothing of the encoded data
+// is read.
+
+const gchar *bukfile_image(BukFile *file, guint index, gint *width, gint *height)
+{
+    const BukImage *image = &file->images[index];
+
+    if (image->offset > file->header->imageDataSize || image->size > file->header->imageDataSize - image->offset
+        || image->width > G_MAXINT || image->height > G_MAXINT)
+        return NULL;
+
+    *width = image->width;
+    *height = image->height;
+
+    return string_at(file, image->hash);
+}
+
+// returns the encoded data of an image, still in the mapped file, which stays mapped until it is released
+
+GBytes *bukfile_image_data(BukFile *file, guint index)
+{
+    const BukImage *image = &file->images[index];
+
+    g_atomic_int_inc(&file->refs);
+
+    return g_bytes_new_with_free_func(file->imageData + image->offset, image->size, (GDestroyNotify) bukfile_close,
+                                      file);
+}
+
+guint bukfile_anchor_count(BukFile *file)
+{
+    return file->header->anchorCount;
+}
+
+// returns the character offset of an anchor and the image it shows, false if it is damaged
+
+gboolean bukfile_anchor(BukFile *file, guint index, guint64 *chars, guint *image)
+{
+    const BukAnchor *anchor = &file->anchors[index];
+
+    if (anchor->image >= file->header->imageCount)
+        return FALSE;
+
+    *chars = anchor->chars;
+    *image = anchor->image;
+
+    return TRUE;
+}
+
+// starts building a native document in memory
+
+BukWriter *bukwriter_new(void)
+{
+    BukWriter *writer = g_new0(BukWriter, 1);
+
+    writer->tags = g_byte_array_new();
+    writer->styles = g_byte_array_new();
+    writer->styleTags = g_byte_array_new();
+    writer->runs = g_byte_array_new();
+    writer->strings = g_byte_array_new();
+    writer->text = g_byte_array_new();
+    writer->images = g_byte_array_new();
+    writer->anchors = g_byte_array_new();
+    writer->imageData = g_byte_array_new();
+    writer->imageIndex = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    return writer;
+}
+
+// copies a nul terminated string into the blob and returns its offset
+
+static uint32_t add_string(BukWriter *writer, const gchar *str)
+{
+    uint32_t offset = writer->strings->len;
+
+    g_byte_array_append(writer->strings, (const guint8 *) str, strlen(str) + 1);
+
+    return offset;
+}
+
+// adds a tag with its name, type, value attribute triples. Tags are numbered in the order they are added.
+
+void bukwriter_add_tag(BukWriter *writer, const gchar *name, gint priority, GPtrArray *attrs)
+{
+    BukTag tag;
+    guint i;
+
+    tag.name = add_string(writer, name);
+    tag.priority = priority;
+    tag.attrs = writer->strings->len;
+    tag.attrCount = attrs->len / 3;
+
+    for (i = 0; i < tag.attrCount * 3; i++)
+        add_string(writer, g_ptr_array_index(attrs, i));
+
+    g_byte_array_append(writer->tags, (const guint8 *) &tag, sizeof(tag));
+}
+
+// adds a style made of the given tags. Styles are numbered in the order they are added.
+
+void bukwriter_add_style(BukWriter *writer, const guint32 *tags, guint count)
+{
+    BukStyle style;
+
+    style.first = writer->styleTags->len / sizeof(uint32_t);
+    style.count = count;
+
+    g_byte_array_append(writer->styleTags, (const guint8 *) tags, count * sizeof(uint32_t));
+    g_byte_array_append(writer->styles, (const guint8 *) &style, sizeof(style));
+}
+
+// appends text with one style to the document
+
+void bukwriter_add_run(BukWriter *writer, const gchar *text, gsize len, guint style)
+{
+    BukRun run;
+
+    // runs are limited to what the length field can hold
+
+    while (len > G_MAXUINT32)
+    {
+        const gchar *split = g_utf8_find_prev_char(text, text + G_MAXUINT32);
+
+        bukwriter_add_run(writer, text, split - text, style);
+        len -= split - text;
+        text = split;
+    }
+
+    run.offset = writer->text->len;
+    run.length = len;
+    run.style = style;
+
+    g_byte_array_append(writer->runs, (const guint8 *) &run, sizeof(run));
+    g_byte_array_append(writer->text, (const guint8 *) text, len);
+    writer->chars += g_utf8_strlen(text, len);
+}
+
+// adds an image and returns its index. An image with the same hash as one already added is not stored again.
+
+guint bukwriter_add_image(BukWriter *writer, const gchar *hash, gint width, gint height, GBytes *data)
+{
+    BukImage image = { 0 };
+    gpointer found;
+    gconstpointer bytes;
+    gsize size;
+    guint index;
+
+    if (g_hash_table_lookup_extended(writer->imageIndex, hash, NULL, &found))
+        return GPOINTER_TO_UINT(found);
+
+    bytes = g_bytes_get_data(data, &size);
+
+    image.hash = add_string(writer, hash);
+    image.width = width;
+    image.height = height;
+    image.offset = writer->imageData->len;
+    image.size = size;
+
+    index = writer->images->len / sizeof(image);
+    g_byte_array_append(writer->imageData, bytes, size);
+    g_byte_array_append(writer->images, (const guint8 *) &image, sizeof(image));
+    g_hash_table_insert(writer->imageIndex, g_strdup(hash), GUINT_TO_POINTER(index));
+
+    return index;
+}
+
+// anchors an image at the end of the text added so far, the caller adds the U+FFFC standing for it next
+
+void bukwriter_add_anchor(BukWriter *writer, guint image)
+{
+    BukAnchor anchor = { 0 };
+
+    anchor.chars = writer->chars;
+    anchor.image = image;
+
+    g_byte_array_append(writer->anchors, (const guint8 *) &anchor, sizeof(anchor));
+}
+
+// appends a section, padded so the one after it is aligned for the structures it holds
+
+static uint64_t add_section(GByteArray *out, GByteArray *section)
+{
+    static const guint8 zeros[8] = { 0 };
+    uint64_t offset;
+
+    if (out->len % 8)
+        g_byte_array_append(out, zeros, 8 - out->len % 8);
+
+    offset = out->len;
+    g_byte_array_append(out, section->data, section->len);
+    g_byte_array_unref(section);
+
+    return offset;
+}
+
+// lays out the finished document and frees the writer
+
+GBytes *bukwriter_finish(BukWriter *writer)
+{
+    GByteArray *out = g_byte_array_sized_new(sizeof(BukHeader) + writer->text->len + writer->runs->len
+                                             + writer->imageData->len + 256);
+    BukHeader header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUKFILE_MAGIC, sizeof(BUKFILE_MAGIC));
+    header.bom = BUKFILE_BOM;
+    header.version = BUKFILE_VERSION;
+    header.tagCount = writer->tags->len / sizeof(BukTag);
+    header.styleCount = writer->styles->len / sizeof(BukStyle);
+    header.styleTagCount = writer->styleTags->len / sizeof(uint32_t);
+    header.runCount = writer->runs->len / sizeof(BukRun);
+    header.stringsSize = writer->strings->len;
+    header.textSize = writer->text->len;
+    header.textChars = writer->chars;
+    header.imageCount = writer->images->len / sizeof(BukImage);
+    header.anchorCount = writer->anchors->len / sizeof(BukAnchor);
+    header.imageDataSize = writer->imageData->len;
+
+    g_byte_array_append(out, (const guint8 *) &header, sizeof(header));
+    header.tagsOffset = add_section(out, writer->tags);
+    header.stylesOffset = add_section(out, writer->styles);
+    header.styleTagsOffset = add_section(out, writer->styleTags);
+    header.runsOffset = add_section(out, writer->runs);
+    header.stringsOffset = add_section(out, writer->strings);
+    header.textOffset = add_section(out, writer->text);
+    header.imagesOffset = add_section(out, writer->images);
+    header.anchorsOffset = add_section(out, writer->anchors);
+    header.imageDataOffset = add_section(out, writer->imageData);
+    memcpy(out->data, &header, sizeof(header));
+
+    g_hash_table_unref(writer->imageIndex);
+    g_free(writer);
+
+    return g_byte_array_free_to_bytes(out);
+}
@@ -0,0 +1,42 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dictmap.h"
+
+// compiles an expanded word list into the memory mapped dictionary format read by the spellchecker, e.g.
+//     unmunch en_US.dic en_US.aff > words.txt && ./dictc words.txt ../res/hunspell-en_US/en_US.bdic
+
+int main(int argc, char **argv)
+{
+    DictMap *map;
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <wordlist> <output.bdic>\n", argv[0]);
+        return 1;
+    }
+
+    if (!dictmap_compile(argv[1], argv[2]))
+    {
+        fprintf(stderr, "failed to compile %s\n", argv[1]);
+        return 1;
+    }
+
+    map = dictmap_open(argv[2]);
+    if (!map)
+    {
+        fprintf(stderr, "failed to read back %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("%zu words written to %s\n", dictmap_count(map), argv[2]);
+    dictmap_close(map);
+
+    return 0;
+}
@@ -0,0 +1,326 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dictmap.h"
+#include "debugmsg.h"
+
+// The compiled format is a fixed header, an open addressed hash table of slots and a blob of length prefixed
+// words. Everything is stored in host byte order, the byte order mark lets a file from another machine be
+// rejected rather than misread.
+
+#define DICTMAP_MAGIC "BUKDICT"
+#define DICTMAP_VERSION 1
+#define DICTMAP_BOM 0x01020304u
+
+// words are stored with a one byte length, longer entries are dropped when compiling
+
+#define DICTMAP_MAX_WORD 255
+
+typedef struct
+{
+    char magic[8];
+    uint32_t bom;
+    uint32_t version;
+    uint32_t wordCount;
+    uint32_t slotCount;
+    uint64_t slotsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+} DictHeader;
+
+// a slot holds the hash of its word, so most misses never touch the string pages. An offset of zero marks an
+// empty slot, so word offsets are stored plus one.
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t offset;
+} DictSlot;
+
+struct DictMap
+{
+    void *base;
+    size_t size;
+    const DictHeader *header;
+    const DictSlot *slots;
+    const unsigned char *strings;
+};
+
+// FNV-1a, the same hash has to be used by the compiler and the lookup
+
+static uint32_t hash_word(const char *word, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char) word[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// maps a compiled dictionary, returns NULL if the file is missing or is not a dictionary this build can read
+
+DictMap *dictmap_open(const char *path)
+{
+    DictMap *map;
+    struct stat st;
+    void *base;
+    const DictHeader *header;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(DictHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // a shared read only mapping, so every editor process on the machine uses the same pages
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+        return NULL;
+
+    header = base;
+
+    if (memcmp(header->magic, DICTMAP_MAGIC, sizeof(DICTMAP_MAGIC)) != 0 || header->bom != DICTMAP_BOM
+        || header->version != DICTMAP_VERSION || header->slotCount == 0
+        || (header->slotCount & (header->slotCount - 1)) != 0 || header->wordCount >= header->slotCount
+        || header->slotsOffset + (uint64_t) header->slotCount * sizeof(DictSlot) > (uint64_t) st.st_size
+        || header->stringsOffset + header->stringsSize > (uint64_t) st.st_size)
+    {
+        DEB("%s is not a usable compiled dictionary\n", path);
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    map = malloc(sizeof(DictMap));
+    if (!map)
+    {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    map->base = base;
+    map->size = st.st_size;
+    map->header = header;
+    map->slots = (const DictSlot *) ((const char *) base + header->slotsOffset);
+    map->strings = (const unsigned char *) base + header->stringsOffset;
+
+    return map;
+}
+
+// unmaps a compiled dictionary
+
+void dictmap_close(DictMap *map)
+{
+    if (!map)
+        return;
+
+    munmap(map->base, map->size);
+    free(map);
+}
+
+// returns true if the word is in the list exactly as given
+
+bool dictmap_contains(const DictMap *map, const char *word, size_t len)
+{
+    uint32_t mask = map->header->slotCount - 1;
+    uint32_t hash = hash_word(word, len);
+    uint32_t i = hash & mask, probes;
+
+    // a damaged file could have every slot full, so give up once each has been looked at
+
+    for (probes = 0; probes <= mask && map->slots[i].offset; probes++)
+    {
+        const DictSlot *slot = &map->slots[i];
+
+        if (slot->hash == hash && slot->offset - 1 < map->header->stringsSize)
+        {
+            const unsigned char *entry = map->strings + slot->offset - 1;
+
+            if (entry[0] == len && slot->offset + len <= map->header->stringsSize
+                && memcmp(entry + 1, word, len) == 0)
+                return true;
+        }
+
+        i = (i + 1) & mask;
+    }
+
+    return false;
+}
+
+// returns the number of words in a compiled dictionary
+
+size_t dictmap_count(const DictMap *map)
+{
+    return map->header->wordCount;
+}
+
+// reads a whole file into memory, the result is nul terminated
+
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "rb");
+    char *data = NULL;
+    long size;
+
+    if (!file)
+        return NULL;
+
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        data = malloc(size + 1);
+        if (data && fread(data, 1, size, file) == (size_t) size)
+        {
+            data[size] = '\0';
+            *len = size;
+        }
+        else
+        {
+            free(data);
+            data = NULL;
+        }
+    }
+
+    fclose(file);
+
+    return data;
+}
+
+// compiles a word list into the mapped format. The list has one word per line, as produced by expanding a
+// hunspell dictionary with unmunch. Hunspell affix flags after a '/' are ignored, as is a leading word count,
+// so a plain .dic file is accepted too. The output is written next to path and renamed into place.
+
+bool dictmap_compile(const char *wordlist, const char *path)
+{
+    size_t len, lines = 0, i;
+    char *text = read_file(wordlist, &len);
+    DictHeader header;
+    DictSlot *slots;
+    unsigned char *strings;
+    uint32_t slotCount = 16, wordCount = 0;
+    size_t stringsSize = 0;
+    char *line, *save = NULL;
+    bool ret = false;
+
+    if (!text)
+        return false;
+
+    for (i = 0; i < len; i++)
+        if (text[i] == '\n')
+            lines++;
+
+    // keep the table at most half full
+
+    while (slotCount < 2 * (lines + 1))
+        slotCount *= 2;
+
+    slots = calloc(slotCount, sizeof(DictSlot));
+    strings = malloc(len + lines + 1);
+
+    if (!slots || !strings)
+        goto out;
+
+    for (line = strtok_r(text, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save))
+    {
+        size_t wlen = strcspn(line, "/ \t");
+        uint32_t hash, mask = slotCount - 1, s;
+        bool dupe = false;
+
+        if (wlen == 0 || wlen > DICTMAP_MAX_WORD)
+            continue;
+
+        // hunspell .dic files open with the number of entries
+
+        if (wordCount == 0 && strspn(line, "0123456789") == wlen)
+            continue;
+
+        hash = hash_word(line, wlen);
+        for (s = hash & mask; slots[s].offset; s = (s + 1) & mask)
+        {
+            const unsigned char *entry = strings + slots[s].offset - 1;
+
+            if (slots[s].hash == hash && entry[0] == wlen && memcmp(entry + 1, line, wlen) == 0)
+            {
+                dupe = true;
+                break;
+            }
+        }
+
+        if (dupe)
+            continue;
+
+        slots[s].hash = hash;
+        slots[s].offset = stringsSize + 1;
+        strings[stringsSize] = wlen;
+        memcpy(strings + stringsSize + 1, line, wlen);
+        stringsSize += wlen + 1;
+        wordCount++;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DICTMAP_MAGIC, sizeof(DICTMAP_MAGIC));
+    header.bom = DICTMAP_BOM;
+    header.version = DICTMAP_VERSION;
+    header.wordCount = wordCount;
+    header.slotCount = slotCount;
+    header.slotsOffset = sizeof(DictHeader);
+    header.stringsOffset = header.slotsOffset + (uint64_t) slotCount * sizeof(DictSlot);
+    header.stringsSize = stringsSize;
+
+    {
+        size_t tmplen = strlen(path) + 5;
+        char *tmp = malloc(tmplen);
+        FILE *out;
+
+        if (!tmp)
+            goto out;
+
+        snprintf(tmp, tmplen, "%s.tmp", path);
+        out = fopen(tmp, "wb");
+
+        if (out)
+        {
+            ret = fwrite(&header, sizeof(header), 1, out) == 1
+                && fwrite(slots, sizeof(DictSlot), slotCount, out) == slotCount
+                && fwrite(strings, 1, stringsSize, out) == stringsSize;
+            ret = (fclose(out) == 0) && ret;
+
+            if (ret)
+                ret = (rename(tmp, path) == 0);
+            else
+                remove(tmp);
+        }
+
+        free(tmp);
+    }
+
+out:
+    free(slots);
+    free(strings);
+    free(text);
+
+    return ret;
+}
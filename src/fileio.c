@@ -0,0 +1,1664 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <gtk/gtk.h>
+#include <stdbool.h>
+
+#include "fileio.h"
+#include "bukfile.h"
+#include "debugmsg.h"
+#include "trace.h"
+
+// files are read this many bytes at a time on the loading thread
+
+#define FILEIO_CHUNK_BYTES 65536
+
+// parsed text is handed to the main loop in batches of about this many bytes, small enough that the first
+// batch fills the screen almost at once
+
+#define FILEIO_BATCH_BYTES 16384
+
+// the main loop spends at most this long inserting per idle callback, so the editor stays responsive
+
+#define FILEIO_INSERT_US 8000
+
+// the serialisation header gtk writes in front of the tagset markup, followed by a big endian length
+
+#define FILEIO_TAGSET_MAGIC "GTKTEXTBUFFERCONTENTS-0001"
+#define FILEIO_TAGSET_HEADER (sizeof(FILEIO_TAGSET_MAGIC) - 1 + 4)
+
+// one piece of parsed document. Runs carry text and the names of the tags applied to it, definitions carry
+// the name of a tag and its attributes as name, type, value triples. A run with an image is the U+FFFC
+// placeholder the image is shown at.
+
+typedef struct
+{
+    GString *text;
+    gchar *name;
+    GPtrArray *names;
+    FileioImage *image;
+} LoadItem;
+
+// a group of items handed from the loading thread to the main loop. The final batch of a load has finished set.
+
+typedef struct
+{
+    GPtrArray *items;
+    gdouble progress;
+    gboolean finished;
+    gchar *error;
+} LoadBatch;
+
+// state of the markup parser, only touched by the loading thread
+
+typedef struct
+{
+    GPtrArray *tagStack;
+    gboolean inText;
+    LoadItem *run;
+    LoadItem *def;
+    LoadBatch *batch;
+    gsize batchBytes;
+} ParseState;
+
+typedef struct
+{
+    GtkTextBuffer *buff;
+    GtkTextMark *insert;
+    gchar *path;
+    GCancellable *cancel;
+    GAsyncQueue *batches;
+    gint notifyPending;
+    gdouble progress;
+    ParseState parse;
+
+    // the batch being inserted, and how far through it the main loop has got
+
+    LoadBatch *current;
+    guint index;
+
+    // both the last batch and the thread have to finish before the state can go
+
+    gboolean inserted;
+    gboolean threadDone;
+
+    FileioProgressFunc progressFunc;
+    FileioDoneFunc doneFunc;
+    gpointer data;
+} LoadState;
+
+static LoadState *loading;
+
+// set while a load is changing the buffer, so edit tracking can tell file contents from user edits
+
+static gboolean inserting;
+
+// a tag as it will be written out, captured on the main thread so the saving thread never touches gtk
+
+typedef struct
+{
+    gchar *name;
+    gint priority;
+    GPtrArray *attrs;
+} SaveTag;
+
+// a stretch of text with the same tags applied, style indexes the list of tag sets in the snapshot
+
+typedef struct
+{
+    gint offset;
+    gint length;
+    guint style;
+} SaveRun;
+
+// an image to save and the character offset of its placeholder
+
+typedef struct
+{
+    gint offset;
+    FileioImage image;
+} SaveImage;
+
+// everything the saving thread needs to serialise a buffer. Styles are arrays of indexes into tags, in
+// priority order, so runs sharing the same tags share one entry. Images are in the order they appear.
+
+typedef struct
+{
+    gchar *path;
+    gchar *text;
+    GArray *runs;
+    GPtrArray *styles;
+    GPtrArray *tags;
+    GArray *images;
+    FileioDoneFunc doneFunc;
+    gpointer data;
+} SaveState;
+
+// tags which only describe editor state, such as misspellings, and are never saved
+
+static GPtrArray *excludedTags;
+
+// where images loaded from documents go and where saves find them, unset when nothing shows images
+
+static FileioImagePlaceFunc placeImage;
+static FileioImageFindFunc findImage;
+
+static gboolean insert_batches(gpointer data);
+
+static void free_image(FileioImage *image)
+{
+    g_free(image->hash);
+    if (image->data)
+        g_bytes_unref(image->data);
+}
+
+// frees an item of either kind
+
+static void free_item(gpointer data)
+{
+    LoadItem *item = data;
+
+    if (item->text)
+        g_string_free(item->text, TRUE);
+    if (item->image)
+    {
+        free_image(item->image);
+        g_free(item->image);
+    }
+    g_free(item->name);
+    g_ptr_array_unref(item->names);
+    g_free(item);
+}
+
+static LoadBatch *new_batch(void)
+{
+    LoadBatch *batch = g_new0(LoadBatch, 1);
+
+    batch->items = g_ptr_array_new_with_free_func(free_item);
+
+    return batch;
+}
+
+static void free_batch(LoadBatch *batch)
+{
+    g_ptr_array_unref(batch->items);
+    g_free(batch->error);
+    g_free(batch);
+}
+
+// hands a batch to the main loop, only one idle callback is queued at a time to insert everything waiting
+
+static void push_batch(LoadState *state, LoadBatch *batch)
+{
+    batch->progress = state->progress;
+    g_async_queue_push(state->batches, batch);
+
+    // conversions read into the queue without a buffer to insert into
+
+    if (state->buff && g_atomic_int_compare_and_exchange(&state->notifyPending, 0, 1))
+        g_idle_add(insert_batches, state);
+}
+
+// adds an item to the batch being built and sends the batch on once it is big enough
+
+static void add_item(LoadState *state, LoadItem *item, gsize bytes)
+{
+    ParseState *parse = &state->parse;
+
+    if (!parse->batch)
+        parse->batch = new_batch();
+
+    g_ptr_array_add(parse->batch->items, item);
+    parse->batchBytes += bytes;
+
+    if (parse->batchBytes >= FILEIO_BATCH_BYTES)
+    {
+        push_batch(state, parse->batch);
+        parse->batch = NULL;
+        parse->batchBytes = 0;
+    }
+}
+
+// ends the current run of text, called whenever the set of applied tags changes
+
+static void flush_run(LoadState *state)
+{
+    LoadItem *run = state->parse.run;
+
+    state->parse.run = NULL;
+
+    if (run)
+        add_item(state, run, run->text->len);
+}
+
+// appends text to the current run, starting a new run carrying the open tags if there is none
+
+static void add_text(LoadState *state, const gchar *text, gsize len)
+{
+    ParseState *parse = &state->parse;
+
+    if (!parse->run)
+    {
+        guint i;
+
+        parse->run = g_new0(LoadItem, 1);
+        parse->run->text = g_string_sized_new(len);
+        parse->run->names = g_ptr_array_new_with_free_func(g_free);
+
+        for (i = 0; i < parse->tagStack->len; i++)
+        {
+            const gchar *name = g_ptr_array_index(parse->tagStack, i);
+
+            if (name)
+                g_ptr_array_add(parse->run->names, g_strdup(name));
+        }
+    }
+
+    g_string_append_len(parse->run->text, text, len);
+
+    if (parse->run->text->len >= FILEIO_BATCH_BYTES)
+        flush_run(state);
+}
+
+// returns the value of a named attribute of a markup element, or NULL
+
+static const gchar *find_attr(const gchar **names, const gchar **values, const gchar *name)
+{
+    guint i;
+
+    for (i = 0; names[i]; i++)
+        if (strcmp(names[i], name) == 0)
+            return values[i];
+
+    return NULL;
+}
+
+static void markup_start(GMarkupParseContext *ctx, const gchar *element, const gchar **names,
+                         const gchar **values, gpointer data, GError **error)
+{
+    LoadState *state = data;
+    ParseState *parse = &state->parse;
+
+    if (strcmp(element, "tag") == 0)
+    {
+        const gchar *name = find_attr(names, values, "name");
+
+        // anonymous tags have no name to look up, their text is loaded without them
+
+        if (name)
+        {
+            parse->def = g_new0(LoadItem, 1);
+            parse->def->name = g_strdup(name);
+            parse->def->names = g_ptr_array_new_with_free_func(g_free);
+        }
+    }
+    else if (strcmp(element, "attr") == 0 && parse->def)
+    {
+        const gchar *name = find_attr(names, values, "name");
+        const gchar *type = find_attr(names, values, "type");
+        const gchar *value = find_attr(names, values, "value");
+
+        if (name && type && value)
+        {
+            g_ptr_array_add(parse->def->names, g_strdup(name));
+            g_ptr_array_add(parse->def->names, g_strdup(type));
+            g_ptr_array_add(parse->def->names, g_strdup(value));
+        }
+    }
+    else if (strcmp(element, "text") == 0)
+        parse->inText = TRUE;
+    else if (strcmp(element, "apply_tag") == 0)
+    {
+        flush_run(state);
+        g_ptr_array_add(parse->tagStack, g_strdup(find_attr(names, values, "name")));
+    }
+}
+
+static void markup_end(GMarkupParseContext *ctx, const gchar *element, gpointer data, GError **error)
+{
+    LoadState *state = data;
+    ParseState *parse = &state->parse;
+
+    if (strcmp(element, "tag") == 0 && parse->def)
+    {
+        add_item(state, parse->def, 0);
+        parse->def = NULL;
+    }
+    else if (strcmp(element, "text") == 0)
+    {
+        flush_run(state);
+        parse->inText = FALSE;
+    }
+    else if (strcmp(element, "apply_tag") == 0 && parse->tagStack->len)
+    {
+        flush_run(state);
+        g_ptr_array_remove_index(parse->tagStack, parse->tagStack->len - 1);
+    }
+}
+
+static void markup_text(GMarkupParseContext *ctx, const gchar *text, gsize len, gpointer data, GError **error)
+{
+    LoadState *state = data;
+
+    if (state->parse.inText)
+        add_text(state, text, len);
+}
+
+static const GMarkupParser tagsetParser = { markup_start, markup_end, markup_text, NULL, NULL };
+
+// returns the length of the longest prefix of a chunk which ends on a whole utf-8 character
+
+static gsize complete_utf8(const gchar *text, gsize len)
+{
+    gsize back;
+
+    for (back = 1; back <= 4 && back <= len; back++)
+    {
+        guchar c = text[len - back];
+
+        if (c < 0x80)
+            return len;
+
+        if ((c & 0xc0) == 0xc0)
+        {
+            gsize need = (c & 0xe0) == 0xc0 ? 2 : (c & 0xf0) == 0xe0 ? 3 : 4;
+
+            return need > back ? len - back : len;
+        }
+    }
+
+    return len;
+}
+
+// adds a chunk of a plain text file, invalid utf-8 is replaced rather than rejecting the whole file
+
+static void add_plain_text(LoadState *state, const gchar *text, gsize len)
+{
+    if (g_utf8_validate(text, len, NULL))
+        add_text(state, text, len);
+    else
+    {
+        gchar *valid = g_utf8_make_valid(text, len);
+        add_text(state, valid, strlen(valid));
+        g_free(valid);
+    }
+}
+
+// returns the first U+FFFC placeholder for an embedded object in a stretch of text, or NULL
+
+static const gchar *find_object(const gchar *text, gsize len)
+{
+    const gchar *end = text + len, *obj;
+
+    while ((obj = memchr(text, 0xef, end - text)))
+    {
+        // U+FFFC is the three bytes ef bf bc, other characters starting with ef are kept
+
+        if (obj + 3 <= end && (guchar) obj[1] == 0xbf && (guchar) obj[2] == 0xbc)
+            return obj;
+
+        text = obj + 1;
+    }
+
+    return NULL;
+}
+
+// returns the image anchored at a character offset of a native document, or NULL. Anchors are in order, so
+// the next one to look at is kept in anchor and any pointing behind the offset are skipped. Only the image
+// table is read, the encoded data stays in the mapped file until the image is shown.
+
+static FileioImage *anchored_image(BukFile *file, guint *anchor, guint64 chars)
+{
+    FileioImage *image;
+    const gchar *hash;
+    guint64 at;
+    guint index;
+    gint width, height;
+
+    while (*anchor < bukfile_anchor_count(file))
+    {
+        if (!bukfile_anchor(file, *anchor, &at, &index) || at < chars)
+        {
+            (*anchor)++;
+            continue;
+        }
+
+        if (at > chars)
+            return NULL;
+
+        (*anchor)++;
+
+        hash = bukfile_image(file, index, &width, &height);
+        if (!hash)
+            return NULL;
+
+        image = g_new0(FileioImage, 1);
+        image->hash = g_strdup(hash);
+        image->width = width;
+        image->height = height;
+        image->data = bukfile_image_data(file, index);
+
+        return image;
+    }
+
+    return NULL;
+}
+
+// reads a native document. Tags come first, then the runs in order, so the first screen is sent to the main
+// loop having read only the pages it lives in. Long runs are split so no batch is too big to insert at once,
+// and at each image so it arrives as an item of its own.
+
+static void load_native(LoadState *state, GCancellable *cancel, GError **err)
+{
+    BukFile *file = bukfile_open(state->path, err);
+    GPtrArray *tagNames;
+    guint i, runs, anchor = 0;
+    guint64 chars = 0;
+
+    if (!file)
+        return;
+
+    tagNames = g_ptr_array_new();
+
+    for (i = 0; i < bukfile_tag_count(file); i++)
+    {
+        GPtrArray *attrs = g_ptr_array_new();
+        LoadItem *def;
+        const gchar *name;
+        gint priority;
+        guint j;
+
+        name = bukfile_tag(file, i, &priority, attrs);
+        if (!name)
+        {
+            g_ptr_array_unref(attrs);
+            break;
+        }
+
+        def = g_new0(LoadItem, 1);
+        def->name = g_strdup(name);
+        def->names = g_ptr_array_new_full(attrs->len, g_free);
+        for (j = 0; j < attrs->len; j++)
+            g_ptr_array_add(def->names, g_strdup(g_ptr_array_index(attrs, j)));
+
+        add_item(state, def, 0);
+        g_ptr_array_add(tagNames, (gpointer) name);
+        g_ptr_array_unref(attrs);
+    }
+
+    runs = bukfile_run_count(file);
+
+    for (i = 0; i < runs && tagNames->len == bukfile_tag_count(file); i++)
+    {
+        gsize len;
+        guint style, count, j;
+        const gchar *text = bukfile_run(file, i, &len, &style);
+        const guint32 *tags = text ? bukfile_style(file, style, &count) : NULL;
+
+        if (!tags || !g_utf8_validate(text, len, NULL))
+            break;
+
+        if (g_cancellable_is_cancelled(cancel))
+            break;
+
+        while (len)
+        {
+            gsize piece = len > FILEIO_BATCH_BYTES ? complete_utf8(text, FILEIO_BATCH_BYTES) : len;
+            gboolean images = anchor < bukfile_anchor_count(file);
+            const gchar *obj = images ? find_object(text, piece) : NULL;
+            LoadItem *run = g_new0(LoadItem, 1);
+
+            // a placeholder without an anchor is kept as plain text
+
+            if (obj == text)
+            {
+                piece = 3;
+                run->image = anchored_image(file, &anchor, chars);
+            }
+            else if (obj)
+                piece = obj - text;
+
+            if (images)
+                chars += g_utf8_strlen(text, piece);
+
+            run->text = g_string_new_len(text, piece);
+            run->names = g_ptr_array_new_full(count, g_free);
+            for (j = 0; j < count; j++)
+                g_ptr_array_add(run->names, g_strdup(g_ptr_array_index(tagNames, tags[j])));
+
+            state->progress = (i + 1.0) / runs;
+            add_item(state, run, piece);
+            text += piece;
+            len -= piece;
+        }
+    }
+
+    if (!g_cancellable_is_cancelled(cancel) && (i < runs || tagNames->len < bukfile_tag_count(file)))
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is damaged", state->path);
+
+    g_ptr_array_unref(tagNames);
+    bukfile_close(file);
+}
+
+// reads a document into batches. Native documents are mapped, tagset files are fed through an incremental
+// markup parser and anything else is loaded as plain text. The last batch pushed has finished set.
+
+static void read_document(LoadState *state, GCancellable *cancel)
+{
+    GFile *file = g_file_new_for_path(state->path);
+    GError *err = NULL;
+    GFileInputStream *stream = g_file_read(file, cancel, &err);
+    GMarkupParseContext *ctx = NULL;
+    gchar *buf = g_malloc(FILEIO_CHUNK_BYTES);
+    gsize have = 0, carry = 0;
+    guint64 total = 0, done = 0, markupLeft = 0;
+    gboolean sniffed = FALSE, tagset = FALSE, native = FALSE;
+    LoadBatch *last;
+
+    if (stream)
+    {
+        GFileInfo *info = g_file_input_stream_query_info(stream, G_FILE_ATTRIBUTE_STANDARD_SIZE, cancel, NULL);
+
+        if (info)
+        {
+            total = g_file_info_get_size(info);
+            g_object_unref(info);
+        }
+    }
+
+    while (stream && !err)
+    {
+        gssize got = g_input_stream_read(G_INPUT_STREAM(stream), buf + have, FILEIO_CHUNK_BYTES - have, cancel,
+                                         &err);
+        gchar *p = buf;
+
+        if (got <= 0)
+            break;
+
+        have += got;
+        done += got;
+        state->progress = total ? (gdouble) done / total : 0;
+
+        // the first chunk decides whether this is gtk tagset markup or plain text
+
+        if (!sniffed)
+        {
+            if (have < FILEIO_TAGSET_HEADER && (guint64) have < total)
+                continue;
+
+            sniffed = TRUE;
+
+            native = bukfile_sniff(buf, have);
+            if (native)
+            {
+                load_native(state, cancel, &err);
+                break;
+            }
+
+            tagset = have >= FILEIO_TAGSET_HEADER
+                && memcmp(buf, FILEIO_TAGSET_MAGIC, FILEIO_TAGSET_HEADER - 4) == 0;
+
+            if (tagset)
+            {
+                const guchar *len = (const guchar *) buf + FILEIO_TAGSET_HEADER - 4;
+
+                markupLeft = ((guint64) len[0] << 24) | (len[1] << 16) | (len[2] << 8) | len[3];
+                ctx = g_markup_parse_context_new(&tagsetParser, 0, state, NULL);
+                p += FILEIO_TAGSET_HEADER;
+                have -= FILEIO_TAGSET_HEADER;
+            }
+        }
+
+        if (tagset)
+        {
+            gsize feed = MIN((guint64) have, markupLeft);
+
+            if (feed && !g_markup_parse_context_parse(ctx, p, feed, &err))
+                break;
+
+            markupLeft -= feed;
+            have = 0;
+
+            // anything after the markup holds embedded pixbufs, which the editor does not save
+
+            if (markupLeft == 0)
+                break;
+        }
+        else
+        {
+            carry = have - complete_utf8(p, have);
+            add_plain_text(state, p, have - carry);
+            memmove(buf, p + have - carry, carry);
+            have = carry;
+        }
+    }
+
+    if (ctx && !err)
+        g_markup_parse_context_end_parse(ctx, &err);
+    if (!tagset && !native && have && !err)
+        add_plain_text(state, buf, have);
+
+    flush_run(state);
+
+    last = state->parse.batch ? state->parse.batch : new_batch();
+    state->parse.batch = NULL;
+    last->finished = TRUE;
+    if (err)
+        last->error = g_strdup(err->message);
+    else if (g_cancellable_is_cancelled(cancel))
+        last->error = g_strdup(FILEIO_CANCELLED);
+    state->progress = 1;
+    push_batch(state, last);
+
+    if (ctx)
+        g_markup_parse_context_free(ctx);
+    if (stream)
+        g_object_unref(stream);
+    g_clear_error(&err);
+    g_object_unref(file);
+    g_free(buf);
+}
+
+// body of the loading thread, the result reaches the main loop in small batches
+
+static void load_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancel)
+{
+    TRACE_SCOPE(TRACE_SPAN, "load_thread");
+
+    read_document(data, cancel);
+    g_task_return_boolean(task, TRUE);
+}
+
+// releases a load once both the loading thread and the inserting idle callback are finished with it
+
+static void free_load(LoadState *state)
+{
+    LoadBatch *batch;
+
+    if (loading == state)
+        loading = NULL;
+
+    while ((batch = g_async_queue_try_pop(state->batches)))
+        free_batch(batch);
+
+    if (state->current)
+        free_batch(state->current);
+
+    gtk_text_buffer_delete_mark(state->buff, state->insert);
+    g_ptr_array_unref(state->parse.tagStack);
+    g_async_queue_unref(state->batches);
+    g_object_unref(state->cancel);
+    g_object_unref(state->buff);
+    g_free(state->path);
+    g_free(state);
+}
+
+// the loading thread has returned, so nothing else will touch the state from there
+
+static void load_thread_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+    LoadState *state = data;
+
+    state->threadDone = TRUE;
+    if (state->inserted)
+        free_load(state);
+}
+
+// sets one attribute of a tag being created from its serialised form. Only the simple property types are
+// understood, anything else keeps its default.
+
+static void set_tag_attr(GtkTextTag *tag, const gchar *name, const gchar *value)
+{
+    GParamSpec *spec = g_object_class_find_property(G_OBJECT_GET_CLASS(tag), name);
+    GValue gvalue = G_VALUE_INIT;
+    GType type;
+
+    if (!spec || !(spec->flags & G_PARAM_WRITABLE))
+        return;
+
+    type = G_PARAM_SPEC_VALUE_TYPE(spec);
+    g_value_init(&gvalue, type);
+
+    if (type == G_TYPE_BOOLEAN)
+        g_value_set_boolean(&gvalue, strcmp(value, "TRUE") == 0 || strcmp(value, "1") == 0);
+    else if (type == G_TYPE_INT)
+        g_value_set_int(&gvalue, atoi(value));
+    else if (type == G_TYPE_UINT)
+        g_value_set_uint(&gvalue, strtoul(value, NULL, 10));
+    else if (type == G_TYPE_DOUBLE)
+        g_value_set_double(&gvalue, g_ascii_strtod(value, NULL));
+    else if (type == G_TYPE_STRING)
+        g_value_set_string(&gvalue, value);
+    else if (G_TYPE_IS_ENUM(type))
+    {
+        GEnumClass *klass = g_type_class_ref(type);
+        GEnumValue *ev = g_enum_get_value_by_name(klass, value);
+
+        if (!ev)
+            ev = g_enum_get_value_by_nick(klass, value);
+
+        g_value_set_enum(&gvalue, ev ? ev->value : atoi(value));
+        g_type_class_unref(klass);
+    }
+    else
+    {
+        g_value_unset(&gvalue);
+        return;
+    }
+
+    g_object_set_property(G_OBJECT(tag), name, &gvalue);
+    g_value_unset(&gvalue);
+}
+
+// returns the tag with a name, creating it from serialised attributes if the buffer has no such tag yet
+
+GtkTextTag *fileio_define_tag(GtkTextBuffer *buff, const gchar *name, GPtrArray *attrs)
+{
+    GtkTextTagTable *table = gtk_text_buffer_get_tag_table(buff);
+    GtkTextTag *tag = gtk_text_tag_table_lookup(table, name);
+    guint i;
+
+    if (tag)
+        return tag;
+
+    tag = gtk_text_tag_new(name);
+    for (i = 0; i + 2 < attrs->len; i += 3)
+        set_tag_attr(tag, g_ptr_array_index(attrs, i), g_ptr_array_index(attrs, i + 2));
+
+    gtk_text_tag_table_add(table, tag);
+    g_object_unref(tag);
+
+    return tag;
+}
+
+// inserts a run of text at the end of what has been loaded so far and applies its tags. An image goes in
+// place of its placeholder if something is there to show it.
+
+static void insert_run(LoadState *state, LoadItem *item)
+{
+    GtkTextTagTable *table = gtk_text_buffer_get_tag_table(state->buff);
+    GtkTextIter start, end;
+    gint offset;
+    guint i;
+
+    inserting = TRUE;
+
+    gtk_text_buffer_get_iter_at_mark(state->buff, &end, state->insert);
+    offset = gtk_text_iter_get_offset(&end);
+    if (item->image && placeImage)
+        placeImage(state->buff, &end, item->image);
+    else
+        gtk_text_buffer_insert(state->buff, &end, item->text->str, item->text->len);
+    gtk_text_buffer_get_iter_at_offset(state->buff, &start, offset);
+
+    for (i = 0; i < item->names->len; i++)
+    {
+        GtkTextTag *tag = gtk_text_tag_table_lookup(table, g_ptr_array_index(item->names, i));
+
+        if (tag)
+            gtk_text_buffer_apply_tag(state->buff, tag, &start, &end);
+    }
+
+    inserting = FALSE;
+}
+
+// idle callback which inserts waiting batches into the buffer until its time budget runs out
+
+static gboolean insert_batches(gpointer data)
+{
+    TRACE_SCOPE(TRACE_DETAIL, "insert_batches");
+
+    LoadState *state = data;
+    gint64 deadline = g_get_monotonic_time() + FILEIO_INSERT_US;
+    gboolean cancelled = g_cancellable_is_cancelled(state->cancel);
+
+    while (g_get_monotonic_time() < deadline)
+    {
+        LoadBatch *batch = state->current;
+
+        if (!batch)
+        {
+            batch = state->current = g_async_queue_try_pop(state->batches);
+            state->index = 0;
+
+            if (!batch)
+            {
+                // nothing waiting, let the loading thread queue a new callback when it has more
+
+                g_atomic_int_set(&state->notifyPending, 0);
+                if (g_async_queue_length(state->batches) > 0
+                    && g_atomic_int_compare_and_exchange(&state->notifyPending, 0, 1))
+                    return G_SOURCE_CONTINUE;
+
+                return G_SOURCE_REMOVE;
+            }
+        }
+
+        while (!cancelled && state->index < batch->items->len && g_get_monotonic_time() < deadline)
+        {
+            LoadItem *item = g_ptr_array_index(batch->items, state->index++);
+
+            if (item->text)
+                insert_run(state, item);
+            else
+                fileio_define_tag(state->buff, item->name, item->names);
+        }
+
+        if (!cancelled && state->index < batch->items->len)
+            break;
+
+        if (state->progressFunc)
+            state->progressFunc(batch->progress, state->data);
+
+        state->current = NULL;
+
+        if (batch->finished)
+        {
+            TRACE_ASYNC_END(TRACE_SPAN, "fileio_open", state);
+
+            // cleared first so the done callback can tell whether another load has taken over. A cancelled
+            // load reports the cancel whatever the loading thread made of it, as it may have finished reading
+            // first or seen the cancel as a read error.
+
+            if (loading == state)
+                loading = NULL;
+
+            if (state->doneFunc)
+                state->doneFunc(g_cancellable_is_cancelled(state->cancel) ? FILEIO_CANCELLED : batch->error,
+                                state->data);
+
+            free_batch(batch);
+
+            state->inserted = TRUE;
+            if (state->threadDone)
+                free_load(state);
+
+            return G_SOURCE_REMOVE;
+        }
+
+        free_batch(batch);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+// replaces the contents of a buffer with a file, read and parsed on a worker thread and inserted a batch at
+// a time from idle callbacks. Native documents, gtk tagset files and plain text are accepted. The buffer can
+// be edited while the rest of the file arrives. Any load already running is cancelled.
+
+void fileio_open_async(GtkTextBuffer *buff, const gchar *path, FileioProgressFunc progress, FileioDoneFunc done,
+                       gpointer data)
+{
+    LoadState *state = g_new0(LoadState, 1);
+    GTask *task;
+    GtkTextIter start;
+
+    fileio_cancel();
+
+    // emptying the buffer is part of the load, so it is not recorded as an edit
+
+    inserting = TRUE;
+    gtk_text_buffer_set_text(buff, "", 0);
+    inserting = FALSE;
+    gtk_text_buffer_get_start_iter(buff, &start);
+
+    state->buff = g_object_ref(buff);
+    state->insert = gtk_text_buffer_create_mark(buff, NULL, &start, FALSE);
+    state->path = g_strdup(path);
+    state->cancel = g_cancellable_new();
+    state->batches = g_async_queue_new();
+    state->parse.tagStack = g_ptr_array_new_with_free_func(g_free);
+    state->progressFunc = progress;
+    state->doneFunc = done;
+    state->data = data;
+    loading = state;
+
+    TRACE_ASYNC_BEGIN(TRACE_SPAN, "fileio_open", state);
+
+    task = g_task_new(NULL, state->cancel, load_thread_done, state);
+    g_task_set_task_data(task, state, NULL);
+    g_task_run_in_thread(task, load_thread);
+    g_object_unref(task);
+}
+
+// returns true while a file is still being loaded
+
+gboolean fileio_loading(void)
+{
+    return loading != NULL;
+}
+
+// returns true while the buffer is being changed by a load rather than by the user
+
+gboolean fileio_inserting(void)
+{
+    return inserting;
+}
+
+// lets other modules which fill the buffer on the document's behalf mark their changes as not being edits
+
+void fileio_set_inserting(gboolean active)
+{
+    inserting = active;
+}
+
+// returns true if the start of a file shows it is neither a native document nor gtk tagset markup
+
+gboolean fileio_is_plain(const gchar *data, gsize len)
+{
+    if (bukfile_sniff(data, len))
+        return FALSE;
+
+    return len < FILEIO_TAGSET_HEADER || memcmp(data, FILEIO_TAGSET_MAGIC, FILEIO_TAGSET_HEADER - 4) != 0;
+}
+
+// stops the load in progress, the text inserted so far is kept and the done callback reports the cancel
+
+void fileio_cancel(void)
+{
+    if (loading)
+        g_cancellable_cancel(loading->cancel);
+}
+
+// marks a tag as belonging to the editor rather than the document, so saves leave it out
+
+void fileio_exclude_tag(GtkTextTag *tag)
+{
+    if (!excludedTags)
+        excludedTags = g_ptr_array_new();
+
+    if (tag)
+        g_ptr_array_add(excludedTags, tag);
+}
+
+// returns true for tags which are never saved
+
+gboolean fileio_tag_excluded(GtkTextTag *tag)
+{
+    return excludedTags && g_ptr_array_find(excludedTags, tag, NULL);
+}
+
+// sets what shows the images in loaded documents and supplies them to saves. Without handlers images load
+// as their placeholders and are not saved.
+
+void fileio_image_handlers(FileioImagePlaceFunc place, FileioImageFindFunc find)
+{
+    placeImage = place;
+    findImage = find;
+}
+
+static void free_save_tag(gpointer data)
+{
+    SaveTag *tag = data;
+
+    g_free(tag->name);
+    g_ptr_array_unref(tag->attrs);
+    g_free(tag);
+}
+
+static void clear_save_image(gpointer data)
+{
+    free_image(&((SaveImage *) data)->image);
+}
+
+static GArray *new_save_images(void)
+{
+    GArray *images = g_array_new(FALSE, FALSE, sizeof(SaveImage));
+
+    g_array_set_clear_func(images, clear_save_image);
+
+    return images;
+}
+
+// adds an image to a save, keeping its own reference to the encoded data so nothing is encoded again
+
+static void add_save_image(SaveState *state, gint offset, const FileioImage *image)
+{
+    SaveImage saved;
+
+    saved.offset = offset;
+    saved.image.hash = g_strdup(image->hash);
+    saved.image.width = image->width;
+    saved.image.height = image->height;
+    saved.image.data = g_bytes_ref(image->data);
+
+    g_array_append_val(state->images, saved);
+}
+
+static void free_save(SaveState *state)
+{
+    g_free(state->path);
+    g_free(state->text);
+    g_array_unref(state->images);
+    g_array_unref(state->runs);
+    g_ptr_array_unref(state->styles);
+    g_ptr_array_unref(state->tags);
+    g_free(state);
+}
+
+// returns the properties a tag actually sets, as name, type, value triples in the form gtk writes them
+
+GPtrArray *fileio_tag_attrs(GtkTextTag *tag)
+{
+    GPtrArray *attrs = g_ptr_array_new_with_free_func(g_free);
+    GObjectClass *klass = G_OBJECT_GET_CLASS(tag);
+    GParamSpec **specs;
+    guint count, i;
+
+    specs = g_object_class_list_properties(klass, &count);
+    for (i = 0; i < count; i++)
+    {
+        GParamSpec *spec = specs[i];
+        gchar *setName = g_strconcat(spec->name, "-set", NULL);
+        GParamSpec *setSpec = g_object_class_find_property(klass, setName);
+        gboolean isSet = FALSE;
+
+        if (setSpec && (spec->flags & G_PARAM_READABLE)
+            && g_value_type_transformable(G_PARAM_SPEC_VALUE_TYPE(spec), G_TYPE_STRING))
+            g_object_get(tag, setName, &isSet, NULL);
+
+        if (isSet)
+        {
+            GValue value = G_VALUE_INIT, str = G_VALUE_INIT;
+
+            g_value_init(&value, G_PARAM_SPEC_VALUE_TYPE(spec));
+            g_value_init(&str, G_TYPE_STRING);
+            g_object_get_property(G_OBJECT(tag), spec->name, &value);
+
+            if (g_value_transform(&value, &str) && g_value_get_string(&str))
+            {
+                g_ptr_array_add(attrs, g_strdup(spec->name));
+                g_ptr_array_add(attrs, g_strdup(g_type_name(G_PARAM_SPEC_VALUE_TYPE(spec))));
+                g_ptr_array_add(attrs, g_value_dup_string(&str));
+            }
+
+            g_value_unset(&value);
+            g_value_unset(&str);
+        }
+
+        g_free(setName);
+    }
+
+    g_free(specs);
+
+    return attrs;
+}
+
+// captures a tag as it will be written out
+
+static SaveTag *snapshot_tag(GtkTextTag *tag)
+{
+    SaveTag *saved = g_new0(SaveTag, 1);
+
+    g_object_get(tag, "name", &saved->name, "priority", &saved->priority, NULL);
+    saved->attrs = fileio_tag_attrs(tag);
+
+    return saved;
+}
+
+// returns the style index for the tags applied at an iter, adding the tags and the style to the snapshot the
+// first time they are seen. Only a handful of distinct tags exist, so this stays cheap however long the
+// buffer is.
+
+static guint snapshot_style(SaveState *state, GHashTable *tagIndex, GHashTable *styleIndex, GtkTextIter *iter)
+{
+    GSList *tags = gtk_text_iter_get_tags(iter), *l;
+    GArray *style = g_array_new(FALSE, FALSE, sizeof(guint));
+    GString *key = g_string_new(NULL);
+    gpointer found;
+
+    for (l = tags; l; l = l->next)
+    {
+        GtkTextTag *tag = l->data;
+        gpointer index;
+        guint i;
+
+        if (fileio_tag_excluded(tag))
+            continue;
+
+        if (!g_hash_table_lookup_extended(tagIndex, tag, NULL, &index))
+        {
+            SaveTag *saved = snapshot_tag(tag);
+
+            // anonymous tags cannot be looked up again when the file is loaded
+
+            if (!saved->name)
+            {
+                free_save_tag(saved);
+                continue;
+            }
+
+            index = GUINT_TO_POINTER(state->tags->len);
+            g_ptr_array_add(state->tags, saved);
+            g_hash_table_insert(tagIndex, tag, index);
+        }
+
+        i = GPOINTER_TO_UINT(index);
+        g_array_append_val(style, i);
+        g_string_append_printf(key, "%u,", i);
+    }
+
+    g_slist_free(tags);
+
+    if (g_hash_table_lookup_extended(styleIndex, key->str, NULL, &found))
+    {
+        g_array_unref(style);
+        g_string_free(key, TRUE);
+        return GPOINTER_TO_UINT(found);
+    }
+
+    g_ptr_array_add(state->styles, style);
+    g_hash_table_insert(styleIndex, g_string_free(key, FALSE), GUINT_TO_POINTER(state->styles->len - 1));
+
+    return state->styles->len - 1;
+}
+
+// finds the image behind each placeholder in a snapshot. Only the placeholders are visited, so a document
+// without images costs one scan of its text.
+
+static void snapshot_images(SaveState *state, GtkTextBuffer *buff)
+{
+    const gchar *p = state->text, *end = p + strlen(p), *obj;
+    gint chars = 0;
+
+    while ((obj = find_object(p, end - p)))
+    {
+        GtkTextChildAnchor *anchor;
+        FileioImage image;
+        GtkTextIter iter;
+
+        chars += g_utf8_strlen(p, obj - p);
+        gtk_text_buffer_get_iter_at_offset(buff, &iter, chars);
+        anchor = gtk_text_iter_get_child_anchor(&iter);
+
+        if (anchor && findImage(anchor, &image))
+            add_save_image(state, chars, &image);
+
+        chars++;
+        p = obj + 3;
+    }
+}
+
+// copies the text and tag runs of a buffer. The only work proportional to the document is one copy of the
+// text, tags are only visited where they toggle.
+
+static SaveState *snapshot_buffer(GtkTextBuffer *buff)
+{
+    SaveState *state = g_new0(SaveState, 1);
+    GHashTable *tagIndex = g_hash_table_new(NULL, NULL);
+    GHashTable *styleIndex = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GtkTextIter iter, end;
+
+    gtk_text_buffer_get_bounds(buff, &iter, &end);
+    state->text = gtk_text_buffer_get_slice(buff, &iter, &end, TRUE);
+    state->runs = g_array_new(FALSE, FALSE, sizeof(SaveRun));
+    state->styles = g_ptr_array_new_with_free_func((GDestroyNotify) g_array_unref);
+    state->tags = g_ptr_array_new_with_free_func(free_save_tag);
+    state->images = new_save_images();
+
+    while (!gtk_text_iter_equal(&iter, &end))
+    {
+        SaveRun run;
+
+        run.offset = gtk_text_iter_get_offset(&iter);
+        run.style = snapshot_style(state, tagIndex, styleIndex, &iter);
+
+        if (!gtk_text_iter_forward_to_tag_toggle(&iter, NULL))
+            iter = end;
+
+        run.length = gtk_text_iter_get_offset(&iter) - run.offset;
+
+        // neighbouring runs can match once excluded tags are ignored
+
+        if (state->runs->len && g_array_index(state->runs, SaveRun, state->runs->len - 1).style == run.style)
+            g_array_index(state->runs, SaveRun, state->runs->len - 1).length += run.length;
+        else if (run.length)
+            g_array_append_val(state->runs, run);
+    }
+
+    g_hash_table_unref(tagIndex);
+    g_hash_table_unref(styleIndex);
+
+    if (findImage)
+        snapshot_images(state, buff);
+
+    return state;
+}
+
+// appends text to the markup, escaped, without the U+FFFC placeholders which stand for embedded objects
+
+static void append_text(GString *out, const gchar *text, gsize len)
+{
+    const gchar *end = text + len;
+
+    while (text < end)
+    {
+        const gchar *obj = find_object(text, end - text);
+        const gchar *stop = obj ? obj : end;
+        gchar *escaped = g_markup_escape_text(text, stop - text);
+
+        g_string_append(out, escaped);
+        g_free(escaped);
+
+        text = obj ? obj + 3 : end;
+    }
+}
+
+// produces the same serialised form as gtk_text_buffer_serialize with the tagset format, so files can still
+// be read by gtk_text_buffer_deserialize
+
+static GString *serialise_snapshot(SaveState *state)
+{
+    GString *out = g_string_new(NULL);
+    const gchar *p = state->text;
+    gsize markupStart, markupLen;
+    guint i, j;
+
+    g_string_append_len(out, FILEIO_TAGSET_MAGIC "\0\0\0\0", FILEIO_TAGSET_HEADER);
+    markupStart = out->len;
+
+    g_string_append(out, "<text_view_markup>\n <tags>\n");
+    for (i = 0; i < state->tags->len; i++)
+    {
+        SaveTag *tag = g_ptr_array_index(state->tags, i);
+        gchar *name = g_markup_escape_text(tag->name, -1);
+
+        g_string_append_printf(out, "  <tag name=\"%s\" priority=\"%d\">\n", name, tag->priority);
+        for (j = 0; j + 2 < tag->attrs->len; j += 3)
+        {
+            gchar *value = g_markup_escape_text(g_ptr_array_index(tag->attrs, j + 2), -1);
+
+            g_string_append_printf(out, "   <attr name=\"%s\" type=\"%s\" value=\"%s\" />\n",
+                                   (gchar *) g_ptr_array_index(tag->attrs, j),
+                                   (gchar *) g_ptr_array_index(tag->attrs, j + 1), value);
+            g_free(value);
+        }
+        g_string_append(out, "  </tag>\n");
+        g_free(name);
+    }
+    g_string_append(out, " </tags>\n<text>");
+
+    // each run opens its tags, lowest priority outermost, and closes them again afterwards
+
+    for (i = 0; i < state->runs->len; i++)
+    {
+        SaveRun *run = &g_array_index(state->runs, SaveRun, i);
+        GArray *style = g_ptr_array_index(state->styles, run->style);
+        const gchar *runEnd = g_utf8_offset_to_pointer(p, run->length);
+
+        for (j = 0; j < style->len; j++)
+        {
+            SaveTag *tag = g_ptr_array_index(state->tags, g_array_index(style, guint, j));
+            gchar *name = g_markup_escape_text(tag->name, -1);
+
+            g_string_append_printf(out, "<apply_tag name=\"%s\">", name);
+            g_free(name);
+        }
+
+        append_text(out, p, runEnd - p);
+
+        for (j = 0; j < style->len; j++)
+            g_string_append(out, "</apply_tag>");
+
+        p = runEnd;
+    }
+    g_string_append(out, "</text>\n</text_view_markup>\n");
+
+    // the markup length goes in big endian after the magic
+
+    markupLen = out->len - markupStart;
+    out->str[markupStart - 4] = (markupLen >> 24) & 0xff;
+    out->str[markupStart - 3] = (markupLen >> 16) & 0xff;
+    out->str[markupStart - 2] = (markupLen >> 8) & 0xff;
+    out->str[markupStart - 1] = markupLen & 0xff;
+
+    return out;
+}
+
+// adds the text of a run starting at a character offset to a native document. The U+FFFC placeholder of an
+// image is kept with an anchor to the image, which the writer stores once however often it appears. Other
+// placeholders are left out. next is the first image of the snapshot not yet reached.
+
+static void add_native_run(BukWriter *writer, SaveState *state, const gchar *text, gsize len, gint offset,
+                           guint style, guint *next)
+{
+    const gchar *end = text + len, *counted = text;
+
+    while (text < end)
+    {
+        const gchar *obj = find_object(text, end - text);
+        SaveImage *image = NULL;
+
+        if (obj > text || !obj)
+            bukwriter_add_run(writer, text, (obj ? obj : end) - text, style);
+
+        if (!obj)
+            break;
+
+        if (*next < state->images->len)
+        {
+            offset += g_utf8_strlen(counted, obj - counted);
+            counted = obj;
+            image = &g_array_index(state->images, SaveImage, *next);
+        }
+
+        if (image && image->offset == offset)
+        {
+            bukwriter_add_anchor(writer, bukwriter_add_image(writer, image->image.hash, image->image.width,
+                                                             image->image.height, image->image.data));
+            bukwriter_add_run(writer, obj, 3, style);
+            (*next)++;
+        }
+
+        text = obj + 3;
+    }
+}
+
+// produces a native document from a snapshot
+
+static GBytes *serialise_native(SaveState *state)
+{
+    BukWriter *writer = bukwriter_new();
+    const gchar *p = state->text;
+    guint i, next = 0;
+
+    for (i = 0; i < state->tags->len; i++)
+    {
+        SaveTag *tag = g_ptr_array_index(state->tags, i);
+        bukwriter_add_tag(writer, tag->name, tag->priority, tag->attrs);
+    }
+
+    for (i = 0; i < state->styles->len; i++)
+    {
+        GArray *style = g_ptr_array_index(state->styles, i);
+        bukwriter_add_style(writer, (const guint32 *) style->data, style->len);
+    }
+
+    for (i = 0; i < state->runs->len; i++)
+    {
+        SaveRun *run = &g_array_index(state->runs, SaveRun, i);
+        const gchar *runEnd = g_utf8_offset_to_pointer(p, run->length);
+
+        add_native_run(writer, state, p, runEnd - p, run->offset, run->style, &next);
+        p = runEnd;
+    }
+
+    return bukwriter_finish(writer);
+}
+
+// serialises a snapshot in the format its file name asks for, native documents end in .buk
+
+static GBytes *serialise(SaveState *state)
+{
+    if (g_str_has_suffix(state->path, BUKFILE_EXTENSION))
+        return serialise_native(state);
+
+    return g_string_free_to_bytes(serialise_snapshot(state));
+}
+
+// writes data to a temporary file beside path, flushes it to disk and renames it over path, so a crash
+// leaves either the old file or the new one and never a partial write
+
+static gboolean write_atomic(const gchar *path, const gchar *data, gsize len, GError **err)
+{
+    gchar *tmp = g_strconcat(path, ".XXXXXX", NULL);
+    gchar *dir;
+    gsize written = 0;
+    int fd = g_mkstemp_full(tmp, O_WRONLY, 0644);
+    int saved, ret;
+
+    if (fd < 0)
+        goto fail;
+
+    while (written < len)
+    {
+        ssize_t got = write(fd, data + written, len - written);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            goto fail_fd;
+
+        written += got;
+    }
+
+    if (fsync(fd) != 0)
+        goto fail_fd;
+
+    ret = close(fd);
+    fd = -1;
+    if (ret != 0)
+        goto fail_fd;
+
+    if (rename(tmp, path) != 0)
+        goto fail_fd;
+
+    // make the rename itself durable, failure here does not lose the data already written
+
+    dir = g_path_get_dirname(path);
+    fd = open(dir, O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    g_free(dir);
+    g_free(tmp);
+
+    return TRUE;
+
+fail_fd:
+    saved = errno;
+    if (fd >= 0)
+        close(fd);
+    unlink(tmp);
+    errno = saved;
+fail:
+    g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno), "%s: %s", path, g_strerror(errno));
+    g_free(tmp);
+
+    return FALSE;
+}
+
+// body of the saving thread, serialises the snapshot and writes it out
+
+static void save_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancel)
+{
+    TRACE_SCOPE(TRACE_SPAN, "save_thread");
+
+    SaveState *state = data;
+    GBytes *out = serialise(state);
+    gsize len;
+    const gchar *bytes = g_bytes_get_data(out, &len);
+    GError *err = NULL;
+
+    if (write_atomic(state->path, bytes, len, &err))
+        g_task_return_boolean(task, TRUE);
+    else
+        g_task_return_error(task, err);
+
+    g_bytes_unref(out);
+}
+
+// reports the end of a save back on the main loop
+
+static void save_thread_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+    SaveState *state = data;
+    GError *err = NULL;
+
+    g_task_propagate_boolean(G_TASK(result), &err);
+    TRACE_ASYNC_END(TRACE_SPAN, "fileio_save", state);
+
+    if (state->doneFunc)
+        state->doneFunc(err ? err->message : NULL, state->data);
+
+    g_clear_error(&err);
+    free_save(state);
+}
+
+// saves a buffer, in the native format if the name ends in .buk and the gtk tagset format otherwise. The main
+// loop only copies the text and the tag runs, serialising
+// and writing happen on a worker thread and the done callback runs on the main loop when the file is safely
+// on disk.
+
+void fileio_save_async(GtkTextBuffer *buff, const gchar *path, FileioDoneFunc done, gpointer data)
+{
+    TRACE_SCOPE(TRACE_SPAN, "fileio_save_async");
+
+    SaveState *state = snapshot_buffer(buff);
+    GTask *task = g_task_new(NULL, NULL, save_thread_done, state);
+
+    state->path = g_strdup(path);
+    state->doneFunc = done;
+    state->data = data;
+
+    TRACE_ASYNC_BEGIN(TRACE_SPAN, "fileio_save", state);
+
+    g_task_set_task_data(task, state, NULL);
+    g_task_run_in_thread(task, save_thread);
+    g_object_unref(task);
+}
+
+// returns the index of a tag in a conversion, adding a tag without attributes if the document never defined it
+
+static guint convert_tag(SaveState *state, GHashTable *tagIndex, const gchar *name, GPtrArray *attrs)
+{
+    gpointer index;
+    SaveTag *tag;
+
+    if (g_hash_table_lookup_extended(tagIndex, name, NULL, &index))
+        return GPOINTER_TO_UINT(index);
+
+    tag = g_new0(SaveTag, 1);
+    tag->name = g_strdup(name);
+    tag->priority = state->tags->len;
+    tag->attrs = attrs ? g_ptr_array_ref(attrs) : g_ptr_array_new_with_free_func(g_free);
+
+    g_ptr_array_add(state->tags, tag);
+    g_hash_table_insert(tagIndex, tag->name, GUINT_TO_POINTER(state->tags->len - 1));
+
+    return state->tags->len - 1;
+}
+
+// converts a document between formats without a text buffer, reading it as a load would and writing it as a
+// save would. The output format follows the extension of dst.
+
+gboolean fileio_convert(const gchar *src, const gchar *dst, GError **err)
+{
+    TRACE_SCOPE(TRACE_SPAN, "fileio_convert");
+
+    LoadState load = { 0 };
+    SaveState *save = g_new0(SaveState, 1);
+    GHashTable *tagIndex = g_hash_table_new(g_str_hash, g_str_equal);
+    GHashTable *styleIndex = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GString *text = g_string_new(NULL);
+    GError *error = NULL;
+    gboolean finished = FALSE;
+    gint offset = 0;
+
+    load.path = (gchar *) src;
+    load.batches = g_async_queue_new();
+    load.parse.tagStack = g_ptr_array_new_with_free_func(g_free);
+    read_document(&load, NULL);
+
+    save->path = g_strdup(dst);
+    save->runs = g_array_new(FALSE, FALSE, sizeof(SaveRun));
+    save->styles = g_ptr_array_new_with_free_func((GDestroyNotify) g_array_unref);
+    save->tags = g_ptr_array_new_with_free_func(free_save_tag);
+    save->images = new_save_images();
+
+    while (!finished)
+    {
+        LoadBatch *batch = g_async_queue_pop(load.batches);
+        guint i, j;
+
+        for (i = 0; i < batch->items->len; i++)
+        {
+            LoadItem *item = g_ptr_array_index(batch->items, i);
+            GArray *style;
+            GString *key;
+            gpointer found;
+            SaveRun run;
+
+            if (!item->text)
+            {
+                convert_tag(save, tagIndex, item->name, item->names);
+                continue;
+            }
+
+            style = g_array_new(FALSE, FALSE, sizeof(guint));
+            key = g_string_new(NULL);
+            for (j = 0; j < item->names->len; j++)
+            {
+                guint tag = convert_tag(save, tagIndex, g_ptr_array_index(item->names, j), NULL);
+
+                g_array_append_val(style, tag);
+                g_string_append_printf(key, "%u,", tag);
+            }
+
+            if (g_hash_table_lookup_extended(styleIndex, key->str, NULL, &found))
+            {
+                g_array_unref(style);
+                g_string_free(key, TRUE);
+                run.style = GPOINTER_TO_UINT(found);
+            }
+            else
+            {
+                g_ptr_array_add(save->styles, style);
+                g_hash_table_insert(styleIndex, g_string_free(key, FALSE), GUINT_TO_POINTER(save->styles->len - 1));
+                run.style = save->styles->len - 1;
+            }
+
+            if (item->image)
+                add_save_image(save, offset, item->image);
+
+            run.offset = offset;
+            run.length = g_utf8_strlen(item->text->str, item->text->len);
+            offset += run.length;
+            g_string_append_len(text, item->text->str, item->text->len);
+            g_array_append_val(save->runs, run);
+        }
+
+        finished = batch->finished;
+        if (batch->error)
+            g_set_error(&error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "%s", batch->error);
+
+        free_batch(batch);
+    }
+
+    save->text = g_string_free(text, FALSE);
+
+    if (!error)
+    {
+        GBytes *out = serialise(save);
+        gsize len;
+        const gchar *bytes = g_bytes_get_data(out, &len);
+
+        write_atomic(dst, bytes, len, &error);
+        g_bytes_unref(out);
+    }
+
+    g_hash_table_unref(tagIndex);
+    g_hash_table_unref(styleIndex);
+    g_ptr_array_unref(load.parse.tagStack);
+    g_async_queue_unref(load.batches);
+    free_save(save);
+
+    if (error)
+    {
+        g_propagate_error(err, error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,213 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <gtk/gtk.h>
+#include <stdbool.h>
+
+#include "format.h"
+#include "styles.h"
+#include "debugmsg.h"
+#include "trace.h"
+
+// how a command changes its tag. Toggles are removed if every range already has them and applied otherwise,
+// exclusive tags replace any other tag of their group, indents move each paragraph by a number of levels.
+
+typedef enum
+{
+    FORMAT_TOGGLE,
+    FORMAT_EXCLUSIVE,
+    FORMAT_INDENT_BY
+} FormatKind;
+
+// groups of tags of which only one may be applied to the same text
+
+enum
+{
+    GROUP_NONE,
+    GROUP_JUSTIFY
+};
+
+// tag is the offset of the tag pointer in the editor context. Paragraph formats always cover whole lines,
+// as gtk only looks at the start of a paragraph for them.
+
+typedef struct
+{
+    FormatKind kind;
+    gssize tag;
+    gint group;
+    gint delta;
+    bool paragraph;
+} FormatDescriptor;
+
+#define TAG(field) offsetof(EditorContext, field)
+
+static const FormatDescriptor formats[FORMAT_COUNT] = {
+    [FORMAT_BOLD] = { FORMAT_TOGGLE, TAG(bold), GROUP_NONE, 0, false },
+    [FORMAT_ITALIC] = { FORMAT_TOGGLE, TAG(ital), GROUP_NONE, 0, false },
+    [FORMAT_UNDERLINE] = { FORMAT_TOGGLE, TAG(uline), GROUP_NONE, 0, false },
+    [FORMAT_STRIKETHROUGH] = { FORMAT_TOGGLE, TAG(sthru), GROUP_NONE, 0, false },
+    [FORMAT_LJUST] = { FORMAT_EXCLUSIVE, TAG(ljust), GROUP_JUSTIFY, 0, true },
+    [FORMAT_RJUST] = { FORMAT_EXCLUSIVE, TAG(rjust), GROUP_JUSTIFY, 0, true },
+    [FORMAT_CJUST] = { FORMAT_EXCLUSIVE, TAG(cjust), GROUP_JUSTIFY, 0, true },
+    [FORMAT_FJUST] = { FORMAT_EXCLUSIVE, TAG(fjust), GROUP_JUSTIFY, 0, true },
+    [FORMAT_INDENT] = { FORMAT_INDENT_BY, -1, GROUP_NONE, 1, true },
+    [FORMAT_UNINDENT] = { FORMAT_INDENT_BY, -1, GROUP_NONE, -1, true },
+};
+
+// returns the tag a descriptor names
+
+static GtkTextTag *descriptor_tag(EditorContext *editor, const FormatDescriptor *format)
+{
+    return *(GtkTextTag **) ((char *) editor + format->tag);
+}
+
+// gets iters for a range, widened to whole paragraphs if the format needs it
+
+static void range_iters(EditorContext *editor, const FormatDescriptor *format, const FormatRange *range,
+                        GtkTextIter *start, GtkTextIter *end)
+{
+    gtk_text_buffer_get_iter_at_offset(editor->buff, start, range->start);
+    gtk_text_buffer_get_iter_at_offset(editor->buff, end, range->end);
+
+    if (format->paragraph)
+    {
+        // a selection ending at the start of a line does not take in that line
+
+        if (gtk_text_iter_starts_line(end) && gtk_text_iter_compare(end, start) > 0)
+            gtk_text_iter_backward_char(end);
+
+        gtk_text_iter_set_line_offset(start, 0);
+        if (!gtk_text_iter_ends_line(end))
+            gtk_text_iter_forward_to_line_end(end);
+    }
+}
+
+// true if a tag is applied to every character of a range
+
+static bool tag_covers(GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end)
+{
+    GtkTextIter toggle = *start;
+
+    if (!gtk_text_iter_has_tag(start, tag))
+        return false;
+
+    return !gtk_text_iter_forward_to_tag_toggle(&toggle, tag) || gtk_text_iter_compare(&toggle, end) >= 0;
+}
+
+// moves every paragraph of a range by delta indent levels, each from its own current level
+
+static void indent_range(EditorContext *editor, gint delta, GtkTextIter *start, GtkTextIter *end)
+{
+    GtkTextIter para = *start;
+
+    do
+    {
+        GtkTextIter paraEnd = para;
+        gint level = styles_indent_level(editor, &para);
+        gint wanted = CLAMP(level + delta, 0, STYLES_INDENT_LEVELS);
+
+        if (!gtk_text_iter_ends_line(&paraEnd))
+            gtk_text_iter_forward_to_line_end(&paraEnd);
+
+        if (wanted != level)
+        {
+            if (level)
+                styles_clear_indent(editor, &para, &paraEnd);
+            if (wanted)
+                gtk_text_buffer_apply_tag(editor->buff, styles_indent_tag(editor, wanted), &para, &paraEnd);
+        }
+    } while (gtk_text_iter_forward_line(&para) && gtk_text_iter_compare(&para, end) < 0);
+}
+
+// applies a formatting command to any number of ranges as one user action, so gtk revalidates the layout
+// once however many ranges there are. Toggles look at every range before changing any of them, so a style
+// applied to only some of the ranges is applied to all rather than flipped on each.
+
+void format_apply(EditorContext *editor, FormatCommand command, const FormatRange *ranges, guint count)
+{
+    TRACE_SCOPE(TRACE_DETAIL, "format_apply");
+
+    const FormatDescriptor *format = &formats[command];
+    GtkTextTag *tag = format->tag >= 0 ? descriptor_tag(editor, format) : NULL;
+    bool remove = false;
+    guint i, j;
+
+    if (!count)
+        return;
+
+    if (format->kind == FORMAT_TOGGLE)
+    {
+        remove = true;
+
+        for (i = 0; i < count && remove; i++)
+        {
+            GtkTextIter start, end;
+
+            range_iters(editor, format, &ranges[i], &start, &end);
+            remove = tag_covers(tag, &start, &end);
+        }
+    }
+
+    gtk_text_buffer_begin_user_action(editor->buff);
+
+    for (i = 0; i < count; i++)
+    {
+        GtkTextIter start, end;
+
+        range_iters(editor, format, &ranges[i], &start, &end);
+
+        switch (format->kind)
+        {
+        case FORMAT_TOGGLE:
+            if (remove)
+                gtk_text_buffer_remove_tag(editor->buff, tag, &start, &end);
+            else
+                gtk_text_buffer_apply_tag(editor->buff, tag, &start, &end);
+            break;
+
+        case FORMAT_EXCLUSIVE:
+            for (j = 0; j < FORMAT_COUNT; j++)
+                if (formats[j].group == format->group && formats[j].tag != format->tag)
+                    gtk_text_buffer_remove_tag(editor->buff, descriptor_tag(editor, &formats[j]), &start, &end);
+
+            gtk_text_buffer_apply_tag(editor->buff, tag, &start, &end);
+            break;
+
+        case FORMAT_INDENT_BY:
+            indent_range(editor, format->delta, &start, &end);
+            break;
+        }
+    }
+
+    gtk_text_buffer_end_user_action(editor->buff);
+
+    // indent levels left behind may no longer be used anywhere
+
+    if (format->kind == FORMAT_INDENT_BY)
+        styles_schedule_collect(editor);
+}
+
+// applies a formatting command to the selection, paragraph formats also work on the paragraph holding the
+// cursor when nothing is selected
+
+void format_selection(EditorContext *editor, FormatCommand command)
+{
+    GtkTextIter start, end;
+    FormatRange range;
+
+    // a view the user cannot type into cannot be formatted either
+
+    if (!gtk_text_view_get_editable(editor->view))
+        return;
+
+    gtk_text_buffer_get_selection_bounds(editor->buff, &start, &end);
+    range.start = gtk_text_iter_get_offset(&start);
+    range.end = gtk_text_iter_get_offset(&end);
+
+    format_apply(editor, command, &range, 1);
+}
@@ -0,0 +1,646 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <stdbool.h>
+
+#include "images.h"
+#include "debugmsg.h"
+#include "trace.h"
+
+// Pasted images sit in the buffer at child anchors, so they flow with the text around them. The full
+// resolution image is only kept encoded, in a store keyed by the hash of its content and shared by every
+// paste of the same image. What is drawn comes from a cache of surfaces decoded and scaled to their display
+// size on worker threads, keyed by hash and display size, which follows the zoom. Images away from the
+// visible text give up their surface, so memory follows what is on screen and not what is in the document.
+
+// gap kept between an image and the edges of the view
+
+#define IMAGES_MARGIN 8
+
+// the encoded data is what was pasted or a view of the document it was loaded from, and is written back
+// as it is when the document is saved
+
+typedef struct
+{
+    gchar *hash;
+    GBytes *data;
+    gint width;
+    gint height;
+    guint refs;
+} ImageEntry;
+
+// an image in the buffer. entry is NULL until a pasted image has been encoded, width and height are the
+// size it is displayed at in logical pixels.
+
+typedef struct
+{
+    GtkTextChildAnchor *anchor;
+    GtkWidget *widget;
+    ImageEntry *entry;
+    gint nativeWidth;
+    gint nativeHeight;
+    gint width;
+    gint height;
+    gboolean shown;
+} ImagePlacement;
+
+typedef struct
+{
+    gchar *key;
+    cairo_surface_t *surface;
+    gsize bytes;
+    GList *link;
+} CacheItem;
+
+// work for the encoder and decoder threads
+
+typedef struct
+{
+    GtkTextChildAnchor *anchor;
+    GdkPixbuf *pixbuf;
+    GBytes *data;
+    gchar *hash;
+} EncodeJob;
+
+typedef struct
+{
+    gchar *key;
+    GBytes *data;
+    gint width;
+    gint height;
+    gint scale;
+} DecodeJob;
+
+static GtkTextView *imagesView;
+static GtkAdjustment *vadjust;
+static gulong scrollHandler;
+static GCancellable *cancel;
+static guint updateSource;
+static gdouble zoom = 1.0;
+
+static GHashTable *store;
+static GPtrArray *placements;
+
+// the surface cache, most recently shown first, and the keys being decoded
+
+static GHashTable *cache;
+static GQueue lru = G_QUEUE_INIT;
+static gsize cacheBytes;
+static GHashTable *decoding;
+
+static void schedule_update(void);
+
+static void free_entry(gpointer data)
+{
+    ImageEntry *entry = data;
+
+    g_bytes_unref(entry->data);
+    g_free(entry->hash);
+    g_free(entry);
+}
+
+// returns the stored image with a hash, adding it if it is new so pasting the same image twice stores it once
+
+static ImageEntry *intern_entry(const gchar *hash, GBytes *data, gint width, gint height)
+{
+    ImageEntry *entry = g_hash_table_lookup(store, hash);
+
+    if (!entry)
+    {
+        entry = g_new0(ImageEntry, 1);
+        entry->hash = g_strdup(hash);
+        entry->data = g_bytes_ref(data);
+        entry->width = width;
+        entry->height = height;
+        g_hash_table_insert(store, entry->hash, entry);
+    }
+
+    entry->refs++;
+
+    return entry;
+}
+
+static void release_entry(ImageEntry *entry)
+{
+    if (entry && --entry->refs == 0)
+        g_hash_table_remove(store, entry->hash);
+}
+
+static void free_cache_item(gpointer data)
+{
+    CacheItem *item = data;
+
+    cairo_surface_destroy(item->surface);
+    g_free(item->key);
+    g_free(item);
+}
+
+// returns a cached surface and marks it most recently used, or NULL
+
+static cairo_surface_t *cache_lookup(const gchar *key)
+{
+    CacheItem *item = g_hash_table_lookup(cache, key);
+
+    if (!item)
+        return NULL;
+
+    g_queue_unlink(&lru, item->link);
+    g_queue_push_head_link(&lru, item->link);
+
+    return item->surface;
+}
+
+// marks a surface as the first to go when the cache is full
+
+static void cache_demote(const gchar *key)
+{
+    CacheItem *item = g_hash_table_lookup(cache, key);
+
+    if (item)
+    {
+        g_queue_unlink(&lru, item->link);
+        g_queue_push_tail_link(&lru, item->link);
+    }
+}
+
+// adds a surface, dropping the least recently used ones past the budget. A surface still shown lives on in
+// its widget until the image is scrolled away.
+
+static void cache_insert(gchar *key, cairo_surface_t *surface)
+{
+    CacheItem *item = g_new0(CacheItem, 1);
+
+    item->key = key;
+    item->surface = surface;
+    item->bytes = cairo_image_surface_get_stride(surface) * cairo_image_surface_get_height(surface);
+    item->link = g_list_alloc();
+    item->link->data = item;
+
+    g_queue_push_head_link(&lru, item->link);
+    g_hash_table_replace(cache, item->key, item);
+    cacheBytes += item->bytes;
+
+    while (cacheBytes > IMAGES_CACHE_BYTES && lru.length > 1)
+    {
+        CacheItem *old = g_queue_pop_tail(&lru);
+
+        cacheBytes -= old->bytes;
+        g_hash_table_remove(cache, old->key);
+    }
+}
+
+// the cache key for an image at its display size, in device pixels
+
+static gchar *placement_key(ImagePlacement *placement, gint scale)
+{
+    return g_strdup_printf("%s@%dx%d", placement->entry->hash, placement->width * scale, placement->height * scale);
+}
+
+// works out the size an image is displayed at, its own size times the zoom but no wider than the view
+
+static void size_placement(ImagePlacement *placement)
+{
+    gint avail = gtk_widget_get_allocated_width(GTK_WIDGET(imagesView)) - gtk_text_view_get_left_margin(imagesView)
+                 - gtk_text_view_get_right_margin(imagesView) - 2 * IMAGES_MARGIN;
+    gdouble width = placement->nativeWidth * zoom;
+    gdouble height = placement->nativeHeight * zoom;
+
+    if (avail > 0 && width > avail)
+    {
+        height = height * avail / width;
+        width = avail;
+    }
+
+    placement->width = MAX((gint) width, 1);
+    placement->height = MAX((gint) height, 1);
+    gtk_widget_set_size_request(placement->widget, placement->width, placement->height);
+}
+
+static void free_encode_job(gpointer data)
+{
+    EncodeJob *job = data;
+
+    g_object_unref(job->anchor);
+    g_clear_object(&job->pixbuf);
+    if (job->data)
+        g_bytes_unref(job->data);
+    g_free(job->hash);
+    g_free(job);
+}
+
+// encodes a pasted image and hashes the result, on a worker thread. The pixbuf is not touched by the main
+// thread meanwhile.
+
+static void encode_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
+{
+    TRACE_SCOPE(TRACE_SPAN, "encode_thread");
+
+    EncodeJob *job = data;
+    GError *err = NULL;
+    gchar *buffer;
+    gsize size;
+
+    if (!gdk_pixbuf_save_to_buffer(job->pixbuf, &buffer, &size, "png", &err, NULL))
+    {
+        g_task_return_error(task, err);
+        return;
+    }
+
+    job->hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar *) buffer, size);
+    job->data = g_bytes_new_take(buffer, size);
+    g_task_return_boolean(task, TRUE);
+}
+
+// returns the placement for an anchor, or NULL if its image has been deleted
+
+static ImagePlacement *find_placement(GtkTextChildAnchor *anchor)
+{
+    return g_object_get_data(G_OBJECT(anchor), "image-placement");
+}
+
+// gives an encoded image to its placement. The full resolution pixbuf goes with the job.
+
+static void encode_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+    EncodeJob *job = g_task_get_task_data(G_TASK(result));
+    ImagePlacement *placement;
+    GError *err = NULL;
+
+    if (!g_task_propagate_boolean(G_TASK(result), &err))
+    {
+        if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            printf("Error encoding pasted image: %s\n", err->message);
+        g_error_free(err);
+        return;
+    }
+
+    if (!imagesView)
+        return;
+
+    placement = find_placement(job->anchor);
+    if (placement)
+    {
+        placement->entry = intern_entry(job->hash, job->data, placement->nativeWidth, placement->nativeHeight);
+        schedule_update();
+    }
+}
+
+static void free_decode_job(gpointer data)
+{
+    DecodeJob *job = data;
+
+    g_free(job->key);
+    g_bytes_unref(job->data);
+    g_free(job);
+}
+
+// decodes an image straight to its display size, on a worker thread
+
+static void decode_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
+{
+    TRACE_SCOPE(TRACE_SPAN, "decode_thread");
+
+    DecodeJob *job = data;
+    GInputStream *stream = g_memory_input_stream_new_from_bytes(job->data);
+    GError *err = NULL;
+    GdkPixbuf *pixbuf;
+
+    pixbuf = gdk_pixbuf_new_from_stream_at_scale(stream, job->width, job->height, FALSE, cancellable, &err);
+    g_object_unref(stream);
+
+    if (pixbuf)
+        g_task_return_pointer(task, pixbuf, g_object_unref);
+    else
+        g_task_return_error(task, err);
+}
+
+// caches a decoded image and lets the visible images pick it up
+
+static void decode_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+    DecodeJob *job = g_task_get_task_data(G_TASK(result));
+    GError *err = NULL;
+    GdkPixbuf *pixbuf = g_task_propagate_pointer(G_TASK(result), &err);
+
+    if (imagesView)
+        g_hash_table_remove(decoding, job->key);
+
+    if (!pixbuf)
+    {
+        if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            printf("Error decoding image: %s\n", err->message);
+        g_error_free(err);
+        return;
+    }
+
+    if (imagesView)
+    {
+        cache_insert(g_strdup(job->key), gdk_cairo_surface_create_from_pixbuf(pixbuf, job->scale, NULL));
+        schedule_update();
+    }
+
+    g_object_unref(pixbuf);
+}
+
+static void start_decode(ImagePlacement *placement, gchar *key, gint scale)
+{
+    DecodeJob *job = g_new0(DecodeJob, 1);
+    GTask *task;
+
+    job->key = key;
+    job->data = g_bytes_ref(placement->entry->data);
+    job->width = placement->width * scale;
+    job->height = placement->height * scale;
+    job->scale = scale;
+
+    g_hash_table_add(decoding, g_strdup(key));
+
+    task = g_task_new(NULL, cancel, decode_done, NULL);
+    g_task_set_task_data(task, job, free_decode_job);
+    g_task_run_in_thread(task, decode_thread);
+    g_object_unref(task);
+}
+
+// shows an image near the visible text, from the cache or once it has been decoded
+
+static void show_placement(ImagePlacement *placement, gint scale)
+{
+    gchar *key = placement_key(placement, scale);
+    cairo_surface_t *surface = cache_lookup(key);
+
+    if (surface)
+    {
+        if (!placement->shown)
+            gtk_image_set_from_surface(GTK_IMAGE(placement->widget), surface);
+        placement->shown = TRUE;
+        g_free(key);
+    }
+    else if (!g_hash_table_contains(decoding, key))
+        start_decode(placement, key, scale);
+    else
+        g_free(key);
+}
+
+// drops the surface of an image far from the visible text, leaving an empty space of the same size
+
+static void hide_placement(ImagePlacement *placement, gint scale)
+{
+    gchar *key = placement_key(placement, scale);
+
+    gtk_image_clear(GTK_IMAGE(placement->widget));
+    placement->shown = FALSE;
+    cache_demote(key);
+    g_free(key);
+}
+
+// idle callback which shows the images near the visible text and hides the rest
+
+static gboolean update_placements(gpointer data)
+{
+    TRACE_SCOPE(TRACE_DETAIL, "update_placements");
+
+    GtkTextBuffer *buff = gtk_text_view_get_buffer(imagesView);
+    gint scale = gtk_widget_get_scale_factor(GTK_WIDGET(imagesView));
+    GdkRectangle visible;
+    guint i;
+
+    updateSource = 0;
+
+    gtk_text_view_get_visible_rect(imagesView, &visible);
+    visible.y -= visible.height * IMAGES_PREFETCH_SCREENS;
+    visible.height += 2 * visible.height * IMAGES_PREFETCH_SCREENS;
+
+    for (i = 0; i < placements->len; i++)
+    {
+        ImagePlacement *placement = g_ptr_array_index(placements, i);
+        GdkRectangle rect;
+        GtkTextIter iter;
+        bool near;
+
+        if (!placement->entry || gtk_text_child_anchor_get_deleted(placement->anchor))
+            continue;
+
+        gtk_text_buffer_get_iter_at_child_anchor(buff, &iter, placement->anchor);
+        gtk_text_view_get_iter_location(imagesView, &iter, &rect);
+        near = rect.y < visible.y + visible.height && rect.y + MAX(rect.height, placement->height) > visible.y;
+
+        if (near)
+            show_placement(placement, scale);
+        else if (placement->shown)
+            hide_placement(placement, scale);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+// asks for the images to be looked at again once the editor is idle. The view may outlive the module, so
+// its signals find nothing to do once detached.
+
+static void schedule_update(void)
+{
+    if (imagesView && !updateSource)
+        updateSource = g_idle_add(update_placements, NULL);
+}
+
+static void on_scroll(GtkAdjustment *adjustment, gpointer data)
+{
+    schedule_update();
+}
+
+static void on_size_allocate(GtkWidget *widget, GdkRectangle *allocation, gpointer data)
+{
+    schedule_update();
+}
+
+static void free_placement(gpointer data)
+{
+    ImagePlacement *placement = data;
+
+    g_object_set_data(G_OBJECT(placement->anchor), "image-placement", NULL);
+    release_entry(placement->entry);
+    g_object_unref(placement->anchor);
+    g_free(placement);
+}
+
+// forgets an image once its anchor is deleted and the view lets go of its widget
+
+static void on_widget_destroy(GtkWidget *widget, gpointer data)
+{
+    g_ptr_array_remove_fast(placements, data);
+}
+
+// anchors an empty image of the given size at an iter, which is left after it. It is drawn once it comes
+// near the visible text.
+
+static ImagePlacement *add_placement(GtkTextBuffer *buff, GtkTextIter *iter, gint width, gint height)
+{
+    ImagePlacement *placement = g_new0(ImagePlacement, 1);
+
+    placement->nativeWidth = width;
+    placement->nativeHeight = height;
+    placement->widget = gtk_image_new();
+    size_placement(placement);
+
+    placement->anchor = g_object_ref(gtk_text_buffer_create_child_anchor(buff, iter));
+    g_object_set_data(G_OBJECT(placement->anchor), "image-placement", placement);
+
+    g_signal_connect(placement->widget, "destroy", G_CALLBACK(on_widget_destroy), placement);
+    gtk_text_view_add_child_at_anchor(imagesView, placement->widget, placement->anchor);
+    gtk_widget_show(placement->widget);
+    g_ptr_array_add(placements, placement);
+
+    return placement;
+}
+
+// inserts an image at the cursor. It is shown at its display size straight away and drawn once a worker
+// has encoded, hashed and decoded it.
+
+void images_insert(GdkPixbuf *pixbuf)
+{
+    ImagePlacement *placement;
+    GtkTextBuffer *buff;
+    GtkTextIter cursor;
+    EncodeJob *job;
+    GTask *task;
+
+    if (!imagesView || !gtk_text_view_get_editable(imagesView))
+        return;
+
+    buff = gtk_text_view_get_buffer(imagesView);
+
+    gtk_text_buffer_begin_user_action(buff);
+    gtk_text_buffer_get_iter_at_mark(buff, &cursor, gtk_text_buffer_get_insert(buff));
+    placement = add_placement(buff, &cursor, gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf));
+    gtk_text_buffer_end_user_action(buff);
+
+    job = g_new0(EncodeJob, 1);
+    job->anchor = g_object_ref(placement->anchor);
+    job->pixbuf = g_object_ref(pixbuf);
+
+    task = g_task_new(NULL, cancel, encode_done, NULL);
+    g_task_set_task_data(task, job, free_encode_job);
+    g_task_run_in_thread(task, encode_thread);
+    g_object_unref(task);
+}
+
+// places an image loaded from a document. Its data is only decoded when it scrolls near the visible text.
+
+void images_place(GtkTextBuffer *buff, GtkTextIter *iter, const FileioImage *image)
+{
+    ImagePlacement *placement;
+
+    // without a view to show it the image keeps its place as a plain placeholder
+
+    if (!imagesView)
+    {
+        gtk_text_buffer_insert(buff, iter, "\xef\xbf\xbc", 3);
+        return;
+    }
+
+    placement = add_placement(buff, iter, image->width, image->height);
+    placement->entry = intern_entry(image->hash, image->data, image->width, image->height);
+    schedule_update();
+}
+
+// finds the image at an anchor for a save. Images still being encoded after a paste have nothing to save yet.
+
+gboolean images_find(GtkTextChildAnchor *anchor, FileioImage *image)
+{
+    ImagePlacement *placement = imagesView ? find_placement(anchor) : NULL;
+
+    if (!placement || !placement->entry)
+        return FALSE;
+
+    image->hash = placement->entry->hash;
+    image->width = placement->entry->width;
+    image->height = placement->entry->height;
+    image->data = placement->entry->data;
+
+    return TRUE;
+}
+
+// changes the zoom images are displayed at. Surfaces for the old zoom stay cached until they age out.
+
+void images_set_zoom(gdouble newZoom)
+{
+    gint scale;
+    guint i;
+
+    zoom = CLAMP(newZoom, 0.1, 8.0);
+    if (!imagesView)
+        return;
+
+    scale = gtk_widget_get_scale_factor(GTK_WIDGET(imagesView));
+
+    for (i = 0; i < placements->len; i++)
+    {
+        ImagePlacement *placement = g_ptr_array_index(placements, i);
+
+        if (placement->shown)
+            hide_placement(placement, scale);
+        size_placement(placement);
+    }
+
+    schedule_update();
+}
+
+// starts managing the images in a view
+
+void images_attach(GtkTextView *view)
+{
+    imagesView = view;
+    cancel = g_cancellable_new();
+    store = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_entry);
+    placements = g_ptr_array_new_with_free_func(free_placement);
+    cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_cache_item);
+    decoding = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    vadjust = g_object_ref(gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(view)));
+    scrollHandler = g_signal_connect(vadjust, "value-changed", G_CALLBACK(on_scroll), NULL);
+    g_signal_connect(view, "size-allocate", G_CALLBACK(on_size_allocate), NULL);
+}
+
+// stops work in progress and frees the images
+
+void images_detach(void)
+{
+    guint i;
+
+    if (!imagesView)
+        return;
+
+    DEB("Image cache: %zu bytes in %u surfaces, %u images stored\n", cacheBytes, lru.length,
+        g_hash_table_size(store));
+
+    g_cancellable_cancel(cancel);
+    g_clear_object(&cancel);
+
+    if (updateSource)
+        g_source_remove(updateSource);
+    updateSource = 0;
+
+    g_signal_handler_disconnect(vadjust, scrollHandler);
+    g_clear_object(&vadjust);
+
+    // the view may still be destroying widgets, which must not find their placements
+
+    for (i = 0; i < placements->len; i++)
+    {
+        ImagePlacement *placement = g_ptr_array_index(placements, i);
+        g_signal_handlers_disconnect_by_func(placement->widget, on_widget_destroy, placement);
+    }
+
+    g_ptr_array_unref(placements);
+    g_queue_clear(&lru);
+    g_hash_table_unref(cache);
+    g_hash_table_unref(decoding);
+    g_hash_table_unref(store);
+    cacheBytes = 0;
+    imagesView = NULL;
+}
@@ -0,0 +1,631 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gtk/gtk.h>
+#include <stdbool.h>
+
+#include "journal.h"
+#include "fileio.h"
+#include "debugmsg.h"
+#include "trace.h"
+
+// A journal sits next to a saved document as <document>.journal and holds the edits made since the document
+// was last written in full. The header identifies the document by size and modification time, so a journal
+// left behind by an older version of the file is ignored rather than replayed onto the wrong text. Records
+// follow in the order the edits were made, each a fixed part and a payload. Everything is in host byte order.
+
+#define JOURNAL_MAGIC "BUKJRNL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BOM 0x01020304u
+
+// past this size the document is rewritten in full and the journal started again
+
+#define JOURNAL_COMPACT_BYTES (1 << 20)
+
+typedef struct
+{
+    char magic[8];
+    uint32_t bom;
+    uint32_t version;
+    uint64_t baseSize;
+    int64_t baseSec;
+    int64_t baseNsec;
+} JournalHeader;
+
+// record types. Offsets and lengths are in characters. Inserts carry the text, tag changes the tag name and
+// definitions the tag name followed by name, type, value attribute triples, all nul terminated.
+
+enum
+{
+    JOURNAL_INSERT = 1,
+    JOURNAL_DELETE,
+    JOURNAL_APPLY_TAG,
+    JOURNAL_REMOVE_TAG,
+    JOURNAL_DEFINE_TAG
+};
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t size;
+} JournalRecord;
+
+// a write to a journal file, run in order on the journal thread
+
+typedef struct
+{
+    gchar *path;
+    gchar *base;
+    GByteArray *records;
+    gboolean remove;
+    gint64 size;
+    gchar *error;
+    FileioDoneFunc doneFunc;
+    gpointer data;
+} JournalOp;
+
+// a full rewrite of the document in progress
+
+typedef struct
+{
+    gchar *path;
+    FileioDoneFunc doneFunc;
+    gpointer data;
+} FullSave;
+
+static GtkTextBuffer *journalBuff;
+static gulong handlers[5];
+static GThreadPool *writer;
+
+// journal writes queued or running, until their done callback has run on the main loop
+
+static guint opsQueued;
+
+// the document edits are recorded against, and the records not yet written to its journal
+
+static gchar *basePath;
+static GByteArray *pending;
+static GHashTable *definedTags;
+
+// replaying is set while a journal is applied, stale once edits have been missed so only a full save can
+// bring the document up to date, and untracked when the buffer changed while no document was tracked
+
+static gboolean replaying, stale, untracked;
+
+// full saves still running, and a save which has to wait for them
+
+static guint fullSaves;
+static gboolean savePending;
+static FileioDoneFunc pendingDone;
+static gpointer pendingData;
+
+// appends one record to the pending edits
+
+static void add_record(guint32 type, gint offset, gint length, const void *payload, gsize size)
+{
+    JournalRecord record;
+
+    record.type = type;
+    record.offset = offset;
+    record.length = length;
+    record.size = size;
+
+    g_byte_array_append(pending, (const guint8 *) &record, sizeof(record));
+    if (size)
+        g_byte_array_append(pending, payload, size);
+}
+
+// true when an edit should be added to the journal
+
+static gboolean recording(void)
+{
+    if (replaying || fileio_inserting())
+        return FALSE;
+
+    if (!basePath)
+    {
+        untracked = TRUE;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void on_insert_text(GtkTextBuffer *buff, GtkTextIter *location, gchar *text, gint len, gpointer data)
+{
+    if (recording())
+        add_record(JOURNAL_INSERT, gtk_text_iter_get_offset(location), g_utf8_strlen(text, len), text, len);
+}
+
+// an image is only written with the whole document, so the next save has to be a full one. Until then its
+// U+FFFC placeholder is recorded so later offsets stay right.
+
+static void on_insert_child_anchor(GtkTextBuffer *buff, GtkTextIter *location, GtkTextChildAnchor *anchor,
+                                   gpointer data)
+{
+    if (recording())
+        stale = TRUE;
+
+    on_insert_text(buff, location, (gchar *) "\xef\xbf\xbc", 3, data);
+}
+
+static void on_delete_range(GtkTextBuffer *buff, GtkTextIter *start, GtkTextIter *end, gpointer data)
+{
+    gint from = gtk_text_iter_get_offset(start);
+
+    if (recording())
+        add_record(JOURNAL_DELETE, from, gtk_text_iter_get_offset(end) - from, NULL, 0);
+}
+
+// records a tag change. The first time a tag appears in a journal its definition is written too, so tags
+// made after the document was saved, such as new indent levels, exist again when the journal is replayed.
+
+static void record_tag(guint32 type, GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end)
+{
+    gchar *name = NULL;
+    gint from = gtk_text_iter_get_offset(start);
+
+    if (!recording() || fileio_tag_excluded(tag))
+        return;
+
+    g_object_get(tag, "name", &name, NULL);
+    if (!name)
+        return;
+
+    if (!g_hash_table_contains(definedTags, name))
+    {
+        GPtrArray *attrs = fileio_tag_attrs(tag);
+        GByteArray *def = g_byte_array_new();
+        guint i;
+
+        g_byte_array_append(def, (const guint8 *) name, strlen(name) + 1);
+        for (i = 0; i < attrs->len; i++)
+        {
+            const gchar *field = g_ptr_array_index(attrs, i);
+            g_byte_array_append(def, (const guint8 *) field, strlen(field) + 1);
+        }
+
+        add_record(JOURNAL_DEFINE_TAG, 0, 0, def->data, def->len);
+        g_hash_table_add(definedTags, g_strdup(name));
+        g_byte_array_unref(def);
+        g_ptr_array_unref(attrs);
+    }
+
+    add_record(type, from, gtk_text_iter_get_offset(end) - from, name, strlen(name) + 1);
+    g_free(name);
+}
+
+static void on_apply_tag(GtkTextBuffer *buff, GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end, gpointer data)
+{
+    record_tag(JOURNAL_APPLY_TAG, tag, start, end);
+}
+
+static void on_remove_tag(GtkTextBuffer *buff, GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end,
+                          gpointer data)
+{
+    record_tag(JOURNAL_REMOVE_TAG, tag, start, end);
+}
+
+// fills in the header identifying the document a journal belongs to
+
+static gboolean base_header(const gchar *base, JournalHeader *header)
+{
+    struct stat st;
+
+    if (stat(base, &st) != 0)
+        return FALSE;
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->bom = JOURNAL_BOM;
+    header->version = JOURNAL_VERSION;
+    header->baseSize = st.st_size;
+    header->baseSec = st.st_mtim.tv_sec;
+    header->baseNsec = st.st_mtim.tv_nsec;
+
+    return TRUE;
+}
+
+static gboolean write_all(int fd, const void *data, gsize len)
+{
+    const guint8 *p = data;
+
+    while (len)
+    {
+        ssize_t got = write(fd, p, len);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return FALSE;
+
+        p += got;
+        len -= got;
+    }
+
+    return TRUE;
+}
+
+// appends records to a journal file and syncs it. A missing journal, or one written against another version
+// of the document, is started again with a fresh header.
+
+static void append_journal(JournalOp *op)
+{
+    JournalHeader want, have;
+    int fd = open(op->path, O_RDWR | O_CREAT, 0644);
+    off_t end;
+
+    if (fd < 0 || !base_header(op->base, &want))
+        goto fail;
+
+    if (pread(fd, &have, sizeof(have), 0) != sizeof(have) || memcmp(&have, &want, sizeof(want)) != 0)
+    {
+        if (ftruncate(fd, 0) != 0 || !write_all(fd, &want, sizeof(want)))
+            goto fail;
+    }
+
+    end = lseek(fd, 0, SEEK_END);
+    if (end < 0 || !write_all(fd, op->records->data, op->records->len) || fsync(fd) != 0)
+        goto fail;
+
+    op->size = end + op->records->len;
+    close(fd);
+
+    return;
+
+fail:
+    op->error = g_strdup_printf("%s: %s", op->path, g_strerror(errno));
+    if (fd >= 0)
+        close(fd);
+}
+
+// reports a finished journal write back on the main loop, compacting once the journal has grown too large
+
+static gboolean journal_op_done(gpointer data)
+{
+    JournalOp *op = data;
+
+    opsQueued--;
+
+    if (op->error)
+        stale = TRUE;
+
+    if (op->doneFunc)
+        op->doneFunc(op->error, op->data);
+
+    if (!op->error && op->size > JOURNAL_COMPACT_BYTES && basePath && strcmp(basePath, op->base) == 0)
+    {
+        DEB("Compacting %s\n", op->base);
+        journal_full_save(op->base, NULL, NULL);
+    }
+
+    g_free(op->path);
+    g_free(op->base);
+    if (op->records)
+        g_byte_array_unref(op->records);
+    g_free(op->error);
+    g_free(op);
+
+    return G_SOURCE_REMOVE;
+}
+
+// body of the journal thread. There is only one, so writes reach the file in the order they were queued.
+
+static void journal_thread(gpointer data, gpointer unused)
+{
+    TRACE_SCOPE(TRACE_SPAN, "journal_thread");
+
+    JournalOp *op = data;
+
+    if (op->remove)
+    {
+        if (unlink(op->path) != 0 && errno != ENOENT)
+            op->error = g_strdup_printf("%s: %s", op->path, g_strerror(errno));
+    }
+    else
+        append_journal(op);
+
+    g_idle_add(journal_op_done, op);
+}
+
+static void queue_op(const gchar *base, GByteArray *records, FileioDoneFunc done, gpointer data)
+{
+    JournalOp *op = g_new0(JournalOp, 1);
+
+    op->base = g_strdup(base);
+    op->path = g_strconcat(base, ".journal", NULL);
+    op->records = records;
+    op->remove = records == NULL;
+    op->doneFunc = done;
+    op->data = data;
+
+    opsQueued++;
+    g_thread_pool_push(writer, op, NULL);
+}
+
+// starts recording edits against a document, after it has been loaded or written in full. NULL stops
+// recording, as when another document starts loading.
+
+void journal_track(const gchar *path)
+{
+    g_free(basePath);
+    basePath = g_strdup(path);
+
+    g_byte_array_set_size(pending, 0);
+    g_hash_table_remove_all(definedTags);
+
+    // edits made while a document was loading were never recorded against it
+
+    stale = path && untracked;
+    untracked = FALSE;
+}
+
+// returns the document edits are being recorded against, or NULL
+
+const gchar *journal_path(void)
+{
+    return basePath;
+}
+
+// applies one journal record to the buffer, returning false if it does not fit the text
+
+static gboolean replay_record(const JournalRecord *record, const gchar *payload)
+{
+    GtkTextTagTable *table = gtk_text_buffer_get_tag_table(journalBuff);
+    gint chars = gtk_text_buffer_get_char_count(journalBuff);
+    GtkTextIter start, end;
+    GtkTextTag *tag;
+
+    if (record->type == JOURNAL_DEFINE_TAG)
+    {
+        GPtrArray *attrs = g_ptr_array_new();
+        const gchar *p = payload + strlen(payload) + 1;
+
+        while (p < payload + record->size)
+        {
+            g_ptr_array_add(attrs, (gpointer) p);
+            p += strlen(p) + 1;
+        }
+
+        fileio_define_tag(journalBuff, payload, attrs);
+        g_hash_table_add(definedTags, g_strdup(payload));
+        g_ptr_array_unref(attrs);
+
+        return TRUE;
+    }
+
+    if (record->offset > (guint32) chars)
+        return FALSE;
+
+    gtk_text_buffer_get_iter_at_offset(journalBuff, &start, record->offset);
+
+    switch (record->type)
+    {
+    case JOURNAL_INSERT:
+        if (!g_utf8_validate(payload, record->size, NULL))
+            return FALSE;
+        gtk_text_buffer_insert(journalBuff, &start, payload, record->size);
+        return TRUE;
+
+    case JOURNAL_DELETE:
+    case JOURNAL_APPLY_TAG:
+    case JOURNAL_REMOVE_TAG:
+        if (record->length > (guint32) chars - record->offset)
+            return FALSE;
+        gtk_text_buffer_get_iter_at_offset(journalBuff, &end, record->offset + record->length);
+        break;
+
+    default:
+        return FALSE;
+    }
+
+    if (record->type == JOURNAL_DELETE)
+    {
+        gtk_text_buffer_delete(journalBuff, &start, &end);
+        return TRUE;
+    }
+
+    tag = gtk_text_tag_table_lookup(table, payload);
+    if (!tag)
+        return FALSE;
+
+    if (record->type == JOURNAL_APPLY_TAG)
+        gtk_text_buffer_apply_tag(journalBuff, tag, &start, &end);
+    else
+        gtk_text_buffer_remove_tag(journalBuff, tag, &start, &end);
+
+    return TRUE;
+}
+
+// applies the journal of a freshly loaded document, bringing the buffer up to its last save. Replay stops
+// at the first record which is cut short or does not fit, which is where a crash during a write would
+// leave the journal.
+
+gboolean journal_replay(const gchar *path)
+{
+    TRACE_SCOPE(TRACE_SPAN, "journal_replay");
+
+    gchar *journal = g_strconcat(path, ".journal", NULL);
+    gchar *contents = NULL;
+    gsize length, pos;
+    JournalHeader want;
+    guint count = 0;
+
+    if (!g_file_get_contents(journal, &contents, &length, NULL) || !base_header(path, &want)
+        || length < sizeof(want) || memcmp(contents, &want, sizeof(want)) != 0)
+    {
+        g_free(journal);
+        g_free(contents);
+        return FALSE;
+    }
+
+    replaying = TRUE;
+
+    for (pos = sizeof(want); pos + sizeof(JournalRecord) <= length; count++)
+    {
+        JournalRecord record;
+        const gchar *payload = contents + pos + sizeof(record);
+
+        memcpy(&record, contents + pos, sizeof(record));
+        if (record.size > length - pos - sizeof(record))
+            break;
+
+        // names are nul terminated, anything else would run off the end of the payload
+
+        if (record.type != JOURNAL_INSERT && record.type != JOURNAL_DELETE
+            && (record.size == 0 || payload[record.size - 1] != '\0'))
+            break;
+
+        if (!replay_record(&record, payload))
+            break;
+
+        pos += sizeof(record) + record.size;
+    }
+
+    replaying = FALSE;
+
+    DEB("Replayed %u journal records from %s\n", count, journal);
+    g_free(journal);
+    g_free(contents);
+
+    return TRUE;
+}
+
+// a full save has finished, the journal of the version it replaced is removed and any save which waited for
+// it goes ahead
+
+static void full_save_done(const gchar *error, gpointer data)
+{
+    FullSave *save = data;
+
+    fullSaves--;
+
+    if (!error)
+        queue_op(save->path, NULL, NULL, NULL);
+    else if (basePath && strcmp(basePath, save->path) == 0)
+        stale = TRUE;
+
+    if (save->doneFunc)
+        save->doneFunc(error, save->data);
+
+    if (savePending && !fullSaves && basePath)
+    {
+        savePending = FALSE;
+        journal_save(pendingDone, pendingData);
+    }
+
+    g_free(save->path);
+    g_free(save);
+}
+
+// writes the whole document to path and records further edits against it. The buffer is snapshotted before
+// this returns, so edits made while the write is running go to the next journal.
+
+void journal_full_save(const gchar *path, FileioDoneFunc done, gpointer data)
+{
+    TRACE_SCOPE(TRACE_SPAN, "journal_full_save");
+
+    FullSave *save = g_new0(FullSave, 1);
+
+    save->path = g_strdup(path);
+    save->doneFunc = done;
+    save->data = data;
+
+    fullSaves++;
+    untracked = FALSE;
+    journal_track(path);
+    fileio_save_async(journalBuff, path, full_save_done, save);
+}
+
+// saves the edits made since the last save by appending them to the journal, so the cost follows the size
+// of the edits rather than the document. Returns false if there is no document yet to save into.
+
+gboolean journal_save(FileioDoneFunc done, gpointer data)
+{
+    TRACE_SCOPE(TRACE_SPAN, "journal_save");
+
+    if (!basePath)
+        return FALSE;
+
+    if (stale)
+    {
+        journal_full_save(basePath, done, data);
+        return TRUE;
+    }
+
+    if (fullSaves)
+    {
+        savePending = TRUE;
+        pendingDone = done;
+        pendingData = data;
+        return TRUE;
+    }
+
+    if (!pending->len)
+    {
+        if (done)
+            done(NULL, data);
+        return TRUE;
+    }
+
+    queue_op(basePath, pending, done, data);
+    pending = g_byte_array_new();
+
+    return TRUE;
+}
+
+// returns true until every save asked for, journalled or full, has finished and reported back
+
+gboolean journal_busy(void)
+{
+    return opsQueued || fullSaves || savePending;
+}
+
+// starts recording the edits made to a buffer
+
+void journal_attach(GtkTextBuffer *buff)
+{
+    journalBuff = buff;
+    pending = g_byte_array_new();
+    definedTags = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    writer = g_thread_pool_new(journal_thread, NULL, 1, FALSE, NULL);
+
+    handlers[0] = g_signal_connect(buff, "insert-text", G_CALLBACK(on_insert_text), NULL);
+    handlers[1] = g_signal_connect(buff, "delete-range", G_CALLBACK(on_delete_range), NULL);
+    handlers[2] = g_signal_connect(buff, "apply-tag", G_CALLBACK(on_apply_tag), NULL);
+    handlers[3] = g_signal_connect(buff, "remove-tag", G_CALLBACK(on_remove_tag), NULL);
+    handlers[4] = g_signal_connect(buff, "insert-child-anchor", G_CALLBACK(on_insert_child_anchor), NULL);
+}
+
+// waits for queued journal writes and stops recording
+
+void journal_detach(void)
+{
+    guint i;
+
+    if (!journalBuff)
+        return;
+
+    for (i = 0; i < G_N_ELEMENTS(handlers); i++)
+        g_signal_handler_disconnect(journalBuff, handlers[i]);
+
+    g_thread_pool_free(writer, FALSE, TRUE);
+    g_byte_array_unref(pending);
+    g_hash_table_unref(definedTags);
+    g_free(basePath);
+    basePath = NULL;
+    journalBuff = NULL;
+}
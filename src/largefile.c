@@ -0,0 +1,812 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "largefile.h"
+#include "debugmsg.h"
+#include "spellcheck.h"
+#include "trace.h"
+
+// the window moves once the view scrolls within this fraction of either end of the text it holds
+
+#define LARGEFILE_EDGE 0.2
+
+// searches scan the mapping this many bytes at a time, checking for cancellation in between
+
+#define LARGEFILE_SEARCH_BYTES (4 << 20)
+
+// where a chunk starts in the file and how many lines come before it
+
+typedef struct
+{
+    guint64 offset;
+    guint64 line;
+} LargeChunk;
+
+// a mapped file and its chunk index. The index has one entry past the last chunk marking the end of the file,
+// so a chunk always ends where the next begins. Worker threads hold a reference while they read the mapping.
+
+typedef struct
+{
+    gint refs;
+    gchar *path;
+    const gchar *base;
+    gsize size;
+    GArray *chunks;
+    GCancellable *cancel;
+    FileioDoneFunc doneFunc;
+    gpointer data;
+} LargeFile;
+
+// a search or misspelling scan, started at a byte offset and wrapping round to it
+
+typedef enum
+{
+    SEEK_TEXT,
+    SEEK_MISSPELLING
+} SeekKind;
+
+typedef struct
+{
+    LargeFile *file;
+    SeekKind kind;
+    gchar *needle;
+    gsize needleLen;
+    guint64 from;
+    guint64 found;
+    gsize foundLen;
+} SeekJob;
+
+// the file being viewed and the window of its chunks in the buffer. Each chunk in the window has a mark
+// at its start, left in place by text inserted after it, with room for one more as the window moves.
+
+static EditorContext *largeEditor;
+static LargeFile *large;
+static guint windowFirst, windowCount;
+static GtkTextMark *chunkMarks[LARGEFILE_WINDOW_CHUNKS + 1];
+static gulong scrollHandler;
+static guint shiftSource;
+static GCancellable *seeking;
+
+// indexing threads whose result has not been handled yet, including those for files since closed
+
+static guint indexTasks;
+
+// takes a reference on a file for a worker
+
+static LargeFile *large_ref(LargeFile *file)
+{
+    g_atomic_int_inc(&file->refs);
+    return file;
+}
+
+// drops a reference, the mapping goes with the last one
+
+static void large_unref(gpointer data)
+{
+    LargeFile *file = data;
+
+    if (!g_atomic_int_dec_and_test(&file->refs))
+        return;
+
+    munmap((void *) file->base, file->size);
+    g_array_free(file->chunks, TRUE);
+    g_object_unref(file->cancel);
+    g_free(file->path);
+    g_free(file);
+}
+
+// the number of chunks in an indexed file
+
+static guint chunk_count(LargeFile *file)
+{
+    return file->chunks->len ? file->chunks->len - 1 : 0;
+}
+
+// returns the bytes of a chunk in the mapping
+
+static const gchar *chunk_text(LargeFile *file, guint chunk, gsize *len)
+{
+    LargeChunk *start = &g_array_index(file->chunks, LargeChunk, chunk);
+
+    *len = (start + 1)->offset - start->offset;
+
+    return file->base + start->offset;
+}
+
+// finds the chunk holding a byte offset
+
+static guint chunk_at(LargeFile *file, guint64 offset)
+{
+    guint low = 0, high = chunk_count(file);
+
+    while (high - low > 1)
+    {
+        guint mid = (low + high) / 2;
+
+        if (g_array_index(file->chunks, LargeChunk, mid).offset <= offset)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+// lets the kernel drop the pages of a range, they are read back from the file if they are touched again.
+// Only clean file pages are ever mapped, so this keeps the editor's memory flat however far it has read.
+
+static void release_pages(LargeFile *file, guint64 offset, guint64 len)
+{
+    guint64 page = sysconf(_SC_PAGESIZE);
+    guint64 start = offset & ~(page - 1);
+    guint64 end = MIN(offset + len, file->size);
+
+    if (end > start)
+        madvise((void *) (file->base + start), end - start, MADV_DONTNEED);
+}
+
+// counts the newlines in a run of bytes
+
+static guint64 count_lines(const gchar *text, gsize len)
+{
+    const gchar *end = text + len;
+    guint64 lines = 0;
+
+    while ((text = memchr(text, '\n', end - text)))
+    {
+        lines++;
+        text++;
+    }
+
+    return lines;
+}
+
+// splits the mapping into chunks on a worker thread. A chunk ends after the first newline past its nominal
+// size, or failing that on a character boundary, so no line or character is split between two chunks.
+
+static void index_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancel)
+{
+    TRACE_SCOPE(TRACE_SPAN, "index_thread");
+
+    LargeFile *file = data;
+    guint64 pos = 0, line = 0;
+    LargeChunk end;
+
+    madvise((void *) file->base, file->size, MADV_SEQUENTIAL);
+
+    while (pos < file->size)
+    {
+        LargeChunk chunk = { pos, line };
+        guint64 cut = pos + LARGEFILE_CHUNK_BYTES;
+
+        if (g_cancellable_is_cancelled(cancel))
+        {
+            g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_CANCELLED, FILEIO_CANCELLED);
+            return;
+        }
+
+        g_array_append_val(file->chunks, chunk);
+
+        if (cut >= file->size)
+            cut = file->size;
+        else
+        {
+            const gchar *newline = memchr(file->base + cut, '\n', MIN(LARGEFILE_CHUNK_BYTES, file->size - cut));
+
+            if (newline)
+                cut = newline - file->base + 1;
+            else
+                while (cut > pos + 1 && (file->base[cut] & 0xc0) == 0x80)
+                    cut--;
+        }
+
+        line += count_lines(file->base + pos, cut - pos);
+        release_pages(file, pos, cut - pos);
+        pos = cut;
+    }
+
+    end.offset = file->size;
+    end.line = line;
+    g_array_append_val(file->chunks, end);
+
+    madvise((void *) file->base, file->size, MADV_RANDOM);
+
+    g_task_return_boolean(task, TRUE);
+}
+
+// inserts a chunk at an iter without it counting as an edit. Bytes which are not utf-8 are replaced so the
+// buffer accepts them.
+
+static void insert_chunk(guint chunk, GtkTextIter *iter)
+{
+    gsize len;
+    const gchar *text = chunk_text(large, chunk, &len);
+
+    fileio_set_inserting(TRUE);
+
+    if (g_utf8_validate(text, len, NULL))
+        gtk_text_buffer_insert(largeEditor->buff, iter, text, len);
+    else
+    {
+        gchar *valid = g_utf8_make_valid(text, len);
+
+        gtk_text_buffer_insert(largeEditor->buff, iter, valid, -1);
+        g_free(valid);
+    }
+
+    fileio_set_inserting(FALSE);
+}
+
+// removes the text between two iters without it counting as an edit
+
+static void remove_text(GtkTextIter *start, GtkTextIter *end)
+{
+    fileio_set_inserting(TRUE);
+    gtk_text_buffer_delete(largeEditor->buff, start, end);
+    fileio_set_inserting(FALSE);
+}
+
+// empties the window, leaving the buffer empty too
+
+static void clear_window(void)
+{
+    GtkTextIter start, end;
+    guint i;
+
+    for (i = 0; i < windowCount; i++)
+        gtk_text_buffer_delete_mark(largeEditor->buff, chunkMarks[i]);
+    windowCount = 0;
+
+    gtk_text_buffer_get_bounds(largeEditor->buff, &start, &end);
+    remove_text(&start, &end);
+}
+
+// fills the window with the chunks from first on, pulled back so it is full where the file allows
+
+static void show_window(guint first)
+{
+    guint count = chunk_count(large);
+    GtkTextIter end;
+
+    clear_window();
+
+    windowFirst = count > LARGEFILE_WINDOW_CHUNKS ? MIN(first, count - LARGEFILE_WINDOW_CHUNKS) : 0;
+
+    while (windowCount < LARGEFILE_WINDOW_CHUNKS && windowFirst + windowCount < count)
+    {
+        gtk_text_buffer_get_end_iter(largeEditor->buff, &end);
+        chunkMarks[windowCount] = gtk_text_buffer_create_mark(largeEditor->buff, NULL, &end, TRUE);
+        insert_chunk(windowFirst + windowCount, &end);
+        windowCount++;
+    }
+}
+
+// brings the next chunk into the window, dropping the first once the window is full
+
+static gboolean shift_forward(void)
+{
+    GtkTextIter start, end;
+
+    if (windowFirst + windowCount >= chunk_count(large))
+        return FALSE;
+
+    gtk_text_buffer_get_end_iter(largeEditor->buff, &end);
+    chunkMarks[windowCount] = gtk_text_buffer_create_mark(largeEditor->buff, NULL, &end, TRUE);
+    insert_chunk(windowFirst + windowCount, &end);
+
+    if (++windowCount <= LARGEFILE_WINDOW_CHUNKS)
+        return TRUE;
+
+    gtk_text_buffer_get_start_iter(largeEditor->buff, &start);
+    gtk_text_buffer_get_iter_at_mark(largeEditor->buff, &end, chunkMarks[1]);
+    remove_text(&start, &end);
+    gtk_text_buffer_delete_mark(largeEditor->buff, chunkMarks[0]);
+    release_pages(large, g_array_index(large->chunks, LargeChunk, windowFirst).offset,
+                  g_array_index(large->chunks, LargeChunk, windowFirst + 1).offset
+                  - g_array_index(large->chunks, LargeChunk, windowFirst).offset);
+
+    memmove(chunkMarks, chunkMarks + 1, LARGEFILE_WINDOW_CHUNKS * sizeof(*chunkMarks));
+    windowCount--;
+    windowFirst++;
+
+    return TRUE;
+}
+
+// brings the chunk before the window in at the top, dropping the last
+
+static gboolean shift_back(void)
+{
+    GtkTextIter start, end;
+    guint last;
+
+    if (windowFirst == 0)
+        return FALSE;
+
+    // the old first mark sits at the insertion point, it is moved past the new chunk once it is in
+
+    gtk_text_buffer_get_start_iter(largeEditor->buff, &start);
+    insert_chunk(windowFirst - 1, &start);
+    gtk_text_buffer_move_mark(largeEditor->buff, chunkMarks[0], &start);
+
+    gtk_text_buffer_get_start_iter(largeEditor->buff, &start);
+    memmove(chunkMarks + 1, chunkMarks, windowCount * sizeof(*chunkMarks));
+    chunkMarks[0] = gtk_text_buffer_create_mark(largeEditor->buff, NULL, &start, TRUE);
+    windowFirst--;
+    windowCount++;
+
+    if (windowCount <= LARGEFILE_WINDOW_CHUNKS)
+        return TRUE;
+
+    last = windowCount - 1;
+    gtk_text_buffer_get_iter_at_mark(largeEditor->buff, &start, chunkMarks[last]);
+    gtk_text_buffer_get_end_iter(largeEditor->buff, &end);
+    remove_text(&start, &end);
+    gtk_text_buffer_delete_mark(largeEditor->buff, chunkMarks[last]);
+    release_pages(large, g_array_index(large->chunks, LargeChunk, windowFirst + last).offset,
+                  g_array_index(large->chunks, LargeChunk, windowFirst + last + 1).offset
+                  - g_array_index(large->chunks, LargeChunk, windowFirst + last).offset);
+    windowCount--;
+
+    return TRUE;
+}
+
+// moves the window when the view is near either end of it. The line at the top of the view is marked first
+// and scrolled back to afterwards, so the text does not jump as chunks come and go.
+
+static gboolean check_window(gpointer data)
+{
+    TRACE_SCOPE(TRACE_DETAIL, "check_window");
+
+    GtkAdjustment *adj = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(largeEditor->view));
+    gdouble value = gtk_adjustment_get_value(adj);
+    gdouble upper = gtk_adjustment_get_upper(adj);
+    gdouble page = gtk_adjustment_get_page_size(adj);
+    gboolean forward = value + page >= upper * (1 - LARGEFILE_EDGE);
+    gboolean back = !forward && value <= upper * LARGEFILE_EDGE;
+    GdkRectangle visible;
+    GtkTextIter top;
+    GtkTextMark *mark;
+    gboolean shifted;
+
+    if (!forward && !back)
+    {
+        shiftSource = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    gtk_text_view_get_visible_rect(largeEditor->view, &visible);
+    gtk_text_view_get_line_at_y(largeEditor->view, &top, visible.y, NULL);
+    mark = gtk_text_buffer_create_mark(largeEditor->buff, NULL, &top, TRUE);
+
+    shifted = forward ? shift_forward() : shift_back();
+
+    gtk_text_view_scroll_to_mark(largeEditor->view, mark, 0, TRUE, 0, 0);
+    gtk_text_buffer_delete_mark(largeEditor->buff, mark);
+
+    // keep going while the view is still near an edge, which it is after a long jump of the scrollbar
+
+    if (shifted)
+        return G_SOURCE_CONTINUE;
+
+    shiftSource = 0;
+    return G_SOURCE_REMOVE;
+}
+
+// checks the window once the scrolling has settled
+
+static void on_scroll(GtkAdjustment *adj, gpointer data)
+{
+    if (!shiftSource)
+        shiftSource = g_idle_add(check_window, NULL);
+}
+
+// shows a window once the file is indexed and hands the result to the caller
+
+static void index_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+    LargeFile *file = g_task_get_task_data(G_TASK(result));
+    GtkAdjustment *adj;
+    GError *err = NULL;
+
+    indexTasks--;
+
+    // a file closed or replaced while it was indexed reports the cancel as a load does, even if indexing
+    // finished first, so nothing was shown
+
+    if (file != large || g_cancellable_is_cancelled(file->cancel))
+    {
+        file->doneFunc(FILEIO_CANCELLED, file->data);
+        return;
+    }
+
+    if (!g_task_propagate_boolean(G_TASK(result), &err))
+    {
+        file->doneFunc(err->message, file->data);
+        g_error_free(err);
+        return;
+    }
+
+    adj = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(largeEditor->view));
+
+    DEB("Indexed %s: %u chunks, %lu lines\n", file->path, chunk_count(file), (unsigned long) largefile_lines());
+
+    show_window(0);
+    scrollHandler = g_signal_connect(adj, "value-changed", G_CALLBACK(on_scroll), NULL);
+
+    file->doneFunc(NULL, file->data);
+}
+
+// returns true for a plain text file too big to load whole
+
+gboolean largefile_wanted(const gchar *path)
+{
+    gchar head[64];
+    struct stat info;
+    gssize got;
+    int fd;
+
+    if (stat(path, &info) != 0 || info.st_size < LARGEFILE_THRESHOLD)
+        return FALSE;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return FALSE;
+
+    got = read(fd, head, sizeof(head));
+    close(fd);
+
+    return got > 0 && fileio_is_plain(head, got);
+}
+
+// maps a file and indexes it on a worker thread, then shows its first chunks read-only. Only the window of
+// chunks around the view is ever in the buffer. done is called on the main loop once the window is showing.
+
+void largefile_open(EditorContext *editor, const gchar *path, FileioDoneFunc done, gpointer data)
+{
+    LargeFile *file;
+    struct stat info;
+    GTask *task;
+    void *base;
+    int fd;
+
+    largefile_close();
+    fileio_cancel();
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        done("Cannot open file", data);
+        return;
+    }
+
+    base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+    {
+        done("Cannot map file", data);
+        return;
+    }
+
+    file = g_new0(LargeFile, 1);
+    file->refs = 1;
+    file->path = g_strdup(path);
+    file->base = base;
+    file->size = info.st_size;
+    file->chunks = g_array_sized_new(FALSE, FALSE, sizeof(LargeChunk), info.st_size / LARGEFILE_CHUNK_BYTES + 2);
+    file->cancel = g_cancellable_new();
+    file->doneFunc = done;
+    file->data = data;
+
+    large = file;
+    largeEditor = editor;
+
+    fileio_set_inserting(TRUE);
+    gtk_text_buffer_set_text(editor->buff, "", 0);
+    fileio_set_inserting(FALSE);
+    gtk_text_view_set_editable(editor->view, FALSE);
+
+    task = g_task_new(NULL, file->cancel, index_done, NULL);
+    g_task_set_task_data(task, large_ref(file), large_unref);
+    indexTasks++;
+    g_task_run_in_thread(task, index_thread);
+    g_object_unref(task);
+}
+
+// leaves large file mode, stopping any indexing or search and making the view editable again. The text in
+// the window is left for the next load to replace.
+
+void largefile_close(void)
+{
+    if (!large)
+        return;
+
+    if (seeking)
+    {
+        g_cancellable_cancel(seeking);
+        g_clear_object(&seeking);
+    }
+    g_cancellable_cancel(large->cancel);
+
+    if (scrollHandler)
+    {
+        GtkAdjustment *adj = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(largeEditor->view));
+
+        g_signal_handler_disconnect(adj, scrollHandler);
+        scrollHandler = 0;
+    }
+    if (shiftSource)
+    {
+        g_source_remove(shiftSource);
+        shiftSource = 0;
+    }
+
+    while (windowCount)
+        gtk_text_buffer_delete_mark(largeEditor->buff, chunkMarks[--windowCount]);
+    windowFirst = 0;
+
+    gtk_text_view_set_editable(largeEditor->view, TRUE);
+
+    large_unref(large);
+    large = NULL;
+}
+
+// returns true while a file is being indexed, or a cancelled index has yet to report back
+
+gboolean largefile_indexing(void)
+{
+    return indexTasks > 0;
+}
+
+// returns true while a large file is shown
+
+gboolean largefile_active(void)
+{
+    return large != NULL;
+}
+
+// returns the number of lines in the large file, 0 until it is indexed
+
+guint64 largefile_lines(void)
+{
+    if (!large || !large->chunks->len)
+        return 0;
+
+    return g_array_index(large->chunks, LargeChunk, large->chunks->len - 1).line;
+}
+
+// finds the byte offset in the file of an iter in the window
+
+static guint64 iter_offset(GtkTextIter *iter)
+{
+    guint k = 0, chars;
+    const gchar *text, *at;
+    GtkTextIter mark;
+    gsize len;
+
+    while (k + 1 < windowCount)
+    {
+        gtk_text_buffer_get_iter_at_mark(largeEditor->buff, &mark, chunkMarks[k + 1]);
+        if (gtk_text_iter_compare(&mark, iter) > 0)
+            break;
+        k++;
+    }
+
+    if (!windowCount)
+        return 0;
+
+    gtk_text_buffer_get_iter_at_mark(largeEditor->buff, &mark, chunkMarks[k]);
+    chars = gtk_text_iter_get_offset(iter) - gtk_text_iter_get_offset(&mark);
+    text = chunk_text(large, windowFirst + k, &len);
+
+    // count characters through the mapping, stopping at the chunk's end should invalid bytes make it short
+
+    for (at = text; chars && at < text + len; chars--)
+        at = g_utf8_next_char(at);
+
+    return MIN(at, text + len) - large->base;
+}
+
+// looks for text in the mapping from an offset onwards, wrapping round to the start of the file
+
+static gboolean seek_text(GCancellable *cancel, SeekJob *job)
+{
+    LargeFile *file = job->file;
+    guint64 pos = job->from, scanned = 0;
+
+    while (scanned < file->size)
+    {
+        guint64 len = MIN((guint64) LARGEFILE_SEARCH_BYTES, file->size - pos);
+        guint64 span = MIN(len + job->needleLen - 1, file->size - pos);
+        const gchar *hit;
+
+        if (g_cancellable_is_cancelled(cancel))
+            return FALSE;
+
+        // each slice reaches a needle's length past its end, so matches across slices are still found
+
+        hit = memmem(file->base + pos, span, job->needle, job->needleLen);
+        release_pages(file, pos, len);
+
+        if (hit)
+        {
+            job->found = hit - file->base;
+            job->foundLen = job->needleLen;
+            return TRUE;
+        }
+
+        scanned += len;
+        pos += len;
+        if (pos >= file->size)
+            pos = 0;
+    }
+
+    return FALSE;
+}
+
+// spellchecks the mapping a chunk at a time from an offset onwards, wrapping round to the start of the file.
+// Chunks end on line breaks so no word is cut in two.
+
+static gboolean seek_misspelling(GCancellable *cancel, SeekJob *job)
+{
+    LargeFile *file = job->file;
+    SpellcheckResult result = { 0 };
+    guint count = chunk_count(file);
+    guint first = chunk_at(file, job->from);
+    gboolean found = FALSE;
+    guint i;
+
+    for (i = 0; i <= count && !found; i++)
+    {
+        guint chunk = (first + i) % count;
+        guint64 start = g_array_index(file->chunks, LargeChunk, chunk).offset;
+        gsize len, k;
+        const gchar *text = chunk_text(file, chunk, &len);
+
+        if (g_cancellable_is_cancelled(cancel))
+            break;
+
+        spellcheck_checkstring(text, len, &result);
+        release_pages(file, start, len);
+
+        for (k = 0; k < result.count && !found; k++)
+        {
+            guint64 at = start + result.spans[k].offset;
+
+            // the first chunk is looked at twice, once after the offset and again at the end for before it
+
+            if ((i == 0 && at < job->from) || (i == count && at >= job->from))
+                continue;
+
+            job->found = at;
+            job->foundLen = result.spans[k].length;
+            found = TRUE;
+        }
+    }
+
+    spellcheck_result_free(&result);
+
+    return found;
+}
+
+// runs a search or misspelling scan on a worker thread
+
+static void seek_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancel)
+{
+    TRACE_SCOPE(TRACE_SPAN, "seek_thread");
+
+    SeekJob *job = data;
+    gboolean found = job->kind == SEEK_TEXT ? seek_text(cancel, job) : seek_misspelling(cancel, job);
+
+    g_task_return_boolean(task, found);
+}
+
+// releases a finished scan
+
+static void free_seek(gpointer data)
+{
+    SeekJob *job = data;
+
+    large_unref(job->file);
+    g_free(job->needle);
+    g_free(job);
+}
+
+// selects what a scan found, moving the window to it if it lies outside
+
+static void seek_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+    SeekJob *job = g_task_get_task_data(G_TASK(result));
+    GtkTextIter start, end;
+    const gchar *at;
+    guint chunk;
+    glong chars;
+
+    if (!g_task_propagate_boolean(G_TASK(result), NULL))
+    {
+        if (!g_cancellable_is_cancelled(g_task_get_cancellable(G_TASK(result))))
+            printf("No more %s\n", job->kind == SEEK_TEXT ? "matches" : "misspellings");
+        return;
+    }
+
+    if (job->file != large)
+        return;
+
+    chunk = chunk_at(large, job->found);
+    if (chunk < windowFirst || chunk >= windowFirst + windowCount)
+        show_window(chunk ? chunk - 1 : 0);
+
+    at = large->base + g_array_index(large->chunks, LargeChunk, chunk).offset;
+    chars = g_utf8_strlen(at, large->base + job->found - at);
+
+    gtk_text_buffer_get_iter_at_mark(largeEditor->buff, &start, chunkMarks[chunk - windowFirst]);
+    gtk_text_iter_forward_chars(&start, chars);
+    end = start;
+    gtk_text_iter_forward_chars(&end, g_utf8_strlen(large->base + job->found, job->foundLen));
+
+    gtk_text_buffer_select_range(largeEditor->buff, &start, &end);
+    gtk_text_view_scroll_to_iter(largeEditor->view, &start, 0.1, FALSE, 0, 0);
+}
+
+// starts a scan from just past the cursor, cancelling any still running
+
+static void start_seek(SeekKind kind, const gchar *needle)
+{
+    SeekJob *job;
+    GtkTextIter cursor;
+    GTask *task;
+
+    if (!large || !windowCount)
+        return;
+
+    if (seeking)
+    {
+        g_cancellable_cancel(seeking);
+        g_object_unref(seeking);
+    }
+    seeking = g_cancellable_new();
+
+    gtk_text_buffer_get_iter_at_mark(largeEditor->buff, &cursor, gtk_text_buffer_get_insert(largeEditor->buff));
+    gtk_text_iter_forward_char(&cursor);
+
+    job = g_new0(SeekJob, 1);
+    job->file = large_ref(large);
+    job->kind = kind;
+    job->needle = g_strdup(needle);
+    job->needleLen = needle ? strlen(needle) : 0;
+    job->from = MIN(iter_offset(&cursor), large->size - 1);
+
+    task = g_task_new(NULL, seeking, seek_done, NULL);
+    g_task_set_task_data(task, job, free_seek);
+    g_task_run_in_thread(task, seek_thread);
+    g_object_unref(task);
+}
+
+// searches the whole file for text, on a worker thread over the mapping, and selects the next match
+
+void largefile_find(const gchar *needle)
+{
+    if (needle && *needle)
+        start_seek(SEEK_TEXT, needle);
+}
+
+// spellchecks the whole file on a worker thread over the mapping and selects the next misspelt word
+
+void largefile_next_misspelling(void)
+{
+    start_seek(SEEK_MISSPELLING, NULL);
+}
@@ -0,0 +1,264 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <gtk/gtk.h>
+
+#include "latency.h"
+#include "debugmsg.h"
+
+static const gchar *metricNames[LATENCY_COUNT] = {
+    "key to paint", "change to paint", "key handlers", "frame layout", "frame paint"
+};
+
+static LatencyHistogram histograms[LATENCY_COUNT];
+
+// the widgets being watched and the handlers connected to them
+
+static EditorContext *latencyEditor;
+static GdkFrameClock *frameClock;
+static gulong keyHandler, afterHandler, changedHandler, realizeHandler;
+static gulong frameHandlers[3];
+
+// the oldest key press and buffer change not yet painted, 0 when there are none. A key press is timed from
+// when the window first sees it, as that is the earliest the editor can know of it.
+
+static gint64 keyTime;
+static gint64 changeTime;
+static gint64 handlerStart;
+
+// the times the current frame reached its phases
+
+static gint64 frameStart;
+static gint64 layoutEnd;
+
+// maps a value to its bucket
+
+static guint bucket_of(guint64 value)
+{
+    guint shift;
+
+    if (value < (2u << LATENCY_SUB_BITS))
+        return value;
+
+    shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS;
+    if (shift + 1 >= LATENCY_BUCKETS >> LATENCY_SUB_BITS)
+        return LATENCY_BUCKETS - 1;
+
+    return ((shift + 1) << LATENCY_SUB_BITS) + (guint) ((value >> shift) - (1u << LATENCY_SUB_BITS));
+}
+
+// returns the middle of the values a bucket holds
+
+static guint64 bucket_value(guint bucket)
+{
+    guint shift;
+
+    if (bucket < (2u << LATENCY_SUB_BITS))
+        return bucket;
+
+    shift = (bucket >> LATENCY_SUB_BITS) - 1;
+
+    return ((guint64) ((bucket & ((1u << LATENCY_SUB_BITS) - 1)) + (1u << LATENCY_SUB_BITS)) << shift)
+        + ((1ull << shift) >> 1);
+}
+
+// adds a value in microseconds to a metric's histogram
+
+void latency_record(LatencyMetric metric, guint64 us)
+{
+    LatencyHistogram *histogram = &histograms[metric];
+
+    histogram->counts[bucket_of(us)]++;
+    histogram->total++;
+    histogram->max = MAX(histogram->max, us);
+}
+
+// returns the value below which the given percent of a metric's values fall, 0 if it has none
+
+guint64 latency_percentile(LatencyMetric metric, gdouble percent)
+{
+    LatencyHistogram *histogram = &histograms[metric];
+    guint64 wanted, seen = 0;
+    guint i;
+
+    if (!histogram->total)
+        return 0;
+
+    wanted = (guint64) (histogram->total * percent / 100 + 0.5);
+    wanted = CLAMP(wanted, 1, histogram->total);
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= wanted)
+            return MIN(bucket_value(i), histogram->max);
+    }
+
+    return histogram->max;
+}
+
+// prints the count and the p50, p99, p99.9 and maximum of each metric in milliseconds
+
+void latency_report(FILE *out)
+{
+    guint i;
+
+    fprintf(out, "%-16s %8s %8s %8s %8s %8s\n", "latency (ms)", "count", "p50", "p99", "p99.9", "max");
+
+    for (i = 0; i < LATENCY_COUNT; i++)
+        fprintf(out, "%-16s %8lu %8.2f %8.2f %8.2f %8.2f\n", metricNames[i], (unsigned long) histograms[i].total,
+                latency_percentile(i, 50) / 1000.0, latency_percentile(i, 99) / 1000.0,
+                latency_percentile(i, 99.9) / 1000.0, histograms[i].max / 1000.0);
+}
+
+// empties every histogram
+
+void latency_reset(void)
+{
+    memset(histograms, 0, sizeof(histograms));
+}
+
+// notes a key press as the window receives it, before any handler has run. Modifier keys on their own change
+// nothing on screen and are left out. The frame clock is asked for an after-paint so a key with nothing to
+// draw still ends at the next frame rather than being matched to an unrelated paint.
+
+static gboolean on_key_press(GtkWidget *widget, GdkEventKey *event, gpointer data)
+{
+    if (event->is_modifier)
+        return FALSE;
+
+    handlerStart = g_get_monotonic_time();
+    if (!keyTime)
+        keyTime = handlerStart;
+
+    if (frameClock)
+        gdk_frame_clock_request_phase(frameClock, GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+
+    return FALSE;
+}
+
+// event-after runs once every handler has had the key, whether one of them stopped it or not
+
+static void on_event_after(GtkWidget *widget, GdkEvent *event, gpointer data)
+{
+    if (event->type != GDK_KEY_PRESS || !handlerStart)
+        return;
+
+    latency_record(LATENCY_HANDLER, g_get_monotonic_time() - handlerStart);
+    handlerStart = 0;
+}
+
+// notes the first buffer change since the last paint
+
+static void on_changed(GtkTextBuffer *buff, gpointer data)
+{
+    if (!changeTime)
+        changeTime = g_get_monotonic_time();
+}
+
+// the frame clock phases, connected after gtk's own handlers so each marks the end of its phase's work
+
+static void on_before_paint(GdkFrameClock *clock, gpointer data)
+{
+    frameStart = g_get_monotonic_time();
+    layoutEnd = 0;
+}
+
+static void on_layout(GdkFrameClock *clock, gpointer data)
+{
+    layoutEnd = g_get_monotonic_time();
+
+    if (frameStart)
+        latency_record(LATENCY_LAYOUT, layoutEnd - frameStart);
+}
+
+// closes a frame, matching the input waiting for it. Frames with only an after-paint requested skip layout
+// and paint, so those are only measured for frames which reached them.
+
+static void on_after_paint(GdkFrameClock *clock, gpointer data)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (layoutEnd)
+        latency_record(LATENCY_PAINT, now - layoutEnd);
+
+    if (keyTime && now - keyTime < LATENCY_STALE_US)
+        latency_record(LATENCY_KEY_TO_PAINT, now - keyTime);
+    if (changeTime && now - changeTime < LATENCY_STALE_US)
+        latency_record(LATENCY_CHANGE_TO_PAINT, now - changeTime);
+
+    keyTime = 0;
+    changeTime = 0;
+    frameStart = 0;
+    layoutEnd = 0;
+}
+
+// connects to the frame clock once the view has one
+
+static void on_realize(GtkWidget *widget, gpointer data)
+{
+    if (frameClock)
+        return;
+
+    frameClock = g_object_ref(gtk_widget_get_frame_clock(widget));
+    frameHandlers[0] = g_signal_connect_after(frameClock, "before-paint", G_CALLBACK(on_before_paint), NULL);
+    frameHandlers[1] = g_signal_connect_after(frameClock, "layout", G_CALLBACK(on_layout), NULL);
+    frameHandlers[2] = g_signal_connect_after(frameClock, "after-paint", G_CALLBACK(on_after_paint), NULL);
+}
+
+// starts timing key presses and buffer changes through to the frame which paints them. Must be attached
+// before the window's own key handlers so key presses are seen first.
+
+void latency_attach(EditorContext *editor)
+{
+    latencyEditor = editor;
+
+    keyHandler = g_signal_connect(editor->window, "key-press-event", G_CALLBACK(on_key_press), NULL);
+    afterHandler = g_signal_connect(editor->window, "event-after", G_CALLBACK(on_event_after), NULL);
+    changedHandler = g_signal_connect(editor->buff, "changed", G_CALLBACK(on_changed), NULL);
+
+    if (gtk_widget_get_realized(GTK_WIDGET(editor->view)))
+        on_realize(GTK_WIDGET(editor->view), NULL);
+    else
+        realizeHandler = g_signal_connect(editor->view, "realize", G_CALLBACK(on_realize), NULL);
+}
+
+// disconnects a handler unless the object has already dropped it, as a destroyed widget does
+
+static void disconnect(gpointer object, gulong *handler)
+{
+    if (*handler && g_signal_handler_is_connected(object, *handler))
+        g_signal_handler_disconnect(object, *handler);
+    *handler = 0;
+}
+
+// stops timing. The histograms are kept so they can still be reported.
+
+void latency_detach(void)
+{
+    guint i;
+
+    if (!latencyEditor)
+        return;
+
+    if (frameClock)
+    {
+        for (i = 0; i < G_N_ELEMENTS(frameHandlers); i++)
+            disconnect(frameClock, &frameHandlers[i]);
+        g_clear_object(&frameClock);
+    }
+
+    // the builder keeps the widgets alive after the window is destroyed, so their handlers can be checked
+
+    disconnect(latencyEditor->window, &keyHandler);
+    disconnect(latencyEditor->window, &afterHandler);
+    disconnect(latencyEditor->view, &realizeHandler);
+    disconnect(latencyEditor->buff, &changedHandler);
+
+    latencyEditor = NULL;
+}
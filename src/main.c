@@ -9,11 +9,22 @@
 
 #include "maingraphics.h"
 #include "spellcheck.h"
+#include "trace.h"
+#include "session.h"
 
 int main(int argc, char **argv)
 {
+    // a build with tracing writes its trace on exit, to the file named by BUK_TRACE if it is set
 
-    spellcheck_init();
+    TRACE_INIT(getenv("BUK_TRACE") ? getenv("BUK_TRACE") : "buk-trace.json");
+
+    // take out the options for recording and replaying sessions, GApplication rejects options it does not know
+
+    session_parse_args(&argc, argv);
+
+    // load the dictionary in the background so the window can be shown straight away
+
+    spellcheck_init_async();
 
     // call into the graphics engine
 
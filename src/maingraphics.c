@@ -5,12 +5,26 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <gtk/gtk.h>
 #include <stdbool.h>
 
 #include "maingraphics.h"
 #include "debugmsg.h"
 #include "spellcheck.h"
+#include "spellview.h"
+#include "suggest.h"
+#include "fileio.h"
+#include "journal.h"
+#include "bukfile.h"
+#include "styles.h"
+#include "format.h"
+#include "undo.h"
+#include "images.h"
+#include "largefile.h"
+#include "latency.h"
+#include "session.h"
+#include "trace.h"
 
 // static bold toggle
 
@@ -20,84 +34,97 @@ static gboolean bold = FALSE;
 
 static GtkBuilder *builder;
 
-// keypress handler, initially will only handle escape key to close application
+// widgets and tags used by the handlers, resolved once when the window is built
+
+static EditorContext editor;
+
+// the name handed to the callbacks of the latest open, an older open whose callbacks see another name has
+// been superseded
+
+static gchar *latestOpen;
+
+// keypress handler, initially will only handle escape key to close application. While a file is loading
+// escape cancels the load instead.
 
 static gboolean keypress_handler(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
+    TRACE_SCOPE(TRACE_SPAN, "keypress_handler");
+
     GtkApplication *app = data;
+    guint modifiers = event->state & gtk_accelerator_get_default_mod_mask();
+    guint key = gdk_keyval_to_lower(event->keyval);
+
     if (event->keyval == GDK_KEY_Escape){
-        g_application_quit(G_APPLICATION(app));
+        if (fileio_loading())
+            fileio_cancel();
+        else
+            g_application_quit(G_APPLICATION(app));
         return TRUE;
     }
-    return FALSE;
-}
-
-// a helper function to check whether a tag toggle lies within gtk text iter range
 
-static bool has_tag_toggle(GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end)
-{
-    GtkTextIter *nextToggle = start;
-    gboolean ret = gtk_text_iter_forward_to_tag_toggle(nextToggle, tag);
-
-    // if forward to tag toggle returns true, there is a tag toggle, if not no more is required
+    // ctrl+shift+l prints how long key presses have taken to reach the screen so far
 
-    if (ret == TRUE)
+    if (modifiers == (GDK_CONTROL_MASK | GDK_SHIFT_MASK) && key == GDK_KEY_l)
     {
-        ret = gtk_text_iter_in_range(nextToggle, start, end);
+        latency_report(stdout);
+        return TRUE;
     }
 
-    return ret;
-}
+    // f12 writes out the trace recorded so far, when the editor is built with tracing
 
-// a helper function to see whether a tag is ever inactive in an iter range
+    if (modifiers == 0 && event->keyval == GDK_KEY_F12)
+    {
+        TRACE_DUMP(NULL);
+        return TRUE;
+    }
 
-static bool tag_complete(GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end)
-{
-    bool ret = false;
+    // ctrl+z undoes, ctrl+shift+z and ctrl+y redo
 
-    if (gtk_text_iter_has_tag(start, tag))
+    if (modifiers == GDK_CONTROL_MASK && key == GDK_KEY_z)
     {
-        GtkTextIter *nextToggle = gtk_text_iter_copy(start);
-        gboolean gret = gtk_text_iter_forward_to_tag_toggle(nextToggle, tag);
-        if (gret)
-        {
-            if (!gtk_text_iter_in_range(nextToggle, start, end))
-            {
-                ret = true;
-            }
-        }
+        undo_undo();
+        return TRUE;
+    }
+    if ((modifiers == (GDK_CONTROL_MASK | GDK_SHIFT_MASK) && key == GDK_KEY_z)
+        || (modifiers == GDK_CONTROL_MASK && key == GDK_KEY_y))
+    {
+        undo_redo();
+        return TRUE;
     }
-    return ret;
-}
-
-// a helper function to apply a togglable tag type to an iter text range
 
-static void applyTogTag(GtkTextBuffer *buff, GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end)
-{
-    GtkTextTagTable *tab = gtk_text_buffer_get_tag_table(GTK_TEXT_BUFFER(buff));
+    // a large file is searched and spellchecked through its mapping, ctrl+f finds the next place the selected
+    // text appears and f7 the next misspelt word
 
-    if (tag_complete(tag, start, end))
+    if (largefile_active() && modifiers == GDK_CONTROL_MASK && key == GDK_KEY_f)
     {
-        gtk_text_buffer_remove_tag(buff, tag, start, end);
+        GtkTextIter start, end;
+
+        if (gtk_text_buffer_get_selection_bounds(editor.buff, &start, &end))
+        {
+            gchar *needle = gtk_text_iter_get_text(&start, &end);
+
+            largefile_find(needle);
+            g_free(needle);
+        }
+        return TRUE;
     }
-    else
+    if (largefile_active() && modifiers == 0 && event->keyval == GDK_KEY_F7)
     {
-        gtk_text_buffer_apply_tag(buff, tag, start, end);
+        largefile_next_misspelling();
+        return TRUE;
     }
+
+    return FALSE;
 }
 
 // handles the event that the bold button is pressed
 
 static gboolean enbolden(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextTagTable *table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
-    GtkTextTag *tag = gtk_text_tag_table_lookup(table, "bold");
+    TRACE_SCOPE(TRACE_SPAN, "enbolden");
 
-    GtkTextIter start, end;
-    gtk_text_buffer_get_selection_bounds(buff, &start, &end);
-
-    applyTogTag(buff, tag, &start, &end);
+    session_record(SESSION_BOLD, NULL);
+    format_selection(&editor, FORMAT_BOLD);
 
     return TRUE;
 }
@@ -106,14 +133,10 @@ static gboolean enbolden(GtkWidget *widget, GdkEventKey *event, gpointer data)
 
 static gboolean italicise(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextTagTable *table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
-    GtkTextTag *tag = gtk_text_tag_table_lookup(table, "ital");
-
-    GtkTextIter start, end;
-    gtk_text_buffer_get_selection_bounds(buff, &start, &end);
+    TRACE_SCOPE(TRACE_SPAN, "italicise");
 
-    applyTogTag(buff, tag, &start, &end);
+    session_record(SESSION_ITALIC, NULL);
+    format_selection(&editor, FORMAT_ITALIC);
 
     return TRUE;
 }
@@ -122,14 +145,10 @@ static gboolean italicise(GtkWidget *widget, GdkEventKey *event, gpointer data)
 
 static gboolean underline(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextTagTable *table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
-    GtkTextTag *tag = gtk_text_tag_table_lookup(table, "uline");
-
-    GtkTextIter start, end;
-    gtk_text_buffer_get_selection_bounds(buff, &start, &end);
+    TRACE_SCOPE(TRACE_SPAN, "underline");
 
-    applyTogTag(buff, tag, &start, &end);
+    session_record(SESSION_UNDERLINE, NULL);
+    format_selection(&editor, FORMAT_UNDERLINE);
 
     return TRUE;
 }
@@ -138,14 +157,10 @@ static gboolean underline(GtkWidget *widget, GdkEventKey *event, gpointer data)
 
 static gboolean strikethough(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextTagTable *table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
-    GtkTextTag *tag = gtk_text_tag_table_lookup(table, "sthru");
+    TRACE_SCOPE(TRACE_SPAN, "strikethough");
 
-    GtkTextIter start, end;
-    gtk_text_buffer_get_selection_bounds(buff, &start, &end);
-
-    applyTogTag(buff, tag, &start, &end);
+    session_record(SESSION_STRIKETHROUGH, NULL);
+    format_selection(&editor, FORMAT_STRIKETHROUGH);
 
     return TRUE;
 }
@@ -154,59 +169,10 @@ static gboolean strikethough(GtkWidget *widget, GdkEventKey *event, gpointer dat
 
 static gboolean indent(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
-    const int indentIncrement = 25;
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextTagTable *table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
-    GtkTextIter start, end;
-    gtk_text_buffer_get_selection_bounds(buff, &start, &end);
-    GSList *tags = gtk_text_iter_get_tags(&start);
-    gboolean tagFound = FALSE;
-    GValue BRET = { 0 };
-    GValue IRET = { 0 };
-
-    if (tags != NULL)
-    {
-        while (tags->data != NULL)
-        {
-            g_object_get_property(G_OBJECT(tags->data), "indent-set", &BRET);
-            tagFound = g_value_get_boolean(&BRET);
-            if (tagFound)
-            {
-                gint indentSize;
-                gchar tagName[30];
-
-                gtk_text_buffer_remove_tag(buff, GTK_TEXT_TAG(tags->data), &start, &end);
-
-                g_object_get_property(tags->data, "indent", &IRET);
-                indentSize = g_value_get_int(&IRET);
-                indentSize += indentIncrement;
-                sprintf(tagName, "indent%i", indentSize);
-                GtkTextTag *tag = gtk_text_tag_table_lookup(table, tagName);
-
-                if (tag == NULL)
-                {
-                    gtk_text_buffer_create_tag(buff, tagName, "indent", indentSize, NULL);
-                    tag = gtk_text_tag_table_lookup(table, tagName);
-                    gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-                }
-                else
-                {
-                    gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-                }
-
-                break;
-            }
-
-            tags = tags->next;
-        }
-    }
+    TRACE_SCOPE(TRACE_SPAN, "indent");
 
-    if (!tagFound)
-    {
-        gtk_text_buffer_create_tag(buff, "indent25", "indent", indentIncrement, NULL);
-        GtkTextTag *tag = gtk_text_tag_table_lookup(table, "indent25");
-        gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-    }
+    session_record(SESSION_INDENT, NULL);
+    format_selection(&editor, FORMAT_INDENT);
 
     return TRUE;
 }
@@ -215,52 +181,10 @@ static gboolean indent(GtkWidget *widget, GdkEventKey *event, gpointer data)
 
 static gboolean unindent(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
-    const int indentIncrement = 25;
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextTagTable *table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
-    GtkTextIter start, end;
-    gtk_text_buffer_get_selection_bounds(buff, &start, &end);
-    GSList *tags = gtk_text_iter_get_tags(&start);
-    gboolean tagFound = FALSE;
-    GValue BRET = { 0 };
-    GValue IRET = { 0 };
-
-    if (tags != NULL)
-    {
-        while (tags->data != NULL)
-        {
-            g_object_get_property(G_OBJECT(tags->data), "indent-set", &BRET);
-            tagFound = g_value_get_boolean(&BRET);
-            if (tagFound)
-            {
-                gint indentSize;
-                gchar tagName[30];
-
-                gtk_text_buffer_remove_tag(buff, GTK_TEXT_TAG(tags->data), &start, &end);
-
-                g_object_get_property(tags->data, "indent", &IRET);
-                indentSize = g_value_get_int(&IRET);
-                indentSize -= indentIncrement;
-                sprintf(tagName, "indent%i", indentSize);
-                GtkTextTag *tag = gtk_text_tag_table_lookup(table, tagName);
-
-                if (tag == NULL)
-                {
-                    gtk_text_buffer_create_tag(buff, tagName, "indent", indentSize, NULL);
-                    tag = gtk_text_tag_table_lookup(table, tagName);
-                    gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-                }
-                else
-                {
-                    gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-                }
-
-                break;
-            }
-
-            tags = tags->next;
-        }
-    }
+    TRACE_SCOPE(TRACE_SPAN, "unindent");
+
+    session_record(SESSION_UNINDENT, NULL);
+    format_selection(&editor, FORMAT_UNINDENT);
 
     return TRUE;
 }
@@ -269,39 +193,10 @@ static gboolean unindent(GtkWidget *widget, GdkEventKey *event, gpointer data)
 
 static gboolean rjust(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextTagTable *table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
-    GtkTextIter start, end;
-    gtk_text_buffer_get_selection_bounds(buff, &start, &end);
-    GSList *tags = gtk_text_iter_get_tags(&start);
-    gboolean tagFound = FALSE;
-    GValue BRET = { 0 };
-
-    if (tags != NULL)
-    {
+    TRACE_SCOPE(TRACE_SPAN, "rjust");
 
-        while (tags->data != NULL)
-        {
-            g_object_get_property(G_OBJECT(tags->data), "justification-set", &BRET);
-            tagFound = g_value_get_boolean(&BRET);
-
-            if (tagFound)
-            {
-                gtk_text_buffer_remove_tag(buff, GTK_TEXT_TAG(tags->data), &start, &end);
-                GtkTextTag *tag = gtk_text_tag_table_lookup(table, "rjust");
-                gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-                break;
-            }
-
-            tags = tags->next;
-        }
-    }
-
-    if (!tagFound)
-    {
-        GtkTextTag *tag = gtk_text_tag_table_lookup(table, "rjust");
-        gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-    }
+    session_record(SESSION_RJUST, NULL);
+    format_selection(&editor, FORMAT_RJUST);
 
     return TRUE;
 }
@@ -310,39 +205,10 @@ static gboolean rjust(GtkWidget *widget, GdkEventKey *event, gpointer data)
 
 static gboolean ljust(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextTagTable *table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
-    GtkTextIter start, end;
-    gtk_text_buffer_get_selection_bounds(buff, &start, &end);
-    GSList *tags = gtk_text_iter_get_tags(&start);
-    gboolean tagFound = FALSE;
-    GValue BRET = { 0 };
-
-    if (tags != NULL)
-    {
+    TRACE_SCOPE(TRACE_SPAN, "ljust");
 
-        while (tags->data != NULL)
-        {
-            g_object_get_property(G_OBJECT(tags->data), "justification-set", &BRET);
-            tagFound = g_value_get_boolean(&BRET);
-
-            if (tagFound)
-            {
-                gtk_text_buffer_remove_tag(buff, GTK_TEXT_TAG(tags->data), &start, &end);
-                GtkTextTag *tag = gtk_text_tag_table_lookup(table, "ljust");
-                gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-                break;
-            }
-
-            tags = tags->next;
-        }
-    }
-
-    if (!tagFound)
-    {
-        GtkTextTag *tag = gtk_text_tag_table_lookup(table, "ljust");
-        gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-    }
+    session_record(SESSION_LJUST, NULL);
+    format_selection(&editor, FORMAT_LJUST);
 
     return TRUE;
 }
@@ -351,101 +217,78 @@ static gboolean ljust(GtkWidget *widget, GdkEventKey *event, gpointer data)
 
 static gboolean cjust(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextTagTable *table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
-    GtkTextIter start, end;
-    gtk_text_buffer_get_selection_bounds(buff, &start, &end);
-    GSList *tags = gtk_text_iter_get_tags(&start);
-    gboolean tagFound = FALSE;
-    GValue BRET = { 0 };
-
-    if (tags != NULL)
-    {
-
-        while (tags->data != NULL)
-        {
-            g_object_get_property(G_OBJECT(tags->data), "justification-set", &BRET);
-            tagFound = g_value_get_boolean(&BRET);
-
-            if (tagFound)
-            {
-                gtk_text_buffer_remove_tag(buff, GTK_TEXT_TAG(tags->data), &start, &end);
-                GtkTextTag *tag = gtk_text_tag_table_lookup(table, "cjust");
-                gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-                break;
-            }
-
-            tags = tags->next;
-        }
-    }
+    TRACE_SCOPE(TRACE_SPAN, "cjust");
 
-    if (!tagFound)
-    {
-        GtkTextTag *tag = gtk_text_tag_table_lookup(table, "cjust");
-        gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-    }
+    session_record(SESSION_CJUST, NULL);
+    format_selection(&editor, FORMAT_CJUST);
 
     return TRUE;
 }
 
-//handles the clicked event for the center justification toolbutton
+//handles the clicked event for the full justification toolbutton
 
 static gboolean fjust(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextTagTable *table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
-    GtkTextIter start, end;
-    gtk_text_buffer_get_selection_bounds(buff, &start, &end);
-    GSList *tags = gtk_text_iter_get_tags(&start);
-    gboolean tagFound = FALSE;
-    GValue BRET = { 0 };
-
-    if (tags != NULL)
-    {
+    TRACE_SCOPE(TRACE_SPAN, "fjust");
 
-        while (tags->data != NULL)
-        {
-            g_object_get_property(G_OBJECT(tags->data), "justification-set", &BRET);
-            tagFound = g_value_get_boolean(&BRET);
-
-            if (tagFound)
-            {
-                gtk_text_buffer_remove_tag(buff, GTK_TEXT_TAG(tags->data), &start, &end);
-                GtkTextTag *tag = gtk_text_tag_table_lookup(table, "fjust");
-                gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-                break;
-            }
-
-            tags = tags->next;
-        }
-    }
-
-    if (!tagFound)
-    {
-        GtkTextTag *tag = gtk_text_tag_table_lookup(table, "fjust");
-        gtk_text_buffer_apply_tag(buff, tag, &start, &end);
-    }
+    session_record(SESSION_FJUST, NULL);
+    format_selection(&editor, FORMAT_FJUST);
 
     return TRUE;
 }
 
-//handles the clicked event for butSave by saving the entire text buffer to a file name buff.f
+// adds filters for the document formats the editor reads and writes to a file chooser. The format of a
+// saved file follows its extension, anything not ending in .buk is written as gtk tagset markup
+
+static void add_file_filters(GtkWidget *dialog)
+{
+    GtkFileFilter *native = gtk_file_filter_new();
+    GtkFileFilter *all = gtk_file_filter_new();
+
+    gtk_file_filter_set_name(native, "Buk documents (*" BUKFILE_EXTENSION ")");
+    gtk_file_filter_add_pattern(native, "*" BUKFILE_EXTENSION);
+    gtk_file_filter_set_name(all, "All files");
+    gtk_file_filter_add_pattern(all, "*");
+
+    gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(dialog), all);
+    gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(dialog), native);
+}
+
+// reports a finished save, the file name is owned by the save
+
+static void save_done(const gchar *error, gpointer data)
+{
+    if (error)
+        printf("Error saving %s\n", error);
+    else
+        DEB("Saved %s\n", (gchar *) data);
+
+    g_free(data);
+}
+
+// saves the whole buffer to a file, serialising and writing it on a worker thread. The name is owned by the save
+// and freed once it completes.
+
+static void save_as_path(gchar *filename)
+{
+    session_record(SESSION_SAVE_AS, filename);
+    journal_full_save(filename, save_done, filename);
+}
+
+//handles the clicked event for butSaveas by saving the entire text buffer to a file chosen by the user. Only a
+//snapshot of the buffer is taken here, the file is written in the background and later saves go to its journal
 
 static gboolean saveasBuf(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    
-    DEB("Registering serialisation tagset\n");
-    GtkTextIter start, end;
-    GdkAtom format = gtk_text_buffer_register_serialize_tagset(buff, NULL);
-    DEB("Getting selection iterators\n");
-    gtk_text_buffer_get_start_iter(buff, &start);
-    gtk_text_buffer_get_end_iter(buff, &end);
-    gsize len;
-    DEB("Serializing text buffer\n");
-    char *text = (char *) gtk_text_buffer_serialize(buff, buff, format, &start, &end, &len);
-    DEB("%s\n", text);
-    DEB("%ld\n", len);
+    TRACE_SCOPE(TRACE_SPAN, "saveasBuf");
+
+    // only a window of a large file is ever in the buffer, so there is nothing whole to save
+
+    if (largefile_active())
+    {
+        printf("Large files are opened read-only\n");
+        return TRUE;
+    }
 
     // open a save dialog so the user can choose where to save data
 
@@ -456,26 +299,16 @@ static gboolean saveasBuf(GtkWidget *widget, GdkEventKey *event, gpointer data)
                       "_Cancel", GTK_RESPONSE_CANCEL,
                       "_Save", GTK_RESPONSE_ACCEPT,
                       NULL);
+    add_file_filters(dialog);
 
     if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT)
     {
     char *filename;
-    gboolean result;
-    GError *err = NULL;
 
     filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (dialog));
 
-    // set contents of file to the value of 'text'
-
     if (filename != NULL)
-        result = g_file_set_contents (filename, text, len, &err);
-    else
-        result = g_file_set_contents (filename, text, len, &err);
-
-    if (result == FALSE)
-    {
-        printf("error\n");
-    }        
+        save_as_path(filename);
 
     }
     
@@ -484,67 +317,156 @@ static gboolean saveasBuf(GtkWidget *widget, GdkEventKey *event, gpointer data)
     return TRUE;
 }
 
-//handles the clicked event for butOpen by allowing a fileto be selected and deserialized into a textbuffer
+//handles the clicked event for butSave by appending the edits made since the last save to the document's
+//journal. A document which has never been saved is passed to save as instead
 
 static gboolean saveBuf(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextIter start;
-    gtk_text_buffer_get_start_iter(buff, &start);
-    GError *err = NULL;
-    
-    GdkAtom format = gtk_text_buffer_register_deserialize_tagset(buff, NULL);
+    TRACE_SCOPE(TRACE_SPAN, "saveBuf");
+
+    if (largefile_active())
+        return saveasBuf(widget, event, data);
 
+    if (!journal_path())
+        return saveasBuf(widget, event, data);
+
+    session_record(SESSION_SAVE, NULL);
+    journal_save(save_done, g_strdup(journal_path()));
 
     return TRUE;
 }
 
-//handles the clicked event for butOpen by allowing a fileto be selected and deserialized into a textbuffer
+// shows how far through loading a file the editor is in the window title
 
-static gboolean openFile(GtkWidget *widget, GdkEventKey *event, gpointer data)
+static void open_progress(gdouble fraction, gpointer data)
+{
+    gchar *name = g_path_get_basename(data);
+    gchar *title = g_strdup_printf("Loading %s... %d%%", name, (int) (fraction * 100));
+
+    gtk_window_set_title(editor.window, title);
+    g_free(title);
+    g_free(name);
+}
+
+// puts the window title back once a file has loaded, reporting any error. A complete load has the edits
+// saved to its journal replayed on top, and further saves go to the same journal. A load superseded by
+// another open leaves the title and undo history to that one.
+
+static void open_done(const gchar *error, gpointer data)
+{
+    gboolean cancelled = g_strcmp0(error, FILEIO_CANCELLED) == 0;
+    gchar *name;
+
+    if (data != latestOpen)
+    {
+        g_free(data);
+        return;
+    }
+
+    name = g_path_get_basename(data);
+
+    if (error && !cancelled)
+        printf("Error loading %s: %s\n", (const gchar *) data, error);
+    else if (!error)
+    {
+        journal_track(data);
+        journal_replay(data);
+    }
+
+    // the loaded document is where undo stops, what a cancelled load left behind is not a document
+
+    if (!cancelled)
+        undo_clear();
+
+    gtk_window_set_title(editor.window, name);
+    g_free(name);
+    g_free(data);
+    latestOpen = NULL;
+}
+
+// titles the window once a large file is indexed and showing. It is viewed read-only, so nothing is journalled.
+// An index superseded by another open leaves the title and undo history to that one.
+
+static void large_open_done(const gchar *error, gpointer data)
 {
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextIter end;
-    gtk_text_buffer_get_end_iter(buff, &end);
+    gchar *name;
+
+    if (data != latestOpen || g_strcmp0(error, FILEIO_CANCELLED) == 0)
+    {
+        if (data == latestOpen)
+            latestOpen = NULL;
+        g_free(data);
+        return;
+    }
+
+    name = g_path_get_basename(data);
+
+    if (error)
+        printf("Error loading %s: %s\n", (const gchar *) data, error);
+    else
+    {
+        gchar *title = g_strdup_printf("%s (read-only, %" G_GUINT64_FORMAT " lines)", name, largefile_lines());
+
+        gtk_window_set_title(editor.window, title);
+        g_free(title);
+    }
+
+    undo_clear();
+
+    g_free(name);
+    g_free(data);
+    latestOpen = NULL;
+}
+
+// replaces the document with a file, read and deserialized on a worker thread. The name is owned by the
+// callbacks until loading ends.
+
+static void open_path(gchar *filename)
+{
+    session_record(SESSION_OPEN, filename);
+
+    latestOpen = filename;
+    journal_track(NULL);
+    undo_clear();
+
+    // plain text too big to load is mapped and shown a window at a time instead
+
+    if (largefile_wanted(filename))
+        largefile_open(&editor, filename, large_open_done, filename);
+    else
+    {
+        largefile_close();
+        fileio_open_async(editor.buff, filename, open_progress, open_done, filename);
+    }
+}
 
-    gchar *loadData;
-    gsize length;
+//handles the clicked event for butOpen by allowing a file to be selected and loaded into the textbuffer in
+//the background, so the editor stays usable while a large file arrives
+
+static gboolean openFile(GtkWidget *widget, GdkEventKey *event, gpointer data)
+{
+    TRACE_SCOPE(TRACE_SPAN, "openFile");
 
     // open a load dialog so the user can choose the file to load
 
     GtkWidget *dialog;
     dialog = gtk_file_chooser_dialog_new ("Load...",
                       NULL,
-                      GTK_FILE_CHOOSER_ACTION_SAVE,
+                      GTK_FILE_CHOOSER_ACTION_OPEN,
                       "_Cancel", GTK_RESPONSE_CANCEL,
-                      "_Save", GTK_RESPONSE_ACCEPT,
+                      "_Open", GTK_RESPONSE_ACCEPT,
                       NULL);
+    add_file_filters(dialog);
 
     if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT)
     {
     char *filename;
-    gboolean result;
-    GError *err = NULL;
 
     filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (dialog));
 
-    // load the data from the appropriate file
-
-    printf("%s\n", filename);
     if (filename != NULL)
-    {
-        g_file_get_contents(filename, &loadData, &length, &err);
-        printf("%s\n", loadData);
-    }
-    
-    // deserialize the data and put it into a text buffer
+        open_path(filename);
 
-    GdkAtom format = gtk_text_buffer_register_deserialize_tagset(buff, NULL);
-    gboolean ret = gtk_text_buffer_deserialize(buff, buff, format, &end, loadData, length, &err);
-    printf("%i\n", ret);
-    if (err)
-        printf("%s\n", err->message);
-    
     }
     
     gtk_widget_destroy (dialog);
@@ -556,24 +478,15 @@ static gboolean openFile(GtkWidget *widget, GdkEventKey *event, gpointer data)
 
 void pasteImageCallback(GtkClipboard* clipboard, GdkPixbuf* pixbuf, gpointer data)
 {
+    TRACE_SCOPE(TRACE_SPAN, "pasteImageCallback");
+
     if (!pixbuf)
         printf("Error, paste callback received no image\n");
     else
     {
-        // GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-        // GtkTextView *view = GTK_TEXT_VIEW(gtk_builder_get_object(builder, "view0"));
-        // GtkTextIter cursor;
-        // gtk_text_buffer_get_iter_at_mark(buff, &cursor, gtk_text_buffer_get_insert(buff));
-        // gtk_text_buffer_insert_pixbuf(buff, &cursor, pixbuf);
-
-        // some code that places an invisible button or something over the pixbuf
-
-        // GtkTextChildAnchor *anchor = gtk_text_buffer_create_child_anchor(buff, &cursor);
-        GtkWidget *image = gtk_image_new_from_pixbuf(pixbuf);
-        GtkTextView *view = GTK_TEXT_VIEW(gtk_builder_get_object(builder, "view0"));
-        gtk_text_view_add_overlay(view, image, 0, 0);
-        // gtk_text_view_add_child_at_anchor(view, image, anchor);
-        // gtk_widget_show(image);
+        // the image is anchored at the cursor and encoded, hashed and scaled for display in the background
+
+        images_insert(pixbuf);
     }
     return;
 }
@@ -582,79 +495,44 @@ void pasteImageCallback(GtkClipboard* clipboard, GdkPixbuf* pixbuf, gpointer dat
 
 static gboolean pasteImage(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
+    TRACE_SCOPE(TRACE_SPAN, "pasteImage");
+
+    session_record(SESSION_PASTE, NULL);
+
     GdkDisplay *display = gdk_display_get_default();
     GtkClipboard *clipboard = gtk_clipboard_get_default(display);
     gtk_clipboard_request_image(clipboard, pasteImageCallback, NULL);
     return TRUE;
 }
 
-// spellcheck a range of text iters
-
-static void spellcheck_range(GtkTextBuffer *buff, GtkTextIter start, GtkTextIter end)
-{
-    GtkTextTagTable *table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
-    GtkTextTag *tag = gtk_text_tag_table_lookup(table, "misspelt");
-    
-    GtkTextIter wstart, wend;
-    wstart = end;
-    gtk_text_iter_backward_word_start(&wstart);
-    wend = wstart;
-    gtk_text_iter_forward_word_end(&wend);
-    gchar *text = gtk_text_buffer_get_text(buff, &wstart, &wend, FALSE);
-
-    if (spellcheck_isvalidword(text))
-        gtk_text_buffer_remove_tag(buff, tag, &wstart, &wend);
-    else
-        gtk_text_buffer_apply_tag(buff, tag, &wstart, &wend);
-
-    while (!gtk_text_iter_is_start(&wstart))
-    {
-        gtk_text_iter_backward_word_start(&wstart);
-        wend = wstart;
-        gtk_text_iter_forward_word_end(&wend);
-        gchar *text = gtk_text_buffer_get_text(buff, &wstart, &wend, FALSE);
-        if (spellcheck_isvalidword(text))
-            gtk_text_buffer_remove_tag(buff, tag, &wstart, &wend);
-        else
-            gtk_text_buffer_apply_tag(buff, tag, &wstart, &wend);
-    } 
-}
-
-// spellcheck entire text buffer
-
-static void spellcheck_all(GtkWidget *widget, GdkEventKey *event, gpointer data)
+// the handlers a replayed session calls for the toolbar actions it recorded
+
+static gboolean (*const sessionHandlers[SESSION_RECORD_TYPES])(GtkWidget *, GdkEventKey *, gpointer) = {
+    [SESSION_BOLD] = enbolden,
+    [SESSION_ITALIC] = italicise,
+    [SESSION_UNDERLINE] = underline,
+    [SESSION_STRIKETHROUGH] = strikethough,
+    [SESSION_INDENT] = indent,
+    [SESSION_UNINDENT] = unindent,
+    [SESSION_LJUST] = ljust,
+    [SESSION_RJUST] = rjust,
+    [SESSION_CJUST] = cjust,
+    [SESSION_FJUST] = fjust,
+    [SESSION_PASTE] = pasteImage,
+    [SESSION_SAVE] = saveBuf
+};
+
+// performs an action from a replayed session. File operations go straight to the recorded path rather than
+// through a dialog.
+
+static void replay_action(SessionRecordType type, const gchar *path)
 {
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
-    GtkTextTagTable *table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
-    GtkTextTag *tag = gtk_text_tag_table_lookup(table, "misspelt");
-
-    GtkTextIter start, end;
-    gtk_text_buffer_get_start_iter(buff, &start);
-    gtk_text_buffer_get_end_iter(buff, &end);
-    
-    GtkTextIter wstart, wend;
-    wstart = end;
-    gtk_text_iter_backward_word_start(&wstart);
-    wend = wstart;
-    gtk_text_iter_forward_word_end(&wend);
-    gchar *text = gtk_text_buffer_get_text(buff, &wstart, &wend, FALSE);
-
-    if (spellcheck_isvalidword(text))
-        gtk_text_buffer_remove_tag(buff, tag, &wstart, &wend);
-    else
-        gtk_text_buffer_apply_tag(buff, tag, &wstart, &wend);
-
-    while (!gtk_text_iter_is_start(&wstart))
-    {
-        gtk_text_iter_backward_word_start(&wstart);
-        wend = wstart;
-        gtk_text_iter_forward_word_end(&wend);
-        gchar *text = gtk_text_buffer_get_text(buff, &wstart, &wend, FALSE);
-        if (spellcheck_isvalidword(text))
-            gtk_text_buffer_remove_tag(buff, tag, &wstart, &wend);
-        else
-            gtk_text_buffer_apply_tag(buff, tag, &wstart, &wend);
-    } 
+    if (type == SESSION_OPEN && path)
+        open_path(g_strdup(path));
+    else if (type == SESSION_SAVE_AS && path)
+        save_as_path(g_strdup(path));
+    else if (sessionHandlers[type])
+        sessionHandlers[type](NULL, NULL, NULL);
 }
 
 // this is the main runner function for the graphical appliation
@@ -673,7 +551,10 @@ static void activate(GtkApplication *app, gpointer user_data)
     builder = gtk_builder_new_from_file("../res/editorMain.glade");
     view = GTK_WIDGET(gtk_builder_get_object(builder, "view0"));
     window = GTK_WIDGET(gtk_builder_get_object(builder, "editorMain1"));
-    GtkTextBuffer *buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
+
+    // resolve the widgets and tags the handlers use, and create the formatting tags
+
+    styles_init(&editor, builder);
 
     // use gtk builder to obtain a pointer to each toolbutton in the toolbar
 
@@ -688,6 +569,7 @@ static void activate(GtkApplication *app, gpointer user_data)
     butRjust = GTK_WIDGET(gtk_builder_get_object(builder, "butRjust"));
     butFjust = GTK_WIDGET(gtk_builder_get_object(builder, "butFjust"));
     butSaveas = GTK_WIDGET(gtk_builder_get_object(builder, "butSaveas"));
+    butSave = GTK_WIDGET(gtk_builder_get_object(builder, "butSave"));
     butOpen = GTK_WIDGET(gtk_builder_get_object(builder, "butOpen"));
     butPaste = GTK_WIDGET(gtk_builder_get_object(builder, "butPaste"));
 
@@ -709,25 +591,36 @@ static void activate(GtkApplication *app, gpointer user_data)
     // connect event handlers for menu bar activations
 
     g_signal_connect(G_OBJECT(butSaveas), "activate", G_CALLBACK(saveasBuf), app);
+    g_signal_connect(G_OBJECT(butSave), "activate", G_CALLBACK(saveBuf), app);
     g_signal_connect(G_OBJECT(butOpen), "activate", G_CALLBACK(openFile), app);
 
-    // connect event handler for textbuffer changed event
+    // track edits to the text buffer so only the words they touch are spellchecked
+
+    spellview_attach(editor.view, editor.misspelt);
+
+    // offer corrections for misspelt words in the context menu, worked out off the main thread
+
+    suggest_attach(editor.view, editor.misspelt);
 
-    g_signal_connect(G_OBJECT(buff), "changed", G_CALLBACK(spellcheck_all), app);
+    // misspellings are worked out again on load, so they are never written to files
 
-    // set up text tag table with tag types
+    fileio_exclude_tag(editor.misspelt);
 
-    gtk_text_buffer_create_tag(buff, "bold", "weight", 700, NULL);
-    gtk_text_buffer_create_tag(buff, "ital", "style", PANGO_STYLE_ITALIC, NULL);
-    gtk_text_buffer_create_tag(buff, "uline", "underline", PANGO_UNDERLINE_SINGLE, NULL);
-    gtk_text_buffer_create_tag(buff, "sthru", "strikethrough", true, NULL);
+    // record edits so save only has to write what changed
 
-    // set up text tags for justification, only one should be active on some text at a time
+    journal_attach(editor.buff);
 
-    gtk_text_buffer_create_tag(buff, "ljust", "justification", GTK_JUSTIFY_LEFT, NULL);
-    gtk_text_buffer_create_tag(buff, "rjust", "justification", GTK_JUSTIFY_RIGHT, NULL);
-    gtk_text_buffer_create_tag(buff, "cjust", "justification", GTK_JUSTIFY_CENTER, NULL);
-    gtk_text_buffer_create_tag(buff, "fjust", "justification", GTK_JUSTIFY_FILL, NULL);
+    // keep an undo history of text and formatting changes, bounded in memory
+
+    undo_attach(editor.buff, UNDO_DEFAULT_BYTES);
+
+    // pasted images are anchored in the text and drawn from a cache scaled to display size
+
+    images_attach(editor.view);
+
+    // documents store images once each by hash, decoded only when they come into view
+
+    fileio_image_handlers(images_place, images_find);
 
     // add css provider for main text editor, this includes toolbutton styles
 
@@ -738,6 +631,14 @@ static void activate(GtkApplication *app, gpointer user_data)
     // enable keypress on the window
 
     gtk_widget_add_events(GTK_WIDGET(window), GDK_KEY_PRESS_MASK);
+
+    // time key presses and edits through to the frame which paints them, this sees keys before the handler below
+
+    latency_attach(&editor);
+
+    // record the session's key presses and actions, or replay a recorded one, as asked on the command line
+
+    session_attach(window, view, replay_action);
     g_signal_connect(G_OBJECT(window), "key_press_event", G_CALLBACK(keypress_handler), app);
 
     // install a handler to destroy the application when the window is destroyed
@@ -755,6 +656,20 @@ int launchGraphics(int argc, char **argv)
     app = gtk_application_new("in.Buk", G_APPLICATION_FLAGS_NONE);
     g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
     ret = g_application_run(G_APPLICATION(app), argc, argv);
+    suggest_detach();
+    spellview_detach();
+    journal_detach();
+    undo_detach();
+    images_detach();
+    largefile_close();
+    latency_detach();
+    session_detach();
+
+    // BUK_LATENCY asks for the latency of the whole session to be reported on exit
+
+    if (getenv("BUK_LATENCY"))
+        latency_report(stdout);
+
     g_object_unref(app);
 
     return ret;
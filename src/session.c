@@ -0,0 +1,445 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <gtk/gtk.h>
+
+#include "session.h"
+#include "fileio.h"
+#include "journal.h"
+#include "largefile.h"
+#include "debugmsg.h"
+
+// the start of a session file
+
+typedef struct
+{
+    gchar magic[8];
+    guint32 bom;
+    guint32 version;
+} SessionHeader;
+
+// one recorded input, in host byte order. Key fields are only used by key records, size is the length of the
+// path which follows a file operation.
+
+typedef struct
+{
+    guint64 time;
+    guint8 type;
+    guint8 modifier;
+    guint16 keycode;
+    guint32 keyval;
+    guint32 state;
+    guint32 size;
+} SessionRecord;
+
+// how long the actions of one type took to replay
+
+typedef struct
+{
+    guint count;
+    gdouble total;
+    gdouble max;
+} SessionStats;
+
+static const gchar *recordNames[SESSION_RECORD_TYPES] = {
+    "key_press", "key_release", "bold", "italic", "underline", "strikethrough", "indent", "unindent", "ljust",
+    "rjust", "cjust", "fjust", "paste", "save", "save_as", "open"
+};
+
+// recording writes through stdio, which buffers the small records into few writes
+
+static FILE *recordFile;
+static gint64 recordStart;
+
+// the session being replayed, read whole, and how far through it the replay is
+
+static gchar *replayPath;
+static gchar *replayData;
+static gsize replayLen, replayPos;
+static gboolean replayPaced;
+static gint64 replayStart;
+static guint replaySource;
+
+// where a replay's saves go instead of the recorded paths, the document last opened or saved, and whether it
+// already has a copy in the save directory for later saves to journal against
+
+static gchar *replaySaveDir;
+static gchar *replayDocument;
+static gboolean replayRedirected, replayWarned;
+
+// the action waiting to settle, -1 when there is none, and the time it was dispatched
+
+static gint actionType = -1;
+static gint64 actionStart;
+static SessionStats stats[SESSION_RECORD_TYPES];
+
+static GtkWidget *sessionWindow;
+static SessionActionFunc actionFunc;
+static gulong pressHandler, releaseHandler;
+
+// removes the arguments from i onwards by count places, so GApplication never sees them
+
+static void strip_args(int *argc, char **argv, int i, int count)
+{
+    memmove(argv + i, argv + i + count, (*argc - i - count + 1) * sizeof(*argv));
+    *argc -= count;
+}
+
+// starts a session file
+
+static void start_recording(const gchar *path)
+{
+    SessionHeader header = { SESSION_MAGIC, SESSION_BOM, SESSION_VERSION };
+
+    recordFile = fopen(path, "wb");
+    if (!recordFile || fwrite(&header, sizeof(header), 1, recordFile) != 1)
+    {
+        fprintf(stderr, "Cannot record to %s\n", path);
+        if (recordFile)
+            fclose(recordFile);
+        recordFile = NULL;
+        return;
+    }
+
+    recordStart = g_get_monotonic_time();
+}
+
+// reads a session file to replay, checking it was written by this version on a machine of the same byte order
+
+static void load_replay(const gchar *path)
+{
+    SessionHeader *header;
+    GError *err = NULL;
+
+    if (!g_file_get_contents(path, &replayData, &replayLen, &err))
+    {
+        fprintf(stderr, "Cannot replay %s: %s\n", path, err->message);
+        g_error_free(err);
+        return;
+    }
+
+    header = (SessionHeader *) replayData;
+    if (replayLen < sizeof(*header) || memcmp(header->magic, SESSION_MAGIC, sizeof(header->magic)) != 0
+        || header->bom != SESSION_BOM || header->version != SESSION_VERSION)
+    {
+        fprintf(stderr, "%s is not a session recorded by this version\n", path);
+        g_clear_pointer(&replayData, g_free);
+        return;
+    }
+
+    replayPath = g_strdup(path);
+    replayPos = sizeof(*header);
+}
+
+// takes the session options out of the command line: --record FILE logs the session to FILE, --replay FILE
+// plays one back as fast as the editor keeps up and --replay-paced FILE at the pace it was recorded.
+// --replay-saves DIR writes a replay's saves into DIR rather than over the recorded files.
+
+void session_parse_args(int *argc, char **argv)
+{
+    int i = 1;
+
+    while (i < *argc)
+    {
+        const gchar *option = argv[i];
+
+        if (i + 1 < *argc && !recordFile && !replayData
+            && (!strcmp(option, "--record") || !strcmp(option, "--replay") || !strcmp(option, "--replay-paced")))
+        {
+            if (!strcmp(option, "--record"))
+                start_recording(argv[i + 1]);
+            else
+            {
+                replayPaced = !strcmp(option, "--replay-paced");
+                load_replay(argv[i + 1]);
+            }
+
+            strip_args(argc, argv, i, 2);
+        }
+        else if (i + 1 < *argc && !replaySaveDir && !strcmp(option, "--replay-saves"))
+        {
+            replaySaveDir = g_strdup(argv[i + 1]);
+            strip_args(argc, argv, i, 2);
+        }
+        else
+            i++;
+    }
+}
+
+// appends a record to the session being recorded
+
+static void write_record(SessionRecordType type, GdkEventKey *event, const gchar *path)
+{
+    SessionRecord record = { 0 };
+
+    record.time = g_get_monotonic_time() - recordStart;
+    record.type = type;
+    record.size = path ? strlen(path) : 0;
+
+    if (event)
+    {
+        record.modifier = event->is_modifier;
+        record.keycode = event->hardware_keycode;
+        record.keyval = event->keyval;
+        record.state = event->state;
+    }
+
+    fwrite(&record, sizeof(record), 1, recordFile);
+    if (record.size)
+        fwrite(path, 1, record.size, recordFile);
+}
+
+// records an action taken by one of the editor's handlers, a no-op unless a session is being recorded
+
+void session_record(SessionRecordType type, const gchar *path)
+{
+    if (recordFile)
+        write_record(type, NULL, path);
+}
+
+// records key events as the window receives them, ahead of the handlers which may stop them
+
+static gboolean on_key(GtkWidget *widget, GdkEventKey *event, gpointer data)
+{
+    write_record(event->type == GDK_KEY_PRESS ? SESSION_KEY_PRESS : SESSION_KEY_RELEASE, event, NULL);
+
+    return FALSE;
+}
+
+// sends a recorded key event to the window as if it came from the keyboard
+
+static void inject_key(const SessionRecord *record)
+{
+    GdkWindow *window = gtk_widget_get_window(sessionWindow);
+    GdkSeat *seat = gdk_display_get_default_seat(gdk_window_get_display(window));
+    GdkEvent *event = gdk_event_new(record->type == SESSION_KEY_PRESS ? GDK_KEY_PRESS : GDK_KEY_RELEASE);
+
+    event->key.window = g_object_ref(window);
+    event->key.send_event = TRUE;
+    event->key.time = GDK_CURRENT_TIME;
+    event->key.state = record->state;
+    event->key.keyval = record->keyval;
+    event->key.hardware_keycode = record->keycode;
+    event->key.is_modifier = record->modifier;
+    event->key.string = g_strdup("");
+    gdk_event_set_device(event, gdk_seat_get_keyboard(seat));
+
+    gtk_main_do_event(event);
+    gdk_event_free(event);
+}
+
+// counts the time since the last action was dispatched towards its type
+
+static void settle_action(void)
+{
+    gdouble ms;
+
+    if (actionType < 0)
+        return;
+
+    ms = (g_get_monotonic_time() - actionStart) / 1000.0;
+    stats[actionType].count++;
+    stats[actionType].total += ms;
+    stats[actionType].max = MAX(stats[actionType].max, ms);
+    actionType = -1;
+}
+
+// prints the replay's timings as json and closes the editor, so a replay can be run unattended
+
+static void finish_replay(void)
+{
+    gboolean first = TRUE;
+    guint i;
+
+    printf("{\n  \"session\": \"%s\", \"paced\": %s, \"total_ms\": %.3f,", replayPath,
+           replayPaced ? "true" : "false", (g_get_monotonic_time() - replayStart) / 1000.0);
+    if (replaySaveDir)
+        printf(" \"save_dir\": \"%s\",", replaySaveDir);
+    else
+        printf(" \"save_dir\": null,");
+    printf("\n  \"actions\": [");
+
+    for (i = 0; i < SESSION_RECORD_TYPES; i++)
+    {
+        if (!stats[i].count)
+            continue;
+
+        printf("%s\n    {\"name\": \"%s\", \"count\": %u, \"total_ms\": %.3f, \"mean_ms\": %.3f, \"max_ms\": %.3f}",
+               first ? "" : ",", recordNames[i], stats[i].count, stats[i].total, stats[i].total / stats[i].count,
+               stats[i].max);
+        first = FALSE;
+    }
+
+    printf("\n  ]\n}\n");
+    fflush(stdout);
+
+    g_clear_pointer(&replayData, g_free);
+    g_application_quit(g_application_get_default());
+}
+
+// sends a replayed save into the save directory. The first save after an open becomes a save as into the
+// directory, so later saves journal against that copy and never touch the recorded document. Takes path and
+// returns the one to use.
+
+static gchar *redirect_save(gchar *path)
+{
+    gchar *name;
+
+    if (actionType == SESSION_OPEN)
+    {
+        g_free(replayDocument);
+        replayDocument = g_strdup(path);
+        replayRedirected = FALSE;
+        return path;
+    }
+
+    if (actionType == SESSION_SAVE && !replayRedirected && replayDocument)
+    {
+        actionType = SESSION_SAVE_AS;
+        path = g_strdup(replayDocument);
+    }
+
+    if (actionType == SESSION_SAVE_AS && path)
+    {
+        name = g_path_get_basename(path);
+        g_free(path);
+        path = g_build_filename(replaySaveDir, name, NULL);
+        g_free(name);
+        replayRedirected = TRUE;
+    }
+
+    return path;
+}
+
+// plays the next record. Each runs from an idle callback, after gtk has redrawn and handled anything else more
+// urgent, so the time from dispatching an action to the next step is how long the editor took to settle.
+// An open is not settled until its file has loaded or been indexed, and a save until it is on disk.
+
+static gboolean replay_step(gpointer data)
+{
+    SessionRecord record;
+    const gchar *payload;
+    gchar *path = NULL;
+
+    replaySource = 0;
+
+    if (fileio_loading() || largefile_indexing() || journal_busy())
+    {
+        replaySource = g_timeout_add(1, replay_step, NULL);
+        return G_SOURCE_REMOVE;
+    }
+
+    settle_action();
+
+    if (replayPos + sizeof(record) > replayLen)
+    {
+        finish_replay();
+        return G_SOURCE_REMOVE;
+    }
+
+    // records follow paths of any length so are rarely aligned, they are copied out rather than read in place
+
+    memcpy(&record, replayData + replayPos, sizeof(record));
+    payload = replayData + replayPos + sizeof(record);
+    if (record.type >= SESSION_RECORD_TYPES || record.size > replayLen - replayPos - sizeof(record))
+    {
+        fprintf(stderr, "%s is damaged after %zu bytes\n", replayPath, replayPos);
+        finish_replay();
+        return G_SOURCE_REMOVE;
+    }
+
+    // a paced replay waits until the record is due
+
+    if (replayPaced)
+    {
+        gint64 wait = replayStart + (gint64) record.time - g_get_monotonic_time();
+
+        if (wait >= 1000)
+        {
+            replaySource = g_timeout_add(wait / 1000, replay_step, NULL);
+            return G_SOURCE_REMOVE;
+        }
+    }
+
+    replayPos += sizeof(record) + record.size;
+    actionType = record.type;
+    actionStart = g_get_monotonic_time();
+
+    if (record.type == SESSION_KEY_PRESS || record.type == SESSION_KEY_RELEASE)
+        inject_key(&record);
+    else
+    {
+        if (record.size)
+            path = g_strndup(payload, record.size);
+
+        if (replaySaveDir)
+            path = redirect_save(path);
+        else if ((actionType == SESSION_SAVE || actionType == SESSION_SAVE_AS) && !replayWarned)
+        {
+            fprintf(stderr, "%s saves over the files it recorded, use --replay-saves DIR to write them elsewhere\n",
+                    replayPath);
+            replayWarned = TRUE;
+        }
+
+        actionFunc(actionType, path);
+        g_free(path);
+    }
+
+    replaySource = g_idle_add(replay_step, NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
+// starts recording key events from a window, or replaying a session into it once the main loop runs. Must be
+// attached before the window's own key handlers. action performs the recorded toolbar and file actions.
+
+void session_attach(GtkWidget *window, GtkWidget *focus, SessionActionFunc action)
+{
+    sessionWindow = window;
+    actionFunc = action;
+
+    if (recordFile)
+    {
+        pressHandler = g_signal_connect(window, "key-press-event", G_CALLBACK(on_key), NULL);
+        releaseHandler = g_signal_connect(window, "key-release-event", G_CALLBACK(on_key), NULL);
+    }
+
+    if (replayData)
+    {
+        gtk_widget_grab_focus(focus);
+        replayStart = g_get_monotonic_time();
+        replaySource = g_idle_add(replay_step, NULL);
+    }
+}
+
+// finishes the session file and stops any replay
+
+void session_detach(void)
+{
+    if (recordFile)
+    {
+        if (g_signal_handler_is_connected(sessionWindow, pressHandler))
+            g_signal_handler_disconnect(sessionWindow, pressHandler);
+        if (g_signal_handler_is_connected(sessionWindow, releaseHandler))
+            g_signal_handler_disconnect(sessionWindow, releaseHandler);
+
+        fclose(recordFile);
+        recordFile = NULL;
+    }
+
+    if (replaySource)
+    {
+        g_source_remove(replaySource);
+        replaySource = 0;
+    }
+
+    g_clear_pointer(&replayData, g_free);
+    g_clear_pointer(&replayPath, g_free);
+    g_clear_pointer(&replaySaveDir, g_free);
+    g_clear_pointer(&replayDocument, g_free);
+}
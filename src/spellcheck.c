@@ -5,54 +5,1702 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "spellcheck.h"
+#include "dictmap.h"
+#include "userdict.h"
 #include "debugmsg.h"
+#include "trace.h"
 
 #include <hunspell/hunspell.h>
 
+// longest word handed to hunspell, anything longer is left unchecked
+
+#define SPELLCHECK_MAX_WORD 100
+
+// size of the verdict cache hash table, must be a power of two. The table is kept at most half full so probe
+// sequences stay short.
+
+#define SPELLCACHE_SLOTS 65536
+#define SPELLCACHE_MAX_ENTRIES (SPELLCACHE_SLOTS / 2)
+
+// words longer than this bypass the cache, they are rare and would waste arena space
+
+#define SPELLCACHE_MAX_WORD 64
+
+// the arena is big enough to hold every entry at its longest, so compacting it always frees enough space
+
+#define SPELLCACHE_ARENA_SIZE (SPELLCACHE_MAX_ENTRIES * SPELLCACHE_MAX_WORD)
+
+// suggestion lists kept, hunspell takes tens of milliseconds to come up with each one
+
+#define SPELLSUGGEST_CACHE 256
+
+// prefetches beyond this many waiting are dropped, they are only guesses at what will be asked for
+
+#define SPELLSUGGEST_MAX_PREFETCH 64
+
+// where the personal dictionary lives, under $XDG_CONFIG_HOME or else ~/.config
+
+#define SPELLCHECK_PERSONAL_DIR "buk"
+#define SPELLCHECK_PERSONAL_FILE "personal.udic"
+
+// one slot of the verdict cache, the word itself lives in the string arena. A length of zero marks an empty slot.
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t offset;
+    uint8_t length;
+    uint8_t valid;
+    uint8_t referenced;
+} CacheSlot;
+
+// a word accepted this session. Added words are also saved, ignored ones are forgotten on exit.
+
+typedef struct
+{
+    uint32_t hash;
+    bool persist;
+    char *word;
+} PersonalSlot;
+
 static Hunhandle *spellchecker;
 
-// initialised the static spellchecker handle. At the moment this takes no args and sets up a en_US dictionary
-// in future the function can take an arg to decide upon languages.
+// guards the hunspell handle and the cache, hunspell itself is not safe to call from several threads
 
-void spellcheck_init(void)
+static pthread_mutex_t spellLock = PTHREAD_MUTEX_INITIALIZER;
+
+static CacheSlot cacheSlots[SPELLCACHE_SLOTS];
+static char cacheArena[SPELLCACHE_ARENA_SIZE];
+static size_t arenaUsed;
+static unsigned int cacheEntries;
+static unsigned int clockHand;
+static SpellcheckCacheStats cacheStats;
+
+// state of the dictionary, it is loaded on a background thread when started with spellcheck_init_async
+
+typedef void (*ReadyFunc)(void *);
+
+static SpellcheckState loadState = SPELLCHECK_UNLOADED;
+static pthread_t loader;
+static bool loaderRunning;
+static ReadyFunc readyFunc;
+static void *readyData;
+
+// the precompiled word list, and whether hunspell is still being loaded behind it
+
+static DictMap *wordList;
+static bool hunspellLoading;
+static pthread_cond_t loadedCond = PTHREAD_COND_INITIALIZER;
+
+// the personal dictionary as saved, mapped at startup, and the words accepted since in an open addressed set
+// which is kept at most half full. They have a lock of their own so accepting a word never waits on hunspell,
+// which hears about new words from the pending list the next time spellLock is taken.
+
+static pthread_mutex_t personalLock = PTHREAD_MUTEX_INITIALIZER;
+static UserDict *personalDict;
+static char personalPath[PATH_MAX];
+static PersonalSlot *personalSlots;
+static uint32_t personalSlotCount, personalCount;
+static char **personalPending;
+static size_t pendingCount, pendingCapacity;
+static bool personalChanged;
+
+// a cached suggestion list, the suggestions are packed one after another each with its nul, and an empty string
+// ends the list. A slot with no list is empty.
+
+typedef struct
 {
-    DEB("%s", "Initialising spellchecker...\n");
+    char word[SPELLCHECK_MAX_WORD + 1];
+    char *list;
+    size_t size;
+    unsigned long used;
+} SuggestEntry;
 
-    if (!spellchecker)
-        spellchecker = Hunspell_create("../res/hunspell-en_US/en_US.aff", "../res/hunspell-en_US/en_US.dic");
+// a word waiting for the suggestion thread, a prefetch has no func
+
+typedef struct SuggestRequest
+{
+    unsigned long ticket;
+    char word[SPELLCHECK_MAX_WORD + 1];
+    SpellcheckSuggestFunc func;
+    void *data;
+    struct SuggestRequest *next;
+} SuggestRequest;
+
+// guards the suggestion cache and queue. It is never held while hunspell runs, so looking in the cache does
+// not wait on a suggestion being worked out.
+
+static pthread_mutex_t suggestLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t suggestCond = PTHREAD_COND_INITIALIZER;
+static SuggestEntry suggestCache[SPELLSUGGEST_CACHE];
+static unsigned long suggestClock;
+
+// bumped whenever the cache is emptied, so a list worked out before then is not stored after it
+
+static unsigned long suggestGeneration;
+
+// requests are queued ahead of prefetches. The ticket being worked on is cleared when it is cancelled.
+
+static SuggestRequest *suggestQueue;
+static unsigned int prefetchCount;
+static unsigned long lastTicket, runningTicket;
+static pthread_t suggester;
+static bool suggesterRunning, suggesterStop;
+
+// set when the personal dictionary wants writing, the suggestion thread does it so the disk is never touched
+// on the caller's thread
+
+static bool personalSavePending;
+
+// FNV-1a, cheap and good enough for short words
+
+static uint32_t hash_word(const char *word, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char) word[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
 }
 
-// deinits the static spelchecker handle.
+// empties the cache, must be called whenever the dictionary changes as every verdict may be stale
 
-void spellcheck_deinit(void)
+static void cache_clear(void)
 {
-    DEB("%s", "Deinitialising spellchecker...\n");
+    memset(cacheSlots, 0, sizeof(cacheSlots));
+    arenaUsed = 0;
+    cacheEntries = 0;
+    clockHand = 0;
+}
 
-    if(spellchecker)
-        Hunspell_destroy(spellchecker);
+// finds the slot holding a word, or the empty slot where it would be inserted
+
+static CacheSlot *cache_find(const char *word, size_t len, uint32_t hash, bool *found)
+{
+    uint32_t i = hash & (SPELLCACHE_SLOTS - 1);
+
+    while (cacheSlots[i].length)
+    {
+        CacheSlot *slot = &cacheSlots[i];
+
+        if (slot->hash == hash && slot->length == len && memcmp(cacheArena + slot->offset, word, len) == 0)
+        {
+            *found = true;
+            return slot;
+        }
+
+        i = (i + 1) & (SPELLCACHE_SLOTS - 1);
+    }
+
+    *found = false;
+    return &cacheSlots[i];
 }
 
-// returns true for a valid word and false for an invalid word
+// removes the entry in slot i, later entries of the same probe run are shifted back so no tombstones are needed
 
-bool spellcheck_isvalidword(const char *word)
+static void cache_remove(uint32_t i)
 {
-    bool ret = false;
+    uint32_t j = i;
+
+    for (;;)
+    {
+        j = (j + 1) & (SPELLCACHE_SLOTS - 1);
+
+        if (!cacheSlots[j].length)
+            break;
+
+        uint32_t home = cacheSlots[j].hash & (SPELLCACHE_SLOTS - 1);
+
+        // the entry at j may only move back if its home slot is not between i and j
+
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j))
+        {
+            cacheSlots[i] = cacheSlots[j];
+            i = j;
+        }
+    }
+
+    cacheSlots[i].length = 0;
+    cacheEntries--;
+}
+
+// CLOCK eviction, recently used entries get a second chance before they are dropped
+
+static void cache_evict_one(void)
+{
+    for (;;)
+    {
+        CacheSlot *slot = &cacheSlots[clockHand];
+        uint32_t i = clockHand;
+
+        clockHand = (clockHand + 1) & (SPELLCACHE_SLOTS - 1);
+
+        if (!slot->length)
+            continue;
+
+        if (slot->referenced)
+        {
+            slot->referenced = 0;
+            continue;
+        }
+
+        cache_remove(i);
+        cacheStats.evictions++;
+        return;
+    }
+}
+
+// squeezes out the strings of evicted entries so the arena can be reused
+
+static void cache_compact(void)
+{
+    char *fresh = malloc(SPELLCACHE_ARENA_SIZE);
+    size_t used = 0;
+    uint32_t i;
+
+    if (!fresh)
+    {
+        cache_clear();
+        return;
+    }
+
+    for (i = 0; i < SPELLCACHE_SLOTS; i++)
+    {
+        CacheSlot *slot = &cacheSlots[i];
+
+        if (!slot->length)
+            continue;
+
+        memcpy(fresh + used, cacheArena + slot->offset, slot->length);
+        slot->offset = used;
+        used += slot->length;
+    }
+
+    memcpy(cacheArena, fresh, used);
+    arenaUsed = used;
+    free(fresh);
+}
+
+// stores a verdict for a word. Another thread may have cached it while the lock was released for a load.
+
+static void cache_insert(const char *word, size_t len, uint32_t hash, bool valid)
+{
+    CacheSlot *slot;
+    bool found;
+
+    slot = cache_find(word, len, hash, &found);
+    if (found)
+    {
+        slot->valid = valid;
+        return;
+    }
+
+    if (cacheEntries >= SPELLCACHE_MAX_ENTRIES)
+        cache_evict_one();
+
+    if (arenaUsed + len > SPELLCACHE_ARENA_SIZE)
+        cache_compact();
+
+    slot = cache_find(word, len, hash, &found);
+
+    memcpy(cacheArena + arenaUsed, word, len);
+    slot->hash = hash;
+    slot->offset = arenaUsed;
+    slot->length = len;
+    slot->valid = valid;
+    slot->referenced = 0;
+
+    arenaUsed += len;
+    cacheEntries++;
+}
+
+// finds a word in the personal set, returns the slot it is in or the empty slot it would go in. The caller
+// holds personalLock and the set has room.
+
+static PersonalSlot *personal_find_locked(const char *word, size_t len, uint32_t hash)
+{
+    uint32_t mask = personalSlotCount - 1;
+    uint32_t i = hash & mask;
+
+    while (personalSlots[i].word)
+    {
+        PersonalSlot *slot = &personalSlots[i];
+
+        if (slot->hash == hash && strlen(slot->word) == len && memcmp(slot->word, word, len) == 0)
+            break;
+
+        i = (i + 1) & mask;
+    }
+
+    return &personalSlots[i];
+}
+
+// doubles the personal set, returns false if memory ran out. The caller holds personalLock.
+
+static bool personal_grow_locked(void)
+{
+    uint32_t count = personalSlotCount ? personalSlotCount * 2 : 64;
+    PersonalSlot *old = personalSlots;
+    uint32_t oldCount = personalSlotCount, i;
+
+    personalSlots = calloc(count, sizeof(PersonalSlot));
+    if (!personalSlots)
+    {
+        personalSlots = old;
+        return false;
+    }
+
+    personalSlotCount = count;
+
+    for (i = 0; i < oldCount; i++)
+    {
+        if (old[i].word)
+            *personal_find_locked(old[i].word, strlen(old[i].word), old[i].hash) = old[i];
+    }
+
+    free(old);
+
+    return true;
+}
+
+// puts a word in the personal set, or marks it to be saved if it was only ignored before. A new word is also
+// left on the pending list for hunspell and the verdict cache. The caller holds personalLock.
+
+static bool personal_insert_locked(const char *word, size_t len, bool persist)
+{
+    uint32_t hash = hash_word(word, len);
+    PersonalSlot *slot;
+
+    if (2 * (personalCount + 1) > personalSlotCount && !personal_grow_locked())
+        return false;
+
+    if (pendingCount == pendingCapacity)
+    {
+        size_t capacity = pendingCapacity ? pendingCapacity * 2 : 16;
+        char **pending = realloc(personalPending, capacity * sizeof(char *));
+
+        if (!pending)
+            return false;
+
+        personalPending = pending;
+        pendingCapacity = capacity;
+    }
+
+    slot = personal_find_locked(word, len, hash);
+    if (!slot->word)
+    {
+        slot->word = strndup(word, len);
+        if (!slot->word)
+            return false;
+
+        slot->hash = hash;
+        personalCount++;
+        personalPending[pendingCount++] = slot->word;
+        __atomic_store_n(&personalChanged, true, __ATOMIC_RELEASE);
+    }
+
+    slot->persist = slot->persist || persist;
+
+    return true;
+}
+
+// empties the personal set and the pending list. The caller holds personalLock.
+
+static void personal_clear_locked(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < personalSlotCount; i++)
+        free(personalSlots[i].word);
+
+    free(personalSlots);
+    personalSlots = NULL;
+    personalSlotCount = 0;
+    personalCount = 0;
+
+    free(personalPending);
+    personalPending = NULL;
+    pendingCount = 0;
+    pendingCapacity = 0;
+    __atomic_store_n(&personalChanged, false, __ATOMIC_RELEASE);
+}
+
+// true if the word has been accepted, either saved or this session. The caller holds personalLock.
+
+static bool personal_has_locked(const char *word, size_t len)
+{
+    if (personalDict && userdict_contains(personalDict, word, len))
+        return true;
+
+    return personalCount && personal_find_locked(word, len, hash_word(word, len))->word;
+}
+
+// teaches hunspell the personal words, so it stops offering corrections for them and can suggest them. This
+// runs once the handle has loaded, on the loading thread when loading in the background. The caller holds
+// spellLock.
+
+static void personal_to_hunspell_locked(void)
+{
+    char word[SPELLCHECK_MAX_WORD + 1];
+    size_t i, len;
 
     if (!spellchecker)
-        DEB("%s", "Spellchecker was not inited");
+        return;
+
+    pthread_mutex_lock(&personalLock);
+
+    for (i = 0; personalDict && i < userdict_count(personalDict); i++)
+    {
+        const char *entry = userdict_word(personalDict, i, &len);
+
+        if (entry && len <= SPELLCHECK_MAX_WORD)
+        {
+            memcpy(word, entry, len);
+            word[len] = '\0';
+            Hunspell_add(spellchecker, word);
+        }
+    }
+
+    for (i = 0; i < personalSlotCount; i++)
+    {
+        if (personalSlots[i].word)
+            Hunspell_add(spellchecker, personalSlots[i].word);
+    }
+
+    pthread_mutex_unlock(&personalLock);
+}
+
+// marks a word valid in the verdict cache if it is there, along with its capitalised form. The caller holds
+// spellLock.
+
+static void cache_accept_locked(const char *word, size_t len)
+{
+    char upper[SPELLCACHE_MAX_WORD];
+    CacheSlot *slot;
+    bool found;
+
+    if (len == 0 || len > SPELLCACHE_MAX_WORD)
+        return;
+
+    slot = cache_find(word, len, hash_word(word, len), &found);
+    if (found)
+        slot->valid = 1;
+
+    if (word[0] >= 'a' && word[0] <= 'z')
+    {
+        memcpy(upper, word, len);
+        upper[0] -= 'a' - 'A';
+        slot = cache_find(upper, len, hash_word(upper, len), &found);
+        if (found)
+            slot->valid = 1;
+    }
+}
+
+// passes words accepted since the last check on to hunspell and the verdict cache. Only the flag is read when
+// nothing is pending. The caller holds spellLock.
+
+static void personal_sync_locked(void)
+{
+    size_t i;
+
+    if (!__atomic_load_n(&personalChanged, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_lock(&personalLock);
+
+    for (i = 0; i < pendingCount; i++)
+    {
+        if (spellchecker)
+            Hunspell_add(spellchecker, personalPending[i]);
+
+        cache_accept_locked(personalPending[i], strlen(personalPending[i]));
+    }
+
+    pendingCount = 0;
+    __atomic_store_n(&personalChanged, false, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&personalLock);
+}
+
+// makes a directory unless it already exists
+
+static bool make_dir(const char *path)
+{
+    return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+// writes the saved words and those added since to the personal dictionary. The file is small and rewritten
+// whole, sorted, so it always loads with a single mapping. The words are gathered under personalLock and
+// written after releasing it. They stay valid meanwhile as the set only frees them in spellcheck_deinit, once
+// the suggestion thread has stopped.
+
+static bool save_personal(void)
+{
+    UserDictWord *words;
+    char dir[PATH_MAX];
+    char *slash;
+    size_t saved, count = 0, i;
+    bool ret;
+
+    if (!personalPath[0])
+        return false;
+
+    pthread_mutex_lock(&personalLock);
+
+    saved = personalDict ? userdict_count(personalDict) : 0;
+    words = malloc((saved + personalCount + 1) * sizeof(UserDictWord));
+    if (!words)
+    {
+        pthread_mutex_unlock(&personalLock);
+        return false;
+    }
+
+    for (i = 0; i < saved; i++)
+    {
+        words[count].word = userdict_word(personalDict, i, &words[count].len);
+        if (words[count].word)
+            count++;
+    }
+
+    for (i = 0; i < personalSlotCount; i++)
+    {
+        if (personalSlots[i].word && personalSlots[i].persist)
+        {
+            words[count].word = personalSlots[i].word;
+            words[count].len = strlen(personalSlots[i].word);
+            count++;
+        }
+    }
+
+    pthread_mutex_unlock(&personalLock);
+
+    // the config directory and ours inside it may not exist yet
+
+    strcpy(dir, personalPath);
+    slash = strrchr(dir, '/');
+    *slash = '\0';
+    slash = strrchr(dir, '/');
+    *slash = '\0';
+    make_dir(dir);
+    *slash = '/';
+    make_dir(dir);
+
+    ret = userdict_write(personalPath, words, count);
+    free(words);
+
+    return ret;
+}
+
+// loads the en_US dictionary from disk, this is the slow part of starting the spellchecker
+
+static Hunhandle *load_dictionary(void)
+{
+    return Hunspell_create("../res/hunspell-en_US/en_US.aff", "../res/hunspell-en_US/en_US.dic");
+}
+
+// maps the precompiled word list if one has been built with dictc, this only costs an mmap
+
+static void map_word_list(void)
+{
+    DictMap *map = dictmap_open("../res/hunspell-en_US/en_US.bdic");
+
+    pthread_mutex_lock(&spellLock);
+    wordList = map;
+    pthread_mutex_unlock(&spellLock);
+}
+
+// maps the personal dictionary, which like the word list costs only an mmap however many words it holds
+
+static void map_personal(void)
+{
+    const char *config = getenv("XDG_CONFIG_HOME");
+    const char *home = getenv("HOME");
+    UserDict *dict = NULL;
+    int n = -1;
+
+    if (config && *config)
+        n = snprintf(personalPath, sizeof(personalPath), "%s/" SPELLCHECK_PERSONAL_DIR, config);
+    else if (home && *home)
+        n = snprintf(personalPath, sizeof(personalPath), "%s/.config/" SPELLCHECK_PERSONAL_DIR, home);
+
+    if (n < 0 || (size_t) n + sizeof("/" SPELLCHECK_PERSONAL_FILE) > sizeof(personalPath))
+        personalPath[0] = '\0';
     else
-        ret = (Hunspell_spell(spellchecker, word) == 1);
+    {
+        strcat(personalPath, "/" SPELLCHECK_PERSONAL_FILE);
+        dict = userdict_open(personalPath);
+    }
+
+    pthread_mutex_lock(&spellLock);
+    personalDict = dict;
+    pthread_mutex_unlock(&spellLock);
+}
+
+// leaves the loading state once there is something to check words against. The caller holds spellLock and
+// must call the returned function, if any, after releasing it.
+
+static ReadyFunc leave_loading_locked(bool ok, void **data)
+{
+    ReadyFunc func = readyFunc;
+
+    if (loadState != SPELLCHECK_LOADING)
+        return NULL;
+
+    loadState = ok ? SPELLCHECK_READY : SPELLCHECK_FAILED;
+    *data = readyData;
+    readyFunc = NULL;
+
+    return func;
+}
+
+// installs a freshly loaded handle and tells whoever asked to be notified. Verdicts cached before now came from
+// the compiled word list, which hunspell agrees with, so the cache is left alone.
+
+static void finish_load(Hunhandle *handle)
+{
+    ReadyFunc func;
+    void *data;
+
+    pthread_mutex_lock(&spellLock);
+
+    spellchecker = handle;
+    personal_to_hunspell_locked();
+    hunspellLoading = false;
+    pthread_cond_broadcast(&loadedCond);
+    func = leave_loading_locked(handle || wordList, &data);
+
+    pthread_mutex_unlock(&spellLock);
+
+    if (func)
+        func(data);
+}
+
+// body of the dictionary loading thread
+
+static void *loader_main(void *arg)
+{
+    finish_load(load_dictionary());
+
+    return NULL;
+}
+
+// moves from unloaded to loading, returns false if loading has already been started
+
+static bool begin_load(void)
+{
+    bool ret;
+
+    pthread_mutex_lock(&spellLock);
+
+    ret = (loadState == SPELLCHECK_UNLOADED);
+    if (ret)
+    {
+        loadState = SPELLCHECK_LOADING;
+        hunspellLoading = true;
+    }
+
+    pthread_mutex_unlock(&spellLock);
 
     return ret;
 }
 
-// tokenizes all words in a sentence
+// initialised the static spellchecker handle. At the moment this takes no args and sets up a en_US dictionary
+// in future the function can take an arg to decide upon languages.
 
-bool spellcheck_checkstring(const char *string)
+void spellcheck_init(void)
 {
-    return true;
-}
\ No newline at end of file
+    DEB("%s", "Initialising spellchecker...\n");
+
+    if (!begin_load())
+        return;
+
+    map_word_list();
+    map_personal();
+    finish_load(load_dictionary());
+}
+
+// starts loading the dictionary on a background thread and returns straight away. When a compiled word list
+// is present the spellchecker is ready as soon as it is mapped, and only words missing from the list wait for
+// hunspell. Otherwise checks made before the handle is ready find nothing, use spellcheck_notify_ready to hear
+// when it is.
+
+void spellcheck_init_async(void)
+{
+    ReadyFunc func = NULL;
+    void *data;
+
+    DEB("%s", "Initialising spellchecker in the background...\n");
+
+    if (!begin_load())
+        return;
+
+    map_word_list();
+    map_personal();
+
+    if (pthread_create(&loader, NULL, loader_main, NULL) == 0)
+        loaderRunning = true;
+    else
+        finish_load(load_dictionary());
+
+    pthread_mutex_lock(&spellLock);
+    if (wordList)
+        func = leave_loading_locked(true, &data);
+    pthread_mutex_unlock(&spellLock);
+
+    if (func)
+        func(data);
+}
+
+static void suggest_stop(void);
+
+// deinits the static spelchecker handle, waiting for a background load to finish first.
+
+void spellcheck_deinit(void)
+{
+    DEB("%s", "Deinitialising spellchecker...\n");
+
+    if (loaderRunning)
+    {
+        pthread_join(loader, NULL);
+        loaderRunning = false;
+    }
+
+    suggest_stop();
+
+    pthread_mutex_lock(&spellLock);
+
+    if(spellchecker)
+    {
+        Hunspell_destroy(spellchecker);
+        spellchecker = NULL;
+    }
+
+    dictmap_close(wordList);
+    wordList = NULL;
+    pthread_mutex_lock(&personalLock);
+    userdict_close(personalDict);
+    personalDict = NULL;
+    personal_clear_locked();
+    pthread_mutex_unlock(&personalLock);
+    cache_clear();
+
+    loadState = SPELLCHECK_UNLOADED;
+    readyFunc = NULL;
+
+    pthread_mutex_unlock(&spellLock);
+}
+
+// returns whether the dictionary is unloaded, still loading or ready to use
+
+SpellcheckState spellcheck_state(void)
+{
+    SpellcheckState state;
+
+    pthread_mutex_lock(&spellLock);
+    state = loadState;
+    pthread_mutex_unlock(&spellLock);
+
+    return state;
+}
+
+// arranges for func to be called once loading has finished, either way. If it already has, func is called
+// straight away. Otherwise it is called on the loading thread, so it must be thread safe. Only one function
+// can be waiting at a time.
+
+void spellcheck_notify_ready(void (*func)(void *), void *data)
+{
+    bool now;
+
+    pthread_mutex_lock(&spellLock);
+
+    now = (loadState != SPELLCHECK_LOADING);
+    if (!now)
+    {
+        readyFunc = func;
+        readyData = data;
+    }
+
+    pthread_mutex_unlock(&spellLock);
+
+    if (now)
+        func(data);
+}
+
+// asks hunspell about a word. If only the compiled word list was ready this waits for the background load,
+// the lock is released meanwhile. The caller holds spellLock.
+
+static bool hunspell_spell_locked(const char *word)
+{
+    while (!spellchecker && hunspellLoading)
+        pthread_cond_wait(&loadedCond, &spellLock);
+
+    return spellchecker && Hunspell_spell(spellchecker, word) == 1;
+}
+
+// exact lookup in the compiled word list, a capitalised first letter is also accepted as at the start of a
+// sentence. Anything needing affix or compound rules is left to hunspell.
+
+static bool word_list_contains(const char *word, size_t len)
+{
+    char lower[SPELLCHECK_MAX_WORD];
+
+    if (!wordList || len == 0)
+        return false;
+
+    if (dictmap_contains(wordList, word, len))
+        return true;
+
+    if (len <= SPELLCHECK_MAX_WORD && word[0] >= 'A' && word[0] <= 'Z')
+    {
+        memcpy(lower, word, len);
+        lower[0] += 'a' - 'A';
+        return dictmap_contains(wordList, lower, len);
+    }
+
+    return false;
+}
+
+// looks in the personal words the same way, so a word added in lower case is accepted capitalised
+
+static bool personal_contains(const char *word, size_t len)
+{
+    char lower[SPELLCHECK_MAX_WORD];
+    bool ret = false;
+
+    if (len == 0)
+        return false;
+
+    pthread_mutex_lock(&personalLock);
+
+    if (personalDict || personalCount)
+        ret = personal_has_locked(word, len);
+
+    if (!ret && (personalDict || personalCount) && len <= SPELLCHECK_MAX_WORD && word[0] >= 'A' && word[0] <= 'Z')
+    {
+        memcpy(lower, word, len);
+        lower[0] += 'a' - 'A';
+        ret = personal_has_locked(lower, len);
+    }
+
+    pthread_mutex_unlock(&personalLock);
+
+    return ret;
+}
+
+// looks a word up in the cache, then the compiled word list, the personal words and finally hunspell. The
+// caller holds spellLock and word[len] is a nul.
+
+static bool check_word_locked(const char *word, size_t len)
+{
+    bool ret;
+
+    if (len == 0 || len > SPELLCACHE_MAX_WORD)
+        return word_list_contains(word, len) || personal_contains(word, len)
+            || hunspell_spell_locked(word);
+
+    uint32_t hash = hash_word(word, len);
+    bool found;
+    CacheSlot *slot = cache_find(word, len, hash, &found);
+
+    if (found)
+    {
+        slot->referenced = 1;
+        ret = slot->valid;
+        cacheStats.hits++;
+    }
+    else
+    {
+        ret = word_list_contains(word, len) || personal_contains(word, len) || hunspell_spell_locked(word);
+        cache_insert(word, len, hash, ret);
+        cacheStats.misses++;
+    }
+
+    return ret;
+}
+
+// returns true for a valid word and false for an invalid word
+
+bool spellcheck_isvalidword(const char *word)
+{
+    bool ret = false;
+
+    pthread_mutex_lock(&spellLock);
+
+    if (loadState != SPELLCHECK_READY)
+        DEB("%s", "Spellchecker was not inited");
+    else
+    {
+        personal_sync_locked();
+        ret = check_word_locked(word, strlen(word));
+    }
+
+    pthread_mutex_unlock(&spellLock);
+
+    return ret;
+}
+
+// copies out the verdict cache counters
+
+void spellcheck_cache_stats(SpellcheckCacheStats *stats)
+{
+    pthread_mutex_lock(&spellLock);
+    *stats = cacheStats;
+    stats->entries = cacheEntries;
+    pthread_mutex_unlock(&spellLock);
+}
+
+// true for bytes which separate chunks of text, that is ascii whitespace and control characters
+
+static inline bool is_space_byte(unsigned char c)
+{
+    return c <= ' ';
+}
+
+#if defined(__SSE2__)
+
+// returns a bitmask of the bytes in a 16 byte block which are whitespace or control characters
+
+static inline unsigned int space_mask(const char *p)
+{
+    __m128i block = _mm_loadu_si128((const __m128i *) p);
+
+    // bytes at or above 0x80 compare as negative, so they never count as whitespace
+
+    __m128i notNeg = _mm_cmpgt_epi8(block, _mm_set1_epi8(-1));
+    __m128i belowSpace = _mm_cmplt_epi8(block, _mm_set1_epi8(' ' + 1));
+
+    return _mm_movemask_epi8(_mm_and_si128(notNeg, belowSpace));
+}
+
+#endif
+
+// finds the first whitespace byte at or after i, or len if there is none
+
+static size_t find_space(const char *s, size_t i, size_t len)
+{
+#if defined(__SSE2__)
+    while (i + 16 <= len)
+    {
+        unsigned int mask = space_mask(s + i);
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+
+    while (i < len && !is_space_byte(s[i]))
+        i++;
+
+    return i;
+}
+
+// finds the first byte at or after i which is not whitespace, or len if there is none
+
+static size_t skip_space(const char *s, size_t i, size_t len)
+{
+#if defined(__SSE2__)
+    while (i + 16 <= len)
+    {
+        unsigned int mask = space_mask(s + i) ^ 0xffff;
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+
+    while (i < len && is_space_byte(s[i]))
+        i++;
+
+    return i;
+}
+
+// decodes the utf-8 sequence at s[i], returning its length in bytes. Malformed input decodes as U+FFFD one byte
+// at a time so scanning always makes progress.
+
+static size_t decode_utf8(const char *s, size_t i, size_t len, uint32_t *cp)
+{
+    const unsigned char *u = (const unsigned char *) s + i;
+    size_t avail = len - i;
+    size_t need, k;
+    uint32_t c;
+
+    if (u[0] < 0x80)
+    {
+        *cp = u[0];
+        return 1;
+    }
+    else if ((u[0] & 0xe0) == 0xc0)
+    {
+        need = 2;
+        c = u[0] & 0x1f;
+    }
+    else if ((u[0] & 0xf0) == 0xe0)
+    {
+        need = 3;
+        c = u[0] & 0x0f;
+    }
+    else if ((u[0] & 0xf8) == 0xf0)
+    {
+        need = 4;
+        c = u[0] & 0x07;
+    }
+    else
+    {
+        *cp = 0xfffd;
+        return 1;
+    }
+
+    if (need > avail)
+    {
+        *cp = 0xfffd;
+        return 1;
+    }
+
+    for (k = 1; k < need; k++)
+    {
+        if ((u[k] & 0xc0) != 0x80)
+        {
+            *cp = 0xfffd;
+            return 1;
+        }
+        c = (c << 6) | (u[k] & 0x3f);
+    }
+
+    *cp = c;
+    return need;
+}
+
+// true for code points which can make up a word. Outside ascii everything is a letter apart from the
+// punctuation, symbol and special blocks, which is all hunspell needs to see sensible tokens.
+
+static bool is_word_cp(uint32_t cp)
+{
+    if (cp < 0x80)
+        return (cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z') || (cp >= '0' && cp <= '9');
+
+    if (cp < 0xc0 || cp == 0xd7 || cp == 0xf7)
+        return false;
+    if (cp >= 0x2000 && cp <= 0x2bff)
+        return false;
+    if (cp >= 0x3000 && cp <= 0x303f)
+        return false;
+    if (cp >= 0xfe30 && cp <= 0xfe4f)
+        return false;
+    if (cp >= 0xff00 && cp <= 0xff20)
+        return false;
+    if (cp >= 0xfff0 && cp <= 0xffff)
+        return false;
+    if (cp >= 0x1f000)
+        return false;
+
+    return true;
+}
+
+// apostrophes only join letters together, they are checked separately from is_word_cp
+
+static inline bool is_apostrophe_cp(uint32_t cp)
+{
+    return cp == '\'' || cp == 0x2019;
+}
+
+// true for chunks of text which are urls or e-mail addresses and should not be spellchecked
+
+static bool is_address(const char *s, size_t len)
+{
+    const char *at, *colon;
+
+    if (len >= 4 && strncasecmp(s, "www.", 4) == 0)
+        return true;
+
+    colon = memchr(s, ':', len);
+    if (colon && len - (colon - s) >= 3 && colon[1] == '/' && colon[2] == '/')
+        return true;
+
+    at = memchr(s, '@', len);
+    if (at && memchr(at, '.', len - (at - s)))
+        return true;
+
+    return false;
+}
+
+// true for words the dictionary should never see, those holding digits and acronyms written in capitals
+
+static bool skip_word(const char *s, size_t len)
+{
+    size_t i;
+    bool lower = false;
+
+    for (i = 0; i < len; i++)
+    {
+        unsigned char c = s[i];
+
+        if (c >= '0' && c <= '9')
+            return true;
+        if ((c >= 'a' && c <= 'z') || c >= 0x80)
+            lower = true;
+    }
+
+    return !lower && len > 1;
+}
+
+// appends a misspelt span to a result, growing its array when needed
+
+static bool result_push(SpellcheckResult *result, size_t offset, size_t length)
+{
+    if (result->count == result->capacity)
+    {
+        size_t capacity = result->capacity ? result->capacity * 2 : 64;
+        SpellcheckSpan *spans = realloc(result->spans, capacity * sizeof(SpellcheckSpan));
+
+        if (!spans)
+            return false;
+
+        result->spans = spans;
+        result->capacity = capacity;
+    }
+
+    result->spans[result->count].offset = offset;
+    result->spans[result->count].length = length;
+    result->count++;
+
+    return true;
+}
+
+// splits one whitespace free chunk into words and checks each. The caller holds spellLock.
+
+static void check_chunk(const char *s, size_t start, size_t end, SpellcheckResult *result)
+{
+    char word[SPELLCHECK_MAX_WORD + 1];
+    size_t i = start;
+
+    while (i < end)
+    {
+        uint32_t cp;
+        size_t n = decode_utf8(s, i, end, &cp);
+        size_t wstart, wend;
+
+        if (!is_word_cp(cp))
+        {
+            i += n;
+            continue;
+        }
+
+        // extend the word over letters, digits and apostrophes which sit between letters
+
+        wstart = i;
+        i += n;
+        wend = i;
+        while (i < end)
+        {
+            n = decode_utf8(s, i, end, &cp);
+
+            if (is_apostrophe_cp(cp))
+            {
+                uint32_t next;
+
+                if (i + n >= end)
+                    break;
+
+                decode_utf8(s, i + n, end, &next);
+                if (!is_word_cp(next))
+                    break;
+            }
+            else if (!is_word_cp(cp))
+                break;
+
+            i += n;
+            wend = i;
+        }
+
+        size_t len = wend - wstart;
+
+        if (len > SPELLCHECK_MAX_WORD || skip_word(s + wstart, len))
+            continue;
+
+        memcpy(word, s + wstart, len);
+        word[len] = '\0';
+
+        if (!check_word_locked(word, len))
+            result_push(result, wstart, len);
+    }
+}
+
+// spellchecks a whole utf-8 buffer in one call. The spans of misspelt words are stored in result as byte
+// offsets into string, replacing whatever it held before, and the number found is returned. A result can be
+// reused across calls to avoid reallocating its array.
+
+size_t spellcheck_checkstring(const char *string, size_t len, SpellcheckResult *result)
+{
+    TRACE_SCOPE(TRACE_DETAIL, "spellcheck_checkstring");
+
+    size_t i = 0;
+
+    result->count = 0;
+
+    pthread_mutex_lock(&spellLock);
+
+    if (loadState != SPELLCHECK_READY)
+    {
+        DEB("%s", "Spellchecker was not inited");
+        pthread_mutex_unlock(&spellLock);
+        return 0;
+    }
+
+    personal_sync_locked();
+
+    for (;;)
+    {
+        size_t end;
+
+        i = skip_space(string, i, len);
+        if (i >= len)
+            break;
+
+        end = find_space(string, i, len);
+        if (!is_address(string + i, end - i))
+            check_chunk(string, i, end, result);
+        i = end;
+    }
+
+    pthread_mutex_unlock(&spellLock);
+
+    return result->count;
+}
+
+// releases the array held by a result
+
+void spellcheck_result_free(SpellcheckResult *result)
+{
+    free(result->spans);
+    result->spans = NULL;
+    result->count = 0;
+    result->capacity = 0;
+}
+
+// finds a word's cached suggestions. The caller holds suggestLock.
+
+static SuggestEntry *suggest_find_locked(const char *word)
+{
+    unsigned int i;
+
+    for (i = 0; i < SPELLSUGGEST_CACHE; i++)
+    {
+        if (suggestCache[i].list && strcmp(suggestCache[i].word, word) == 0)
+        {
+            suggestCache[i].used = ++suggestClock;
+            return &suggestCache[i];
+        }
+    }
+
+    return NULL;
+}
+
+// caches a word's suggestions in an empty slot or in place of the least recently used. The caller holds
+// suggestLock and the cache takes the list.
+
+static void suggest_store_locked(const char *word, char *list, size_t size)
+{
+    SuggestEntry *entry = &suggestCache[0];
+    unsigned int i;
+
+    for (i = 0; i < SPELLSUGGEST_CACHE && entry->list; i++)
+    {
+        if (!suggestCache[i].list || suggestCache[i].used < entry->used)
+            entry = &suggestCache[i];
+    }
+
+    free(entry->list);
+    strcpy(entry->word, word);
+    entry->list = list;
+    entry->size = size;
+    entry->used = ++suggestClock;
+}
+
+// empties the suggestion cache. The caller holds suggestLock.
+
+static void suggest_clear_locked(void)
+{
+    unsigned int i;
+
+    suggestGeneration++;
+
+    for (i = 0; i < SPELLSUGGEST_CACHE; i++)
+    {
+        free(suggestCache[i].list);
+        suggestCache[i].list = NULL;
+    }
+}
+
+// returns a copy of a cached list for the caller to free, NULL if the word is not cached. The caller holds
+// suggestLock.
+
+static char *suggest_copy_locked(const char *word)
+{
+    SuggestEntry *entry = suggest_find_locked(word);
+    char *copy;
+
+    if (!entry || !(copy = malloc(entry->size)))
+        return NULL;
+
+    return memcpy(copy, entry->list, entry->size);
+}
+
+// asks hunspell for a word's suggestions, packed into one block. Waits for hunspell if only the compiled word
+// list has loaded, a dictionary which failed to load suggests nothing.
+
+static char *run_suggest(const char *word, size_t *size)
+{
+    TRACE_SCOPE(TRACE_SPAN, "run_suggest");
+
+    char **found = NULL;
+    char *list, *p;
+    int count = 0, i;
+
+    pthread_mutex_lock(&spellLock);
+
+    while (!spellchecker && hunspellLoading)
+        pthread_cond_wait(&loadedCond, &spellLock);
+
+    personal_sync_locked();
+
+    if (spellchecker)
+        count = Hunspell_suggest(spellchecker, &found, word);
+
+    *size = 1;
+    for (i = 0; i < count; i++)
+        *size += strlen(found[i]) + 1;
+
+    p = list = malloc(*size);
+    if (list)
+    {
+        for (i = 0; i < count; i++)
+            p = stpcpy(p, found[i]) + 1;
+        *p = '\0';
+    }
+
+    if (found)
+        Hunspell_free_list(spellchecker, &found, count);
+
+    pthread_mutex_unlock(&spellLock);
+
+    return list;
+}
+
+// looks up a word's suggestions, working them out if they are not cached. Returns a list the caller frees,
+// NULL if memory ran out.
+
+static char *suggest_lookup(const char *word)
+{
+    char *list, *copy;
+    unsigned long generation;
+    size_t size;
+
+    pthread_mutex_lock(&suggestLock);
+    copy = suggest_copy_locked(word);
+    generation = suggestGeneration;
+    pthread_mutex_unlock(&suggestLock);
+
+    if (copy || !(list = run_suggest(word, &size)))
+        return copy;
+
+    copy = malloc(size);
+    if (copy)
+        memcpy(copy, list, size);
+
+    // a word accepted meanwhile may be missing from the list, it is still returned but not kept
+
+    pthread_mutex_lock(&suggestLock);
+    if (generation == suggestGeneration)
+        suggest_store_locked(word, list, size);
+    else
+        free(list);
+    pthread_mutex_unlock(&suggestLock);
+
+    return copy;
+}
+
+// body of the suggestion thread, works through the queue until told to stop
+
+static void *suggester_main(void *arg)
+{
+    for (;;)
+    {
+        SuggestRequest *request;
+        char *list;
+        bool deliver;
+
+        pthread_mutex_lock(&suggestLock);
+
+        while (!suggestQueue && !suggesterStop && !personalSavePending)
+            pthread_cond_wait(&suggestCond, &suggestLock);
+
+        // a save is finished before stopping so the last word added is not lost
+
+        if (personalSavePending)
+        {
+            personalSavePending = false;
+            pthread_mutex_unlock(&suggestLock);
+
+            if (!save_personal())
+                fprintf(stderr, "Cannot save the personal dictionary to %s\n", personalPath);
+            continue;
+        }
+
+        if (suggesterStop)
+        {
+            pthread_mutex_unlock(&suggestLock);
+            break;
+        }
+
+        request = suggestQueue;
+        suggestQueue = request->next;
+        if (!request->func)
+            prefetchCount--;
+        runningTicket = request->ticket;
+
+        pthread_mutex_unlock(&suggestLock);
+
+        list = suggest_lookup(request->word);
+
+        pthread_mutex_lock(&suggestLock);
+        deliver = request->func && runningTicket == request->ticket;
+        runningTicket = 0;
+        pthread_mutex_unlock(&suggestLock);
+
+        if (deliver)
+            request->func(request->ticket, list, request->data);
+        else
+            free(list);
+
+        free(request);
+    }
+
+    return NULL;
+}
+
+// stops the suggestion thread, anything still queued is dropped and the cache emptied
+
+static void suggest_stop(void)
+{
+    SuggestRequest *request;
+
+    pthread_mutex_lock(&suggestLock);
+    suggesterStop = true;
+    pthread_cond_signal(&suggestCond);
+    pthread_mutex_unlock(&suggestLock);
+
+    if (suggesterRunning)
+    {
+        pthread_join(suggester, NULL);
+        suggesterRunning = false;
+    }
+
+    pthread_mutex_lock(&suggestLock);
+
+    while ((request = suggestQueue))
+    {
+        suggestQueue = request->next;
+        free(request);
+    }
+
+    prefetchCount = 0;
+    suggesterStop = false;
+    suggest_clear_locked();
+
+    pthread_mutex_unlock(&suggestLock);
+}
+
+// returns the suggestions for a misspelt word, working them out if need be, which can take a while. The list
+// holds each suggestion with its nul and ends with an empty string. The caller frees it, NULL is returned if
+// memory ran out.
+
+char *spellcheck_suggest(const char *word)
+{
+    if (strlen(word) > SPELLCHECK_MAX_WORD)
+        return calloc(1, 1);
+
+    return suggest_lookup(word);
+}
+
+// returns a word's suggestions only if they are already known, without waiting, and otherwise NULL
+
+char *spellcheck_suggest_cached(const char *word)
+{
+    char *copy;
+
+    if (strlen(word) > SPELLCHECK_MAX_WORD)
+        return NULL;
+
+    pthread_mutex_lock(&suggestLock);
+    copy = suggest_copy_locked(word);
+    pthread_mutex_unlock(&suggestLock);
+
+    return copy;
+}
+
+// queues a word for the suggestion thread and returns a ticket for it. Once the suggestions are known func is
+// called on that thread with the ticket and a list it must free, in the form spellcheck_suggest returns. With
+// no func the word is only prefetched into the cache, behind any requests, and nothing is queued if it is
+// cached or waiting already. Returns 0 if nothing was queued, func is then never called.
+
+unsigned long spellcheck_suggest_async(const char *word, SpellcheckSuggestFunc func, void *data)
+{
+    SuggestRequest *request, **at;
+    unsigned long ticket = 0;
+
+    if (strlen(word) > SPELLCHECK_MAX_WORD)
+        return 0;
+
+    pthread_mutex_lock(&suggestLock);
+
+    if (!suggesterRunning)
+        suggesterRunning = pthread_create(&suggester, NULL, suggester_main, NULL) == 0;
+
+    if (!suggesterRunning || (!func && prefetchCount >= SPELLSUGGEST_MAX_PREFETCH))
+        goto out;
+
+    // a request goes after the others but ahead of every prefetch, a prefetch at the end
+
+    for (at = &suggestQueue; *at && ((*at)->func || !func); at = &(*at)->next)
+    {
+        if (!func && strcmp((*at)->word, word) == 0)
+            goto out;
+    }
+
+    if (!func && suggest_find_locked(word))
+        goto out;
+
+    request = malloc(sizeof(*request));
+    if (!request)
+        goto out;
+
+    ticket = request->ticket = ++lastTicket;
+    strcpy(request->word, word);
+    request->func = func;
+    request->data = data;
+    request->next = *at;
+    *at = request;
+
+    if (!func)
+        prefetchCount++;
+
+    pthread_cond_signal(&suggestCond);
+
+out:
+    pthread_mutex_unlock(&suggestLock);
+
+    return ticket;
+}
+
+// withdraws a request. If the thread has already started on it the suggestions are still cached but func is
+// not called. If func has already been called, or is being called, the cancel comes too late to stop it, so
+// callers must check the ticket they are handed against the one they are waiting on.
+
+void spellcheck_suggest_cancel(unsigned long ticket)
+{
+    SuggestRequest **at;
+
+    if (!ticket)
+        return;
+
+    pthread_mutex_lock(&suggestLock);
+
+    if (runningTicket == ticket)
+        runningTicket = 0;
+
+    for (at = &suggestQueue; *at; at = &(*at)->next)
+    {
+        if ((*at)->ticket == ticket)
+        {
+            SuggestRequest *request = *at;
+
+            *at = request->next;
+            if (!request->func)
+                prefetchCount--;
+            free(request);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&suggestLock);
+}
+
+// accepts a word from now on without reloading anything. The word goes in the personal set, and hunspell and
+// the verdict cache hear of it the next time they are used, so this never waits on a check or a suggestion.
+// Saved words are written to the personal dictionary on the suggestion thread.
+
+static bool accept_word(const char *word, bool persist)
+{
+    size_t len = strlen(word);
+    bool ret, queued = false;
+
+    if (len == 0 || len > SPELLCHECK_MAX_WORD)
+        return false;
+
+    pthread_mutex_lock(&personalLock);
+    ret = personal_insert_locked(word, len, persist);
+    pthread_mutex_unlock(&personalLock);
+
+    if (!ret)
+        return false;
+
+    // cached suggestions for other words could now include this one
+
+    pthread_mutex_lock(&suggestLock);
+
+    suggest_clear_locked();
+
+    if (persist)
+    {
+        if (!suggesterRunning)
+            suggesterRunning = pthread_create(&suggester, NULL, suggester_main, NULL) == 0;
+
+        queued = personalSavePending = suggesterRunning;
+        pthread_cond_signal(&suggestCond);
+    }
+
+    pthread_mutex_unlock(&suggestLock);
+
+    // without the thread there is nowhere else to write it
+
+    if (persist && !queued && !save_personal())
+        fprintf(stderr, "Cannot save the personal dictionary to %s\n", personalPath);
+
+    return true;
+}
+
+// adds a word to the personal dictionary, returns false if it cannot be accepted
+
+bool spellcheck_add_word(const char *word)
+{
+    return accept_word(word, true);
+}
+
+// accepts a word until the editor exits, returns false if it cannot be accepted
+
+bool spellcheck_ignore_word(const char *word)
+{
+    return accept_word(word, false);
+}
@@ -0,0 +1,903 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <gtk/gtk.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "spellview.h"
+#include "spellworker.h"
+#include "debugmsg.h"
+#include "spellcheck.h"
+#include "trace.h"
+#include "allocstats.h"
+
+// time to wait after the last edit before running a spellcheck pass, so a burst of typing is checked once
+
+#define SPELLVIEW_DEBOUNCE_MS 120
+
+// once this many separate dirty ranges are pending they are collapsed, so the list stays cheap to maintain
+
+#define SPELLVIEW_MAX_RANGES 64
+
+// large ranges are cut into jobs of roughly this many characters, so an edit only supersedes a small piece
+
+#define SPELLVIEW_JOB_CHARS 16384
+
+// the background slices stop queueing work after this long, or once the worker has this many jobs waiting
+
+#define SPELLVIEW_SLICE_US 4000
+#define SPELLVIEW_QUEUE_DEPTH 4
+
+// worker priorities, text on screen is always checked before the rest of the document
+
+#define SPELLVIEW_PRIORITY_VISIBLE 0
+#define SPELLVIEW_PRIORITY_BACKGROUND 1
+
+// a half open range of character offsets in the buffer which needs rechecking
+
+typedef struct
+{
+    gint start;
+    gint end;
+} DirtyRange;
+
+static GtkTextView *spellView;
+static GtkTextBuffer *spellBuff;
+static GtkTextTag *spellTag;
+static GtkAdjustment *spellScroll;
+static GArray *dirty;
+static GQueue inflight = G_QUEUE_INIT;
+
+// the ranges the tag currently covers, sorted, apart and in buffer offsets. The set follows the tag through its
+// signals and through edits, so a recheck can tell which words actually changed and leave the rest alone.
+
+static GArray *tagged;
+
+// a change to the tag worked out from a job's results, collected before any is made since making them changes
+// the tagged set
+
+typedef struct
+{
+    gint start;
+    gint end;
+    gboolean apply;
+} TagFlip;
+
+static GArray *flips;
+
+// schedule_visible builds the new dirty list here and swaps the two, so neither is reallocated on each pass
+
+static GArray *spare;
+static guint passSource, sliceSource;
+static gulong insertHandler, deleteHandler, scrollHandler, applyHandler, removeHandler;
+
+// orders dirty ranges by their start offset
+
+static gint compare_ranges(gconstpointer a, gconstpointer b)
+{
+    const DirtyRange *ra = a;
+    const DirtyRange *rb = b;
+
+    return ra->start - rb->start;
+}
+
+// sorts the dirty list and merges any ranges which overlap or touch
+
+static void merge_ranges(void)
+{
+    guint i, out = 0;
+
+    if (dirty->len < 2)
+        return;
+
+    g_array_sort(dirty, compare_ranges);
+
+    for (i = 1; i < dirty->len; i++)
+    {
+        DirtyRange *last = &g_array_index(dirty, DirtyRange, out);
+        DirtyRange *cur = &g_array_index(dirty, DirtyRange, i);
+
+        if (cur->start <= last->end)
+        {
+            if (cur->end > last->end)
+                last->end = cur->end;
+        }
+        else
+        {
+            out++;
+            g_array_index(dirty, DirtyRange, out) = *cur;
+        }
+    }
+
+    g_array_set_size(dirty, out + 1);
+}
+
+// collapses every pending range into one covering range, used when the list grows too long
+
+static void collapse_ranges(void)
+{
+    DirtyRange all = g_array_index(dirty, DirtyRange, 0);
+    guint i;
+
+    for (i = 1; i < dirty->len; i++)
+    {
+        DirtyRange *cur = &g_array_index(dirty, DirtyRange, i);
+        all.start = MIN(all.start, cur->start);
+        all.end = MAX(all.end, cur->end);
+    }
+
+    g_array_set_size(dirty, 1);
+    g_array_index(dirty, DirtyRange, 0) = all;
+}
+
+// true for characters which separate chunks of text, the tokenizer never lets a word run across one
+
+static gboolean is_separator(gunichar c, gpointer data)
+{
+    return g_unichar_isspace(c) || c == 0xfffc;
+}
+
+// moves an iter forward to the next separator unless it is already on one
+
+static void forward_to_separator(GtkTextIter *iter)
+{
+    if (!gtk_text_iter_is_end(iter) && !is_separator(gtk_text_iter_get_char(iter), NULL))
+        gtk_text_iter_forward_find_char(iter, is_separator, NULL, NULL);
+}
+
+// widens a range out to the surrounding whitespace. This catches words split or joined by an edit and keeps
+// urls and e-mail addresses whole, so the tokenizer can recognise and skip them.
+
+static void expand_to_chunks(GtkTextIter *start, GtkTextIter *end)
+{
+    if (gtk_text_iter_backward_find_char(start, is_separator, NULL, NULL))
+        gtk_text_iter_forward_char(start);
+
+    forward_to_separator(end);
+}
+
+// snapshots the text between two iters and hands it to the worker thread
+
+static void submit_range(GtkTextIter *start, GtkTextIter *end, gint priority)
+{
+    SpellJob *job = spellworker_new_job();
+
+    // a slice keeps hidden text and child anchors, so offsets in the snapshot match buffer offsets
+
+    job->text = gtk_text_buffer_get_slice(spellBuff, start, end, TRUE);
+    job->start = gtk_text_buffer_create_mark(spellBuff, NULL, start, TRUE);
+    job->end = gtk_text_buffer_create_mark(spellBuff, NULL, end, FALSE);
+    job->priority = priority;
+
+    g_queue_push_head_link(&inflight, &job->link);
+    spellworker_submit(job);
+}
+
+// submits one job sized piece from the front of a range and returns the offset the next piece starts at. Pieces
+// end on whitespace so no word is split between jobs, and the separator a piece ends on goes with it. The next
+// piece then starts just after a separator and is not widened back over this one, which matters when a word
+// longer than a job ends right where the range starts.
+
+static gint submit_piece(gint from, gint to, gint priority)
+{
+    GtkTextIter start, end, cut;
+
+    gtk_text_buffer_get_iter_at_offset(spellBuff, &start, from);
+    gtk_text_buffer_get_iter_at_offset(spellBuff, &end, to);
+    expand_to_chunks(&start, &end);
+
+    cut = start;
+    gtk_text_iter_forward_chars(&cut, SPELLVIEW_JOB_CHARS);
+    if (gtk_text_iter_compare(&cut, &end) >= 0)
+        cut = end;
+    else
+    {
+        forward_to_separator(&cut);
+        if (gtk_text_iter_compare(&cut, &end) < 0)
+            gtk_text_iter_forward_char(&cut);
+    }
+
+    submit_range(&start, &cut, priority);
+
+    return MAX(gtk_text_iter_get_offset(&cut), from + 1);
+}
+
+// finds the range of offsets currently shown in the view
+
+static void visible_range(gint *from, gint *to)
+{
+    GdkRectangle rect;
+    GtkTextIter start, end;
+
+    gtk_text_view_get_visible_rect(spellView, &rect);
+    gtk_text_view_get_iter_at_location(spellView, &start, rect.x, rect.y);
+    gtk_text_view_get_iter_at_location(spellView, &end, rect.x + rect.width, rect.y + rect.height);
+    gtk_text_iter_forward_to_line_end(&end);
+
+    *from = gtk_text_iter_get_offset(&start);
+    *to = gtk_text_iter_get_offset(&end);
+}
+
+// takes the visible part out of every dirty range and sends it to the front of the worker queue
+
+static void schedule_visible(void)
+{
+    GArray *rest = spare;
+    gint vfrom, vto;
+    guint i;
+
+    g_array_set_size(rest, 0);
+    visible_range(&vfrom, &vto);
+
+    for (i = 0; i < dirty->len; i++)
+    {
+        DirtyRange range = g_array_index(dirty, DirtyRange, i);
+        gint from = MAX(range.start, vfrom);
+        gint to = MIN(range.end, vto);
+
+        if (from > to)
+        {
+            g_array_append_val(rest, range);
+            continue;
+        }
+
+        // whatever lies either side of the viewport stays dirty for the background slices
+
+        if (range.start < from)
+        {
+            DirtyRange left = { range.start, from };
+            g_array_append_val(rest, left);
+        }
+
+        if (to < range.end)
+        {
+            DirtyRange right = { to, range.end };
+            g_array_append_val(rest, right);
+        }
+
+        do
+            from = submit_piece(from, to, SPELLVIEW_PRIORITY_VISIBLE);
+        while (from < to);
+    }
+
+    spare = dirty;
+    dirty = rest;
+}
+
+// low priority idle callback which feeds the rest of the document to the worker a slice at a time. It keeps
+// only a few jobs queued, so whatever scrolls into view later can still overtake it, and stops once the
+// worker has enough, apply_results starts it again when results come back.
+
+static gboolean background_slice(gpointer data)
+{
+    TRACE_SCOPE(TRACE_DETAIL, "background_slice");
+    ALLOC_COUNT_SCOPE();
+
+    gint64 deadline = g_get_monotonic_time() + SPELLVIEW_SLICE_US;
+
+    while (dirty->len && spellworker_queued() < SPELLVIEW_QUEUE_DEPTH && g_get_monotonic_time() < deadline)
+    {
+        DirtyRange *range = &g_array_index(dirty, DirtyRange, 0);
+        gint cut = submit_piece(range->start, range->end, SPELLVIEW_PRIORITY_BACKGROUND);
+
+        if (cut >= range->end)
+            g_array_remove_index(dirty, 0);
+        else
+            range->start = cut;
+    }
+
+    if (dirty->len && spellworker_queued() < SPELLVIEW_QUEUE_DEPTH)
+        return G_SOURCE_CONTINUE;
+
+    sliceSource = 0;
+    return G_SOURCE_REMOVE;
+}
+
+// makes sure the background slices are running while anything is left to check
+
+static void start_slices(void)
+{
+    if (!sliceSource && dirty->len)
+        sliceSource = g_idle_add_full(G_PRIORITY_LOW, background_slice, NULL, NULL);
+}
+
+// runs once typing has settled, the visible part of what changed is checked first and the rest in the background
+
+static gboolean spellcheck_pass(gpointer data)
+{
+    TRACE_SCOPE(TRACE_SPAN, "spellcheck_pass");
+    ALLOC_COUNT_SCOPE();
+
+    passSource = 0;
+    merge_ranges();
+    if (spellView)
+        schedule_visible();
+    start_slices();
+
+    return G_SOURCE_REMOVE;
+}
+
+// runs a pass waiting on the debounce straight away
+
+void spellview_flush(void)
+{
+    if (!passSource)
+        return;
+
+    g_source_remove(passSource);
+    spellcheck_pass(NULL);
+}
+
+// true once every edit has been checked and the results are in the buffer
+
+gboolean spellview_idle(void)
+{
+    return !spellBuff || (!dirty->len && g_queue_is_empty(&inflight) && !passSource);
+}
+
+// bumps anything unchecked which has just scrolled into view to the front of the queue
+
+static void on_scroll(GtkAdjustment *adjustment, gpointer data)
+{
+    ALLOC_COUNT_SCOPE();
+
+    if (dirty->len)
+        schedule_visible();
+}
+
+// returns the index of the first tagged range ending after an offset
+
+static guint first_after(gint offset)
+{
+    guint lo = 0, hi = tagged->len;
+
+    while (lo < hi)
+    {
+        guint mid = lo + (hi - lo) / 2;
+
+        if (g_array_index(tagged, SpellSpan, mid).end <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// adds a range to the tagged set, joining it to any range it overlaps or touches as the tag itself does
+
+static void tagged_add(gint start, gint end)
+{
+    SpellSpan span = { start, end };
+    guint i, j;
+
+    if (start >= end)
+        return;
+
+    i = j = first_after(start - 1);
+    for (; j < tagged->len && g_array_index(tagged, SpellSpan, j).start <= end; j++)
+    {
+        SpellSpan *cur = &g_array_index(tagged, SpellSpan, j);
+
+        span.start = MIN(span.start, cur->start);
+        span.end = MAX(span.end, cur->end);
+    }
+
+    if (j > i)
+        g_array_remove_range(tagged, i, j - i);
+    g_array_insert_val(tagged, i, span);
+}
+
+// takes a range out of the tagged set, splitting a range it falls inside
+
+static void tagged_remove(gint start, gint end)
+{
+    guint i = first_after(start);
+
+    while (i < tagged->len && start < end)
+    {
+        SpellSpan *cur = &g_array_index(tagged, SpellSpan, i);
+
+        if (cur->start >= end)
+            break;
+
+        if (cur->start < start && cur->end > end)
+        {
+            SpellSpan right = { end, cur->end };
+
+            cur->end = start;
+            g_array_insert_val(tagged, i + 1, right);
+            break;
+        }
+
+        if (cur->start < start)
+        {
+            cur->end = start;
+            i++;
+        }
+        else if (cur->end > end)
+        {
+            cur->start = end;
+            break;
+        }
+        else
+            g_array_remove_index(tagged, i);
+    }
+}
+
+// moves the tagged ranges past inserted text. Text typed inside a tagged word takes the tag, and so can text
+// typed at its end, which is checked on the buffer rather than assumed.
+
+static void tagged_insert(const GtkTextIter *start, gint at, gint count)
+{
+    guint i;
+
+    for (i = first_after(at - 1); i < tagged->len; i++)
+    {
+        SpellSpan *cur = &g_array_index(tagged, SpellSpan, i);
+
+        if (cur->start >= at)
+        {
+            cur->start += count;
+            cur->end += count;
+        }
+        else if (cur->end > at || gtk_text_iter_has_tag(start, spellTag))
+            cur->end += count;
+    }
+}
+
+// moves the tagged ranges back over removed text and drops those removed with it. Ranges either side which
+// now meet are joined, as the tag joins them.
+
+static void tagged_delete(gint from, gint to)
+{
+    guint i = first_after(from);
+
+    while (i < tagged->len)
+    {
+        SpellSpan *cur = &g_array_index(tagged, SpellSpan, i);
+
+        cur->start = cur->start >= to ? cur->start - (to - from) : MIN(cur->start, from);
+        cur->end = cur->end >= to ? cur->end - (to - from) : MIN(cur->end, from);
+
+        if (cur->start >= cur->end)
+            g_array_remove_index(tagged, i);
+        else
+            i++;
+    }
+
+    i = first_after(from - 1);
+    if (i + 1 < tagged->len && g_array_index(tagged, SpellSpan, i).end == from
+        && g_array_index(tagged, SpellSpan, i + 1).start == from)
+    {
+        g_array_index(tagged, SpellSpan, i).end = g_array_index(tagged, SpellSpan, i + 1).end;
+        g_array_remove_index(tagged, i + 1);
+    }
+}
+
+// keep the tagged set in step with the tag, whoever applies or removes it, pasted text included
+
+static void on_apply_tag(GtkTextBuffer *buff, GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end, gpointer data)
+{
+    if (tag == spellTag)
+        tagged_add(gtk_text_iter_get_offset(start), gtk_text_iter_get_offset(end));
+}
+
+static void on_remove_tag(GtkTextBuffer *buff, GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end,
+                          gpointer data)
+{
+    if (tag == spellTag)
+        tagged_remove(gtk_text_iter_get_offset(start), gtk_text_iter_get_offset(end));
+}
+
+// adds a flip for each part of start to end which no span covers. The spans are sorted and moved by shift,
+// next is where the search picks up, as the ranges asked about come in order too.
+
+static void add_uncovered(gint start, gint end, const SpellSpan *spans, guint count, gint shift, guint *next,
+                          gboolean apply)
+{
+    guint i = *next;
+
+    while (i < count && spans[i].end + shift <= start)
+        i++;
+    *next = i;
+
+    for (; i < count && spans[i].start + shift < end; i++)
+    {
+        if (spans[i].start + shift > start)
+        {
+            TagFlip flip = { start, spans[i].start + shift, apply };
+            g_array_append_val(flips, flip);
+        }
+        start = MAX(start, spans[i].end + shift);
+    }
+
+    if (start < end)
+    {
+        TagFlip flip = { start, end, apply };
+        g_array_append_val(flips, flip);
+    }
+}
+
+// works out the changes a job's results make to the tag between two offsets. Whatever is tagged but no longer
+// misspelt is removed and whatever is newly misspelt is applied, words which stay as they were are not touched.
+
+static void compare_job(SpellJob *job, gint from, gint to)
+{
+    const SpellSpan *found = (const SpellSpan *) job->misspelt->data;
+    guint first = first_after(from);
+    guint i, next = 0;
+
+    for (i = first; i < tagged->len && g_array_index(tagged, SpellSpan, i).start < to; i++)
+    {
+        SpellSpan *cur = &g_array_index(tagged, SpellSpan, i);
+
+        add_uncovered(MAX(cur->start, from), MIN(cur->end, to), found, job->misspelt->len, from, &next, FALSE);
+    }
+
+    next = first;
+    for (i = 0; i < job->misspelt->len; i++)
+        add_uncovered(found[i].start + from, found[i].end + from, (const SpellSpan *) tagged->data, tagged->len, 0,
+                      &next, TRUE);
+}
+
+// makes the changes collected in flips. The tag is only touched where a word's status flipped, so a recheck
+// which finds nothing new makes no changes and nothing is laid out again.
+
+static void apply_flips(void)
+{
+    guint i;
+
+    for (i = 0; i < flips->len; i++)
+    {
+        TagFlip *flip = &g_array_index(flips, TagFlip, i);
+        GtkTextIter start, end;
+
+        gtk_text_buffer_get_iter_at_offset(spellBuff, &start, flip->start);
+        gtk_text_buffer_get_iter_at_offset(spellBuff, &end, flip->end);
+
+        if (flip->apply)
+            gtk_text_buffer_apply_tag(spellBuff, spellTag, &start, &end);
+        else
+            gtk_text_buffer_remove_tag(spellBuff, spellTag, &start, &end);
+    }
+
+    DEB("Spellcheck changed the tag on %u ranges\n", flips->len);
+}
+
+// releases the marks of a finished job along with the job itself
+
+static void drop_job(SpellJob *job)
+{
+    g_queue_unlink(&inflight, &job->link);
+    gtk_text_buffer_delete_mark(spellBuff, job->start);
+    gtk_text_buffer_delete_mark(spellBuff, job->end);
+    spellworker_free_job(job);
+}
+
+// applies every result waiting in one batch
+
+static void apply_jobs(void)
+{
+    ALLOC_COUNT_SCOPE();
+
+    SpellJob *job;
+
+    if (flips)
+        g_array_set_size(flips, 0);
+
+    while ((job = spellworker_pop_result()))
+    {
+        if (!job->cancelled && spellBuff)
+        {
+            GtkTextIter start, end;
+
+            gtk_text_buffer_get_iter_at_mark(spellBuff, &start, job->start);
+            gtk_text_buffer_get_iter_at_mark(spellBuff, &end, job->end);
+            compare_job(job, gtk_text_iter_get_offset(&start), gtk_text_iter_get_offset(&end));
+        }
+
+        if (spellBuff)
+            drop_job(job);
+        else
+            spellworker_free_job(job);
+    }
+
+    if (!spellBuff)
+        return;
+
+    apply_flips();
+
+    // the worker has room again, so keep feeding it the rest of the document
+
+    start_slices();
+}
+
+// called on the main loop when the worker has finished jobs. A pass is over once nothing is left dirty, queued
+// or waiting for the debounce.
+
+static gboolean apply_results(gpointer data)
+{
+    TRACE_SCOPE(TRACE_SPAN, "apply_results");
+
+    apply_jobs();
+
+    if (spellBuff && spellview_idle())
+        ALLOC_COUNT_REPORT("spellcheck pass");
+
+    return G_SOURCE_REMOVE;
+}
+
+// supersedes any job whose text overlaps an edit, its whole range is queued again for the next pass
+
+static void cancel_overlapping(gint from, gint to)
+{
+    GList *l;
+
+    for (l = inflight.head; l != NULL; l = l->next)
+    {
+        SpellJob *job = l->data;
+        GtkTextIter start, end;
+
+        if (job->cancelled)
+            continue;
+
+        gtk_text_buffer_get_iter_at_mark(spellBuff, &start, job->start);
+        gtk_text_buffer_get_iter_at_mark(spellBuff, &end, job->end);
+
+        if (from <= gtk_text_iter_get_offset(&end) && to >= gtk_text_iter_get_offset(&start))
+        {
+            spellworker_cancel(job);
+            spellview_mark_dirty(gtk_text_iter_get_offset(&start), gtk_text_iter_get_offset(&end));
+        }
+    }
+}
+
+// records a range as needing a recheck and (re)starts the debounce timer
+
+void spellview_mark_dirty(gint start, gint end)
+{
+    DirtyRange range = { start, end };
+
+    if (!dirty)
+        return;
+
+    g_array_append_val(dirty, range);
+
+    if (dirty->len > SPELLVIEW_MAX_RANGES)
+    {
+        merge_ranges();
+        if (dirty->len > SPELLVIEW_MAX_RANGES)
+            collapse_ranges();
+    }
+
+    if (passSource)
+        g_source_remove(passSource);
+    passSource = g_timeout_add(SPELLVIEW_DEBOUNCE_MS, spellcheck_pass, NULL);
+}
+
+// moves pending ranges to account for text inserted or removed before them
+
+static void shift_ranges(gint at, gint removed, gint inserted)
+{
+    guint i;
+
+    for (i = 0; i < dirty->len; i++)
+    {
+        DirtyRange *range = &g_array_index(dirty, DirtyRange, i);
+
+        if (range->start >= at + removed)
+            range->start += inserted - removed;
+        else if (range->start > at)
+            range->start = at;
+
+        if (range->end >= at + removed)
+            range->end += inserted - removed;
+        else if (range->end > at)
+            range->end = at;
+    }
+}
+
+// connected after the default handler, so location points to the end of the freshly inserted text
+
+static void on_insert_text(GtkTextBuffer *buff, GtkTextIter *location, gchar *text, gint len, gpointer data)
+{
+    TRACE_SCOPE(TRACE_DETAIL, "on_insert_text");
+
+    gint end = gtk_text_iter_get_offset(location);
+    gint count = g_utf8_strlen(text, len);
+    GtkTextIter start = *location;
+
+    gtk_text_iter_backward_chars(&start, count);
+    tagged_insert(&start, end - count, count);
+    shift_ranges(end - count, 0, count);
+    cancel_overlapping(end - count, end);
+    spellview_mark_dirty(end - count, end);
+}
+
+// connected before the default handler, so the range still describes the text about to be removed
+
+static void on_delete_range(GtkTextBuffer *buff, GtkTextIter *start, GtkTextIter *end, gpointer data)
+{
+    TRACE_SCOPE(TRACE_DETAIL, "on_delete_range");
+
+    gint from = gtk_text_iter_get_offset(start);
+    gint to = gtk_text_iter_get_offset(end);
+
+    cancel_overlapping(from, to);
+    tagged_delete(from, to);
+    shift_ranges(from, to - from, 0);
+    spellview_mark_dirty(from, from);
+}
+
+// called once the dictionary accepts a word. Only the tagged words are looked at: copies spelt exactly as the
+// word, or with a capital first letter, are accepted too and lose the tag straight away. Copies with other
+// capitals are up to hunspell, so just their ranges are rechecked.
+
+void spellview_accept_word(const gchar *word)
+{
+    glong chars = g_utf8_strlen(word, -1);
+    gchar *fold = g_utf8_casefold(word, -1);
+    guint i;
+
+    if (!spellBuff)
+    {
+        g_free(fold);
+        return;
+    }
+
+    g_array_set_size(flips, 0);
+
+    for (i = 0; i < tagged->len; i++)
+    {
+        SpellSpan *span = &g_array_index(tagged, SpellSpan, i);
+        GtkTextIter start, end;
+        gchar *text, *textFold;
+
+        if (span->end - span->start != chars)
+            continue;
+
+        gtk_text_buffer_get_iter_at_offset(spellBuff, &start, span->start);
+        gtk_text_buffer_get_iter_at_offset(spellBuff, &end, span->end);
+        text = gtk_text_iter_get_slice(&start, &end);
+
+        if (strcmp(text, word) == 0
+            || (text[0] >= 'A' && text[0] <= 'Z' && text[0] - 'A' + 'a' == word[0] && strcmp(text + 1, word + 1) == 0))
+        {
+            TagFlip flip = { span->start, span->end, FALSE };
+            g_array_append_val(flips, flip);
+
+            // a job already checked against the old dictionary would tag the word again
+
+            cancel_overlapping(span->start, span->end);
+        }
+        else
+        {
+            textFold = g_utf8_casefold(text, -1);
+            if (strcmp(textFold, fold) == 0)
+                spellview_mark_dirty(span->start, span->end);
+            g_free(textFold);
+        }
+
+        g_free(text);
+    }
+
+    g_free(fold);
+    apply_flips();
+}
+
+// fills the tagged set from wherever the tag already is in the buffer
+
+static void load_tagged(void)
+{
+    GtkTextIter iter;
+
+    g_array_set_size(tagged, 0);
+    gtk_text_buffer_get_start_iter(spellBuff, &iter);
+
+    if (!gtk_text_iter_starts_tag(&iter, spellTag))
+        gtk_text_iter_forward_to_tag_toggle(&iter, spellTag);
+
+    while (!gtk_text_iter_is_end(&iter))
+    {
+        gint start = gtk_text_iter_get_offset(&iter);
+
+        gtk_text_iter_forward_to_tag_toggle(&iter, spellTag);
+        tagged_add(start, gtk_text_iter_get_offset(&iter));
+        gtk_text_iter_forward_to_tag_toggle(&iter, spellTag);
+    }
+}
+
+// starts tracking edits to a buffer, the given tag is applied to misspelt words. Without a view everything is
+// checked by the background slices, as nothing is on screen to go first.
+
+static void attach(GtkTextBuffer *buff, GtkTextView *view, GtkTextTag *tag)
+{
+    GtkTextIter start, end;
+
+    spellView = view;
+    spellBuff = buff;
+    spellTag = tag;
+    dirty = g_array_new(FALSE, FALSE, sizeof(DirtyRange));
+    spare = g_array_new(FALSE, FALSE, sizeof(DirtyRange));
+    tagged = g_array_new(FALSE, FALSE, sizeof(SpellSpan));
+    flips = g_array_new(FALSE, FALSE, sizeof(TagFlip));
+    load_tagged();
+    spellworker_start(apply_results);
+
+    insertHandler = g_signal_connect_after(G_OBJECT(buff), "insert-text", G_CALLBACK(on_insert_text), NULL);
+    deleteHandler = g_signal_connect(G_OBJECT(buff), "delete-range", G_CALLBACK(on_delete_range), NULL);
+    applyHandler = g_signal_connect_after(G_OBJECT(buff), "apply-tag", G_CALLBACK(on_apply_tag), NULL);
+    removeHandler = g_signal_connect_after(G_OBJECT(buff), "remove-tag", G_CALLBACK(on_remove_tag), NULL);
+
+    spellScroll = view ? gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(view)) : NULL;
+    if (spellScroll)
+        scrollHandler = g_signal_connect(G_OBJECT(spellScroll), "value-changed", G_CALLBACK(on_scroll), NULL);
+
+    // anything already in the buffer has never been checked
+
+    gtk_text_buffer_get_bounds(buff, &start, &end);
+    if (!gtk_text_iter_equal(&start, &end))
+        spellview_mark_dirty(0, gtk_text_iter_get_offset(&end));
+}
+
+// starts tracking edits to the buffer shown in a view, the given tag is applied to misspelt words
+
+void spellview_attach(GtkTextView *view, GtkTextTag *tag)
+{
+    attach(gtk_text_view_get_buffer(view), view, tag);
+}
+
+// tracks a buffer which is not shown anywhere, as the benchmarks do
+
+void spellview_attach_buffer(GtkTextBuffer *buff, GtkTextTag *tag)
+{
+    attach(buff, NULL, tag);
+}
+
+// stops tracking edits, drops any pending pass and waits for the worker thread to exit
+
+void spellview_detach(void)
+{
+    SpellJob *job;
+
+    if (!spellBuff)
+        return;
+
+    if (passSource)
+        g_source_remove(passSource);
+    passSource = 0;
+
+    if (sliceSource)
+        g_source_remove(sliceSource);
+    sliceSource = 0;
+
+    if (spellScroll)
+        g_signal_handler_disconnect(spellScroll, scrollHandler);
+    spellScroll = NULL;
+
+    spellworker_stop();
+    while ((job = spellworker_pop_result()))
+        drop_job(job);
+
+    g_signal_handler_disconnect(spellBuff, insertHandler);
+    g_signal_handler_disconnect(spellBuff, deleteHandler);
+    g_signal_handler_disconnect(spellBuff, applyHandler);
+    g_signal_handler_disconnect(spellBuff, removeHandler);
+    g_array_free(dirty, TRUE);
+    g_array_free(spare, TRUE);
+    g_array_free(tagged, TRUE);
+    g_array_free(flips, TRUE);
+    dirty = NULL;
+    spare = NULL;
+    tagged = NULL;
+    flips = NULL;
+    spellView = NULL;
+    spellBuff = NULL;
+    spellTag = NULL;
+}
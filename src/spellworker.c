@@ -0,0 +1,262 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <gtk/gtk.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "spellworker.h"
+#include "debugmsg.h"
+#include "spellcheck.h"
+#include "trace.h"
+#include "allocstats.h"
+
+static GThread *worker;
+static GAsyncQueue *todo;
+static GAsyncQueue *done;
+static GSourceFunc readyFunc;
+static gint notifyPending;
+
+// empty jobs pushed onto the queue to tell the worker thread to exit, or that the dictionary has loaded
+
+static SpellJob stopJob;
+static SpellJob wakeJob;
+
+// jobs which arrived while the dictionary was still loading, only touched by the worker thread. The count is
+// read by the main thread, so the jobs held back still count as queued.
+
+static GQueue pending = G_QUEUE_INIT;
+static gint pendingJobs;
+
+// results of the last job, only touched by the worker thread and reused so the span array is allocated once
+
+static SpellcheckResult result;
+
+// jobs freed by the owner and waiting to be handed out again, only touched by the main thread
+
+static GQueue pool = G_QUEUE_INIT;
+
+// checks the job text in one batch and converts the byte spans found into character spans
+
+static void check_job(SpellJob *job)
+{
+    TRACE_SCOPE(TRACE_SPAN, "check_job");
+    ALLOC_COUNT_SCOPE();
+
+    const gchar *p = job->text;
+    gint chars = 0;
+    size_t i;
+
+    spellcheck_checkstring(job->text, strlen(job->text), &result);
+
+    for (i = 0; i < result.count; i++)
+    {
+        const gchar *word = job->text + result.spans[i].offset;
+        SpellSpan span;
+
+        // spans come back in order, so the character count only ever moves forward
+
+        chars += g_utf8_strlen(p, word - p);
+        span.start = chars;
+        span.end = chars + g_utf8_strlen(word, result.spans[i].length);
+        g_array_append_val(job->misspelt, span);
+
+        p = word;
+    }
+}
+
+// checks a job unless it has been superseded, then passes it back to the main loop
+
+static void finish_job(SpellJob *job)
+{
+    if (!g_atomic_int_get(&job->cancelled))
+        check_job(job);
+
+    g_async_queue_push(done, job);
+
+    // only one idle callback is queued at a time, it collects every finished job in one go
+
+    if (g_atomic_int_compare_and_exchange(&notifyPending, 0, 1))
+        g_idle_add(readyFunc, NULL);
+}
+
+// called once the dictionary has loaded, possibly on the loading thread, and wakes the worker
+
+static void dictionary_ready(void *data)
+{
+    g_async_queue_push_front(todo, &wakeJob);
+}
+
+// orders the queue so the job with the lowest priority value is popped first
+
+static gint compare_jobs(gconstpointer a, gconstpointer b, gpointer data)
+{
+    const SpellJob *ja = a;
+    const SpellJob *jb = b;
+
+    return ja->priority > jb->priority ? 1 : ja->priority == jb->priority ? 0 : -1;
+}
+
+// body of the worker thread, checks jobs until told to stop. Jobs are held back while the dictionary loads,
+// so text typed before then is still checked once it is ready. They go back on the queue in priority order
+// then, so text which has come into view since is still checked first.
+
+static gpointer worker_main(gpointer data)
+{
+    for (;;)
+    {
+        SpellJob *job = g_async_queue_pop(todo);
+
+        if (job == &stopJob)
+            break;
+
+        if (job == &wakeJob)
+        {
+            while ((job = g_queue_pop_head(&pending)))
+            {
+                g_async_queue_push_sorted(todo, job, compare_jobs, NULL);
+                g_atomic_int_add(&pendingJobs, -1);
+            }
+        }
+        else if (spellcheck_state() == SPELLCHECK_LOADING)
+        {
+            g_queue_push_tail(&pending, job);
+            g_atomic_int_inc(&pendingJobs);
+        }
+        else
+            finish_job(job);
+    }
+
+    return NULL;
+}
+
+// starts the worker thread, ready is invoked on the main loop whenever finished jobs are waiting
+
+void spellworker_start(GSourceFunc ready)
+{
+    if (worker)
+        return;
+
+    readyFunc = ready;
+    if (!todo)
+        todo = g_async_queue_new();
+    if (!done)
+        done = g_async_queue_new();
+    worker = g_thread_new("spellcheck", worker_main, NULL);
+    spellcheck_notify_ready(dictionary_ready, NULL);
+}
+
+// stops the worker thread, jobs which never ran are left on the result queue for the owner to free
+
+void spellworker_stop(void)
+{
+    SpellJob *job;
+
+    if (!worker)
+        return;
+
+    g_async_queue_push_front(todo, &stopJob);
+    g_thread_join(worker);
+    worker = NULL;
+
+    while ((job = g_queue_pop_head(&pending)))
+    {
+        job->cancelled = 1;
+        g_async_queue_push(done, job);
+    }
+    g_atomic_int_set(&pendingJobs, 0);
+
+    while ((job = g_async_queue_try_pop(todo)))
+    {
+        if (job == &wakeJob)
+            continue;
+
+        job->cancelled = 1;
+        g_async_queue_push(done, job);
+    }
+
+    // the queues are kept, as the dictionary loader may still wake a worker which has gone
+
+    spellcheck_result_free(&result);
+}
+
+// returns an empty job, reusing a freed one when there is one
+
+SpellJob *spellworker_new_job(void)
+{
+    GList *link = g_queue_pop_head_link(&pool);
+    SpellJob *job;
+
+    if (link)
+        return link->data;
+
+    job = g_new0(SpellJob, 1);
+    job->misspelt = g_array_new(FALSE, FALSE, sizeof(SpellSpan));
+    job->link.data = job;
+
+    return job;
+}
+
+// queues a job for the worker thread, ownership passes back through spellworker_pop_result
+
+void spellworker_submit(SpellJob *job)
+{
+    g_async_queue_push_sorted(todo, job, compare_jobs, NULL);
+}
+
+// returns the number of jobs waiting for the worker thread, including those held back for the dictionary
+
+guint spellworker_queued(void)
+{
+    gint len = todo ? g_async_queue_length(todo) : 0;
+
+    return MAX(len, 0) + g_atomic_int_get(&pendingJobs);
+}
+
+// marks a job as superseded, the worker skips it and its results must not be applied
+
+void spellworker_cancel(SpellJob *job)
+{
+    g_atomic_int_set(&job->cancelled, 1);
+}
+
+// takes the next finished job without blocking, returns NULL when none are waiting
+
+SpellJob *spellworker_pop_result(void)
+{
+    SpellJob *job = NULL;
+
+    if (done)
+    {
+        g_atomic_int_set(&notifyPending, 0);
+        job = g_async_queue_try_pop(done);
+    }
+
+    return job;
+}
+
+// frees a job once the owner has dealt with it. The struct and its span array go back to the pool, only the
+// text is released.
+
+void spellworker_free_job(SpellJob *job)
+{
+    g_clear_pointer(&job->text, g_free);
+
+    if (pool.length < SPELLWORKER_POOL_JOBS)
+    {
+        g_array_set_size(job->misspelt, 0);
+        job->start = NULL;
+        job->end = NULL;
+        job->priority = 0;
+        job->cancelled = 0;
+        g_queue_push_head_link(&pool, &job->link);
+        return;
+    }
+
+    g_array_free(job->misspelt, TRUE);
+    g_free(job);
+}
@@ -0,0 +1,247 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <stdbool.h>
+
+#include "styles.h"
+#include "debugmsg.h"
+
+// pending idle callback which removes unused indent tags
+
+static guint collectSource;
+
+// returns the pool level an indent tag belongs in, or 0 if it is not one the pool manages. Levels are
+// recognised by name, so indent tags loaded from files are taken into the pool too.
+
+static gint indent_level_of(GtkTextTag *tag)
+{
+    gchar *name = NULL;
+    gint level = 0, pixels;
+    char end;
+
+    g_object_get(tag, "name", &name, NULL);
+
+    if (name && sscanf(name, "indent%d%c", &pixels, &end) == 1 && pixels > 0 && pixels % STYLES_INDENT_STEP == 0
+        && pixels / STYLES_INDENT_STEP <= STYLES_INDENT_LEVELS)
+        level = pixels / STYLES_INDENT_STEP;
+
+    g_free(name);
+
+    return level;
+}
+
+// keeps the pool in step with tags added to the table behind its back, such as by a file load
+
+static void on_tag_added(GtkTextTagTable *table, GtkTextTag *tag, gpointer data)
+{
+    EditorContext *editor = data;
+    gint level = indent_level_of(tag);
+
+    if (level && !editor->indent[level])
+        editor->indent[level] = tag;
+}
+
+static void on_tag_removed(GtkTextTagTable *table, GtkTextTag *tag, gpointer data)
+{
+    EditorContext *editor = data;
+    gint level;
+
+    for (level = 1; level <= STYLES_INDENT_LEVELS; level++)
+        if (editor->indent[level] == tag)
+            editor->indent[level] = NULL;
+}
+
+// looks up the editor widgets and creates the fixed formatting tags
+
+void styles_init(EditorContext *editor, GtkBuilder *builder)
+{
+    memset(editor, 0, sizeof(*editor));
+
+    editor->window = GTK_WINDOW(gtk_builder_get_object(builder, "editorMain1"));
+    editor->view = GTK_TEXT_VIEW(gtk_builder_get_object(builder, "view0"));
+    editor->buff = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "buff0"));
+    editor->table = GTK_TEXT_TAG_TABLE(gtk_builder_get_object(builder, "tab0"));
+    editor->misspelt = gtk_text_tag_table_lookup(editor->table, "misspelt");
+
+    styles_create_tags(editor);
+}
+
+// creates the fixed formatting tags in the editor's buffer and starts tracking its indent tags. Split from
+// styles_init so a buffer without a window, as the benchmarks use, is formatted the same way.
+
+void styles_create_tags(EditorContext *editor)
+{
+    // set up text tag table with tag types
+
+    editor->bold = gtk_text_buffer_create_tag(editor->buff, "bold", "weight", 700, NULL);
+    editor->ital = gtk_text_buffer_create_tag(editor->buff, "ital", "style", PANGO_STYLE_ITALIC, NULL);
+    editor->uline = gtk_text_buffer_create_tag(editor->buff, "uline", "underline", PANGO_UNDERLINE_SINGLE, NULL);
+    editor->sthru = gtk_text_buffer_create_tag(editor->buff, "sthru", "strikethrough", true, NULL);
+
+    // set up text tags for justification, only one should be active on some text at a time
+
+    editor->ljust = gtk_text_buffer_create_tag(editor->buff, "ljust", "justification", GTK_JUSTIFY_LEFT, NULL);
+    editor->rjust = gtk_text_buffer_create_tag(editor->buff, "rjust", "justification", GTK_JUSTIFY_RIGHT, NULL);
+    editor->cjust = gtk_text_buffer_create_tag(editor->buff, "cjust", "justification", GTK_JUSTIFY_CENTER, NULL);
+    editor->fjust = gtk_text_buffer_create_tag(editor->buff, "fjust", "justification", GTK_JUSTIFY_FILL, NULL);
+
+    g_signal_connect(editor->table, "tag-added", G_CALLBACK(on_tag_added), editor);
+    g_signal_connect(editor->table, "tag-removed", G_CALLBACK(on_tag_removed), editor);
+}
+
+// returns the tag for an indent level, creating it on first use. Levels past the end of the pool get the
+// deepest indent, level 0 has no tag.
+
+GtkTextTag *styles_indent_tag(EditorContext *editor, gint level)
+{
+    gchar name[32];
+
+    if (level <= 0)
+        return NULL;
+
+    if (level > STYLES_INDENT_LEVELS)
+        level = STYLES_INDENT_LEVELS;
+
+    if (!editor->indent[level])
+    {
+        snprintf(name, sizeof(name), "indent%d", level * STYLES_INDENT_STEP);
+        editor->indent[level] = gtk_text_buffer_create_tag(editor->buff, name, "indent", level * STYLES_INDENT_STEP,
+                                                           NULL);
+    }
+
+    return editor->indent[level];
+}
+
+// returns the nearest pool level to any indent tag, deeper ones count as the deepest, or 0 if the tag does not
+// indent. Used for stray indent tags from files, whose names the pool does not recognise.
+
+static gint stray_level_of(GtkTextTag *tag)
+{
+    gchar *name = NULL;
+    gboolean indentSet = FALSE;
+    gint level = 0, pixels;
+    char end;
+
+    g_object_get(tag, "name", &name, "indent-set", &indentSet, NULL);
+
+    if (name && indentSet && sscanf(name, "indent%d%c", &pixels, &end) == 1 && pixels > 0)
+        level = CLAMP((pixels + STYLES_INDENT_STEP / 2) / STYLES_INDENT_STEP, 1, STYLES_INDENT_LEVELS);
+
+    g_free(name);
+
+    return level;
+}
+
+// returns the indent level applied at an iter, 0 if the text is not indented. An indent tag outside the pool
+// counts as the nearest level, so indenting text loaded with one moves on from where it is.
+
+gint styles_indent_level(EditorContext *editor, GtkTextIter *iter)
+{
+    GSList *tags, *l;
+    gint level;
+
+    for (level = STYLES_INDENT_LEVELS; level > 0; level--)
+        if (editor->indent[level] && gtk_text_iter_has_tag(iter, editor->indent[level]))
+            return level;
+
+    tags = gtk_text_iter_get_tags(iter);
+    for (l = tags; l; l = l->next)
+        level = MAX(level, stray_level_of(l->data));
+    g_slist_free(tags);
+
+    return level;
+}
+
+// removes every indent tag, from the pool or not, which is applied at start from the range, so the range
+// can be given a pool level in its place
+
+void styles_clear_indent(EditorContext *editor, GtkTextIter *start, GtkTextIter *end)
+{
+    GSList *tags = gtk_text_iter_get_tags(start), *l;
+
+    for (l = tags; l; l = l->next)
+    {
+        if (indent_level_of(l->data) || stray_level_of(l->data))
+            gtk_text_buffer_remove_tag(editor->buff, l->data, start, end);
+    }
+
+    g_slist_free(tags);
+}
+
+// true if a tag is applied anywhere in the buffer
+
+static bool tag_in_use(GtkTextBuffer *buff, GtkTextTag *tag)
+{
+    GtkTextIter iter;
+
+    gtk_text_buffer_get_start_iter(buff, &iter);
+
+    return gtk_text_iter_has_tag(&iter, tag) || gtk_text_iter_forward_to_tag_toggle(&iter, tag);
+}
+
+// the buffer a collection is looking at and the tags it has found to remove
+
+typedef struct
+{
+    GtkTextBuffer *buff;
+    GPtrArray *unused;
+} Collection;
+
+// collects unused indent tags outside the pool, such as odd levels loaded from files
+
+static void find_stray_indent(GtkTextTag *tag, gpointer data)
+{
+    Collection *collection = data;
+    gchar *name = NULL;
+    gboolean indentSet = FALSE;
+
+    g_object_get(tag, "name", &name, "indent-set", &indentSet, NULL);
+
+    if (name && indentSet && g_str_has_prefix(name, "indent") && !indent_level_of(tag)
+        && !tag_in_use(collection->buff, tag))
+        g_ptr_array_add(collection->unused, tag);
+
+    g_free(name);
+}
+
+// idle callback which removes indent tags no text uses any more, so the tag table and the work gtk does per
+// tag stay bounded however indenting is used
+
+static gboolean collect_indents(gpointer data)
+{
+    EditorContext *editor = data;
+    Collection collection = { editor->buff, g_ptr_array_new() };
+    gint level;
+    guint i;
+
+    collectSource = 0;
+
+    for (level = 1; level <= STYLES_INDENT_LEVELS; level++)
+        if (editor->indent[level] && !tag_in_use(editor->buff, editor->indent[level]))
+            g_ptr_array_add(collection.unused, editor->indent[level]);
+
+    gtk_text_tag_table_foreach(editor->table, find_stray_indent, &collection);
+
+    for (i = 0; i < collection.unused->len; i++)
+        gtk_text_tag_table_remove(editor->table, g_ptr_array_index(collection.unused, i));
+
+    DEB("Removed %u indent tags, %d left in table\n", collection.unused->len,
+        gtk_text_tag_table_get_size(editor->table));
+    g_ptr_array_unref(collection.unused);
+
+    return G_SOURCE_REMOVE;
+}
+
+// asks for unused indent tags to be removed once the editor is idle
+
+void styles_schedule_collect(EditorContext *editor)
+{
+    if (!collectSource)
+        collectSource = g_idle_add_full(G_PRIORITY_LOW, collect_indents, editor, NULL);
+}
@@ -0,0 +1,447 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gtk/gtk.h>
+
+#include "suggest.h"
+#include "spellcheck.h"
+#include "spellview.h"
+#include "debugmsg.h"
+#include "trace.h"
+
+// suggestions on their way from the suggestion thread to the main loop
+
+typedef struct
+{
+    gulong ticket;
+    gchar *list;
+} SuggestDelivery;
+
+static GtkTextView *suggestView;
+static GtkTextBuffer *suggestBuff;
+static GtkTextTag *suggestTag;
+static GtkAdjustment *suggestScroll;
+static gulong popupHandler, pressHandler, markHandler, applyHandler, scrollHandler;
+static guint prefetchSource;
+
+// the misspelt word the menu would offer suggestions for, which lies between the two marks. Its suggestions
+// are kept once known, until then the ticket of the request for them is.
+
+static GtkTextMark *wordStart, *wordEnd;
+static gchar *wordText;
+static gchar *wordList;
+static gulong wordTicket;
+
+// a menu still waiting for suggestions, and the item standing in for them meanwhile
+
+static GtkWidget *waitMenu, *waitItem;
+
+// forgets the word, withdrawing any request still out for it
+
+static void clear_word(void)
+{
+    spellcheck_suggest_cancel(wordTicket);
+    wordTicket = 0;
+    g_clear_pointer(&wordText, g_free);
+    g_clear_pointer(&wordList, free);
+}
+
+// finds the misspelt word an iter is inside or just after, returns FALSE if there is none
+
+static gboolean misspelt_word_at(const GtkTextIter *iter, GtkTextIter *start, GtkTextIter *end)
+{
+    *start = *iter;
+
+    if (!gtk_text_iter_has_tag(start, suggestTag))
+    {
+        if (!gtk_text_iter_ends_tag(start, suggestTag))
+            return FALSE;
+        gtk_text_iter_backward_char(start);
+    }
+
+    if (!gtk_text_iter_starts_tag(start, suggestTag))
+        gtk_text_iter_backward_to_tag_toggle(start, suggestTag);
+
+    *end = *start;
+    gtk_text_iter_forward_to_tag_toggle(end, suggestTag);
+
+    return TRUE;
+}
+
+// replaces the word with the suggestion chosen from the menu, undone in one step
+
+static void on_replace(GtkMenuItem *item, gpointer data)
+{
+    GtkTextIter start, end;
+
+    gtk_text_buffer_get_iter_at_mark(suggestBuff, &start, wordStart);
+    gtk_text_buffer_get_iter_at_mark(suggestBuff, &end, wordEnd);
+
+    gtk_text_buffer_begin_user_action(suggestBuff);
+    gtk_text_buffer_delete(suggestBuff, &start, &end);
+    gtk_text_buffer_insert(suggestBuff, &start, gtk_menu_item_get_label(item), -1);
+    gtk_text_buffer_end_user_action(suggestBuff);
+
+    clear_word();
+}
+
+// accepts the word everywhere it is tagged, saving it to the personal dictionary or only for this session
+
+static void accept_word(gboolean persist)
+{
+    if (!wordText)
+        return;
+
+    if (persist ? spellcheck_add_word(wordText) : spellcheck_ignore_word(wordText))
+        spellview_accept_word(wordText);
+
+    clear_word();
+}
+
+static void on_add(GtkMenuItem *item, gpointer data)
+{
+    accept_word(TRUE);
+}
+
+static void on_ignore(GtkMenuItem *item, gpointer data)
+{
+    accept_word(FALSE);
+}
+
+// adds an item to the top of a menu, a separator when there is no label
+
+static void prepend_item(GtkMenuShell *shell, const gchar *label, GCallback activate)
+{
+    GtkWidget *item = label ? gtk_menu_item_new_with_label(label) : gtk_separator_menu_item_new();
+
+    if (activate)
+        g_signal_connect(item, "activate", activate, NULL);
+    gtk_menu_shell_prepend(shell, item);
+    gtk_widget_show(item);
+}
+
+// puts the word's suggestions at the top of a menu, in place of the waiting item if there is one
+
+static void fill_menu(GtkMenuShell *shell)
+{
+    const gchar *p;
+    gint count = 0;
+
+    if (waitItem)
+        gtk_widget_destroy(waitItem);
+    waitItem = NULL;
+    waitMenu = NULL;
+
+    for (p = wordList; p && *p && count < SUGGEST_MENU_ITEMS; p += strlen(p) + 1)
+    {
+        GtkWidget *item = gtk_menu_item_new_with_label(p);
+
+        g_signal_connect(item, "activate", G_CALLBACK(on_replace), NULL);
+        gtk_menu_shell_insert(shell, item, count++);
+        gtk_widget_show(item);
+    }
+
+    if (!count)
+    {
+        GtkWidget *item = gtk_menu_item_new_with_label("(no suggestions)");
+
+        gtk_widget_set_sensitive(item, FALSE);
+        gtk_menu_shell_prepend(shell, item);
+        gtk_widget_show(item);
+    }
+}
+
+// takes suggestions arriving on the main loop, they are dropped unless they are for the current word
+
+static gboolean deliver(gpointer data)
+{
+    SuggestDelivery *delivery = data;
+
+    if (wordTicket && delivery->ticket == wordTicket)
+    {
+        wordTicket = 0;
+        wordList = delivery->list;
+
+        if (waitMenu)
+            fill_menu(GTK_MENU_SHELL(waitMenu));
+    }
+    else
+        free(delivery->list);
+
+    g_free(delivery);
+
+    return G_SOURCE_REMOVE;
+}
+
+// called on the suggestion thread, passes the suggestions over to the main loop
+
+static void on_suggested(unsigned long ticket, char *list, void *data)
+{
+    SuggestDelivery *delivery = g_new(SuggestDelivery, 1);
+
+    delivery->ticket = ticket;
+    delivery->list = list;
+    g_idle_add(deliver, delivery);
+}
+
+// makes the misspelt word between two iters the one suggestions are wanted for. They are asked for straight
+// away unless already known, so they are usually ready by the time a menu opens.
+
+static void choose_word(const GtkTextIter *start, const GtkTextIter *end)
+{
+    GtkTextIter at;
+    gchar *text = gtk_text_iter_get_text(start, end);
+
+    if (wordText)
+    {
+        gtk_text_buffer_get_iter_at_mark(suggestBuff, &at, wordStart);
+
+        if (gtk_text_iter_equal(&at, start) && strcmp(text, wordText) == 0)
+        {
+            g_free(text);
+            return;
+        }
+    }
+
+    clear_word();
+    wordText = text;
+    gtk_text_buffer_move_mark(suggestBuff, wordStart, start);
+    gtk_text_buffer_move_mark(suggestBuff, wordEnd, end);
+
+    wordList = spellcheck_suggest_cached(text);
+    if (!wordList)
+        wordTicket = spellcheck_suggest_async(text, on_suggested, NULL);
+}
+
+// follows the cursor. Suggestions are fetched for a misspelt word it lands on, and the request is withdrawn
+// once it moves off the word.
+
+static void on_mark_set(GtkTextBuffer *buff, GtkTextIter *location, GtkTextMark *mark, gpointer data)
+{
+    GtkTextIter start, end;
+
+    if (mark != gtk_text_buffer_get_insert(buff))
+        return;
+
+    if (wordText)
+    {
+        gtk_text_buffer_get_iter_at_mark(buff, &start, wordStart);
+        gtk_text_buffer_get_iter_at_mark(buff, &end, wordEnd);
+
+        if (gtk_text_iter_in_range(location, &start, &end) || gtk_text_iter_equal(location, &end))
+            return;
+    }
+
+    if (misspelt_word_at(location, &start, &end))
+        choose_word(&start, &end);
+    else
+        clear_word();
+}
+
+// a right click chooses the word under the pointer, which need not be where the cursor is
+
+static gboolean on_button_press(GtkWidget *widget, GdkEventButton *event, gpointer data)
+{
+    GtkTextIter iter, start, end;
+    gint x, y;
+
+    if (event->type != GDK_BUTTON_PRESS || event->button != GDK_BUTTON_SECONDARY
+        || event->window != gtk_text_view_get_window(suggestView, GTK_TEXT_WINDOW_TEXT))
+        return FALSE;
+
+    gtk_text_view_window_to_buffer_coords(suggestView, GTK_TEXT_WINDOW_TEXT, event->x, event->y, &x, &y);
+    gtk_text_view_get_iter_at_location(suggestView, &iter, x, y);
+
+    if (misspelt_word_at(&iter, &start, &end))
+        choose_word(&start, &end);
+    else
+        clear_word();
+
+    return FALSE;
+}
+
+static void on_menu_destroy(GtkWidget *menu, gpointer data)
+{
+    if (menu == waitMenu)
+    {
+        waitMenu = NULL;
+        waitItem = NULL;
+    }
+}
+
+// adds the suggestions to the view's context menu, with items to accept the word. If the suggestions are still
+// being worked out the menu says so and they are added as soon as they arrive, the menu never waits for them.
+
+static void on_populate_popup(GtkTextView *view, GtkWidget *popup, gpointer data)
+{
+    TRACE_SCOPE(TRACE_SPAN, "suggest_popup");
+
+    GtkTextIter start, end;
+    gchar *text;
+
+    if (!GTK_IS_MENU(popup) || !wordText || !gtk_text_view_get_editable(view))
+        return;
+
+    // the word may have been edited or corrected since it was chosen
+
+    gtk_text_buffer_get_iter_at_mark(suggestBuff, &start, wordStart);
+    gtk_text_buffer_get_iter_at_mark(suggestBuff, &end, wordEnd);
+    text = gtk_text_iter_get_text(&start, &end);
+
+    if (strcmp(text, wordText) != 0 || !gtk_text_iter_has_tag(&start, suggestTag))
+    {
+        g_free(text);
+        clear_word();
+        return;
+    }
+
+    g_free(text);
+
+    prepend_item(GTK_MENU_SHELL(popup), NULL, NULL);
+    prepend_item(GTK_MENU_SHELL(popup), "Ignore all", G_CALLBACK(on_ignore));
+    prepend_item(GTK_MENU_SHELL(popup), "Add to dictionary", G_CALLBACK(on_add));
+    prepend_item(GTK_MENU_SHELL(popup), NULL, NULL);
+
+    if (!wordTicket)
+    {
+        fill_menu(GTK_MENU_SHELL(popup));
+        return;
+    }
+
+    waitMenu = popup;
+    waitItem = gtk_menu_item_new_with_label("Finding suggestions...");
+    gtk_widget_set_sensitive(waitItem, FALSE);
+    gtk_menu_shell_prepend(GTK_MENU_SHELL(popup), waitItem);
+    gtk_widget_show(waitItem);
+    g_signal_connect(popup, "destroy", G_CALLBACK(on_menu_destroy), NULL);
+}
+
+// queues the misspelt words on screen for the suggestion thread, behind anything actually asked for
+
+static gboolean prefetch_visible(gpointer data)
+{
+    TRACE_SCOPE(TRACE_SPAN, "prefetch_visible");
+
+    GdkRectangle rect;
+    GtkTextIter iter, end, wend;
+    guint queued = 0;
+
+    prefetchSource = 0;
+
+    gtk_text_view_get_visible_rect(suggestView, &rect);
+    gtk_text_view_get_iter_at_location(suggestView, &iter, rect.x, rect.y);
+    gtk_text_view_get_iter_at_location(suggestView, &end, rect.x + rect.width, rect.y + rect.height);
+    gtk_text_iter_forward_to_line_end(&end);
+
+    if (!gtk_text_iter_has_tag(&iter, suggestTag))
+        gtk_text_iter_forward_to_tag_toggle(&iter, suggestTag);
+    else if (!gtk_text_iter_starts_tag(&iter, suggestTag))
+        gtk_text_iter_backward_to_tag_toggle(&iter, suggestTag);
+
+    while (queued < SUGGEST_PREFETCH_WORDS && gtk_text_iter_compare(&iter, &end) < 0)
+    {
+        gchar *text;
+
+        wend = iter;
+        gtk_text_iter_forward_to_tag_toggle(&wend, suggestTag);
+
+        text = gtk_text_iter_get_text(&iter, &wend);
+        if (spellcheck_suggest_async(text, NULL, NULL))
+            queued++;
+        g_free(text);
+
+        iter = wend;
+        gtk_text_iter_forward_to_tag_toggle(&iter, suggestTag);
+    }
+
+    DEB("Prefetching suggestions for %u words\n", queued);
+
+    return G_SOURCE_REMOVE;
+}
+
+// waits for the view to settle before prefetching, so scrolling and typing are left alone
+
+static void schedule_prefetch(void)
+{
+    if (prefetchSource)
+        g_source_remove(prefetchSource);
+    prefetchSource = g_timeout_add_full(G_PRIORITY_LOW, SUGGEST_PREFETCH_MS, prefetch_visible, NULL, NULL);
+}
+
+static void on_scroll(GtkAdjustment *adjustment, gpointer data)
+{
+    schedule_prefetch();
+}
+
+// new misspellings may have appeared on screen
+
+static void on_apply_tag(GtkTextBuffer *buff, GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end, gpointer data)
+{
+    if (tag == suggestTag)
+        schedule_prefetch();
+}
+
+// offers suggestions for words carrying the given tag in the view's context menu
+
+void suggest_attach(GtkTextView *view, GtkTextTag *tag)
+{
+    GtkTextIter start;
+
+    suggestView = view;
+    suggestBuff = gtk_text_view_get_buffer(view);
+    suggestTag = tag;
+
+    gtk_text_buffer_get_start_iter(suggestBuff, &start);
+    wordStart = gtk_text_buffer_create_mark(suggestBuff, NULL, &start, TRUE);
+    wordEnd = gtk_text_buffer_create_mark(suggestBuff, NULL, &start, FALSE);
+
+    popupHandler = g_signal_connect(view, "populate-popup", G_CALLBACK(on_populate_popup), NULL);
+    pressHandler = g_signal_connect(view, "button-press-event", G_CALLBACK(on_button_press), NULL);
+    markHandler = g_signal_connect(suggestBuff, "mark-set", G_CALLBACK(on_mark_set), NULL);
+    applyHandler = g_signal_connect_after(suggestBuff, "apply-tag", G_CALLBACK(on_apply_tag), NULL);
+
+    suggestScroll = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(view));
+    if (suggestScroll)
+        scrollHandler = g_signal_connect(suggestScroll, "value-changed", G_CALLBACK(on_scroll), NULL);
+}
+
+// removes the suggestions from the menu and withdraws any request still waiting
+
+void suggest_detach(void)
+{
+    if (!suggestBuff)
+        return;
+
+    if (prefetchSource)
+        g_source_remove(prefetchSource);
+    prefetchSource = 0;
+
+    if (suggestScroll)
+        g_signal_handler_disconnect(suggestScroll, scrollHandler);
+    suggestScroll = NULL;
+
+    // the view may already have been destroyed, taking its handlers with it
+
+    if (g_signal_handler_is_connected(suggestView, popupHandler))
+        g_signal_handler_disconnect(suggestView, popupHandler);
+    if (g_signal_handler_is_connected(suggestView, pressHandler))
+        g_signal_handler_disconnect(suggestView, pressHandler);
+    g_signal_handler_disconnect(suggestBuff, markHandler);
+    g_signal_handler_disconnect(suggestBuff, applyHandler);
+
+    clear_word();
+    gtk_text_buffer_delete_mark(suggestBuff, wordStart);
+    gtk_text_buffer_delete_mark(suggestBuff, wordEnd);
+
+    waitMenu = NULL;
+    waitItem = NULL;
+    suggestView = NULL;
+    suggestBuff = NULL;
+    suggestTag = NULL;
+}
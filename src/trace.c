@@ -0,0 +1,221 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#if TRACE_LEVEL > TRACE_OFF
+
+// one recorded event. Complete spans carry their duration, async begins and ends the id pairing them.
+
+typedef struct
+{
+    const char *name;
+    uint64_t start;
+    uint64_t duration;
+    const void *id;
+    char phase;
+} TraceEvent;
+
+// the events of one thread. Only that thread writes to it, head counts every event it has written and is
+// published after each one, so a dump reads the ring without taking a lock. Rings are never freed, a thread
+// which has exited still has its events dumped.
+
+typedef struct TraceRing
+{
+    struct TraceRing *next;
+    long tid;
+    char thread[16];
+    uint64_t head;
+    TraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+static TraceRing *rings;
+static __thread TraceRing *threadRing;
+static char *tracePath;
+static uint64_t traceEpoch;
+
+// returns nanoseconds on the monotonic clock
+
+uint64_t trace_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// returns the calling thread's ring, adding one to the list the first time a thread records an event
+
+static TraceRing *thread_ring(void)
+{
+    TraceRing *ring = threadRing;
+
+    if (ring)
+        return ring;
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+
+    ring->tid = syscall(SYS_gettid);
+    pthread_getname_np(pthread_self(), ring->thread, sizeof(ring->thread));
+
+    ring->next = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+
+    threadRing = ring;
+
+    return ring;
+}
+
+// writes an event into the calling thread's ring
+
+static void record(const char *name, char phase, uint64_t start, uint64_t duration, const void *id)
+{
+    TraceRing *ring = thread_ring();
+    TraceEvent *event;
+    uint64_t head;
+
+    if (!ring)
+        return;
+
+    head = ring->head;
+    event = &ring->events[head % TRACE_RING_EVENTS];
+    event->name = name;
+    event->phase = phase;
+    event->start = start;
+    event->duration = duration;
+    event->id = id;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// records a span which began at start and ends now
+
+void trace_complete(const char *name, uint64_t start)
+{
+    record(name, 'X', start, trace_now() - start, NULL);
+}
+
+// records a point in time
+
+void trace_instant(const char *name)
+{
+    record(name, 'i', trace_now(), 0, NULL);
+}
+
+// records the begin or end of a span which crosses callbacks or threads
+
+void trace_async(const char *name, char phase, const void *id)
+{
+    record(name, phase, trace_now(), 0, id);
+}
+
+// cleanup handler of TRACE_SCOPE
+
+void trace_scope_end(TraceScope *scope)
+{
+    trace_complete(scope->name, scope->start);
+}
+
+// writes a json string, names are literals from the source so only quotes and backslashes need escaping
+
+static void write_string(FILE *out, const char *text)
+{
+    fputc('"', out);
+    for (; *text; text++)
+    {
+        if (*text == '"' || *text == '\\')
+            fputc('\\', out);
+        fputc(*text, out);
+    }
+    fputc('"', out);
+}
+
+// writes every thread's events as chrome trace event json, which chrome://tracing and perfetto load. Events
+// a thread writes while the dump runs may be missed. A NULL path dumps to the file given to trace_init.
+
+int trace_dump(const char *path)
+{
+    TraceRing *ring;
+    FILE *out;
+    int pid = getpid();
+    int first = 1;
+
+    if (!path)
+        path = tracePath;
+    if (!path || !(out = fopen(path, "w")))
+        return -1;
+
+    fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", out);
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+    {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t i = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+        fprintf(out, "%s\n{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, \"tid\": %ld, "
+                "\"args\": {\"name\": ", first ? "" : ",", pid, ring->tid);
+        write_string(out, ring->thread[0] ? ring->thread : "thread");
+        fputs("}}", out);
+        first = 0;
+
+        for (; i < head; i++)
+        {
+            TraceEvent *event = &ring->events[i % TRACE_RING_EVENTS];
+
+            fputs(",\n{\"name\": ", out);
+            write_string(out, event->name);
+            fprintf(out, ", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %ld", event->phase,
+                    (event->start - traceEpoch) / 1000.0, pid, ring->tid);
+
+            if (event->phase == 'X')
+                fprintf(out, ", \"dur\": %.3f", event->duration / 1000.0);
+            else if (event->phase == 'i')
+                fputs(", \"s\": \"t\"", out);
+            else
+                fprintf(out, ", \"cat\": \"async\", \"id\": \"%p\"", event->id);
+
+            fputc('}', out);
+        }
+    }
+
+    fputs("\n]}\n", out);
+
+    return fclose(out);
+}
+
+// dumps the trace as the process exits
+
+static void dump_at_exit(void)
+{
+    if (trace_dump(NULL) == 0)
+        fprintf(stderr, "Trace written to %s\n", tracePath);
+}
+
+// starts tracing, timestamps count from now and the trace is written to path on exit and by TRACE_DUMP(NULL)
+
+void trace_init(const char *path)
+{
+    traceEpoch = trace_now();
+    tracePath = strdup(path);
+    atexit(dump_at_exit);
+}
+
+#endif // TRACE_LEVEL > TRACE_OFF
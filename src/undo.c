@@ -0,0 +1,894 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <stdbool.h>
+
+#include "undo.h"
+#include "fileio.h"
+#include "images.h"
+#include "debugmsg.h"
+#include "trace.h"
+
+// The history is a ring of fixed size deltas and a ring of payload bytes, both allocated once. A delta is
+// one change to the buffer and an undo step is a run of deltas starting with one marked as a group. Deltas
+// and their payloads are added in the same order, so dropping the oldest step frees the oldest payload
+// bytes too. Positions in both rings are sequence numbers which only ever grow, the slot is the position
+// modulo the ring size.
+
+// a quarter of the memory goes to the delta ring, the rest to payloads
+
+#define UNDO_DELTA_SHARE 4
+
+// keystrokes further apart than this start a new undo step
+
+#define UNDO_COALESCE_US 1000000
+
+// the character an image anchor stands for in the text of the buffer
+
+#define UNDO_OBJECT_CHAR "\xef\xbf\xbc"
+
+enum
+{
+    UNDO_INSERT = 1,
+    UNDO_DELETE,
+    UNDO_APPLY_TAG,
+    UNDO_REMOVE_TAG
+};
+
+// Offsets and lengths are in characters. Inserts carry their text. Deletes carry the text removed and the
+// tag runs it had, relative to offset, so undo brings the formatting back too. Tag changes carry only the
+// runs whose state actually changed, so undo does not disturb formatting which was already there. Both
+// inserts and deletes carry the images in their text, so an image comes back as itself and not as its
+// placeholder.
+
+typedef struct
+{
+    guint8 type;
+    guint8 group;
+    guint16 images;
+    guint32 offset;
+    guint32 length;
+    guint32 runs;
+    guint32 textSize;
+    guint32 size;
+    guint64 payload;
+} UndoDelta;
+
+// runs follow the text in a payload. They hold a reference on their tag, so a tag removed from the table
+// since, such as an unused indent level, can be put back.
+
+typedef struct
+{
+    guint32 start;
+    guint32 end;
+    GtkTextTag *tag;
+} UndoRun;
+
+// images follow the runs. Each holds its data by reference, so it can be placed again after its last
+// placement has gone from the store. An image without a hash was still being encoded after a paste when it
+// was recorded, and comes back as a placeholder.
+
+typedef struct
+{
+    guint32 offset;
+    gint32 width;
+    gint32 height;
+    gchar *hash;
+    GBytes *data;
+} UndoImage;
+
+static GtkTextBuffer *undoBuff;
+static gulong handlers[7];
+
+static UndoDelta *deltas;
+static guint64 deltaCap;
+static guint64 first, applied, last;
+
+static guint8 *arena;
+static guint64 arenaCap;
+static guint64 arenaHead;
+
+// replaying is set while undo or redo change the buffer, newGroup once a user action has begun and its
+// first delta is not yet recorded
+
+static gboolean replaying, newGroup;
+static gint actionDepth;
+static gint64 lastEditTime;
+static guint64 evicted;
+
+static UndoDelta *delta_at(guint64 seq)
+{
+    return &deltas[seq % deltaCap];
+}
+
+// the oldest payload byte still in use
+
+static guint64 arena_tail(void)
+{
+    return first < last ? delta_at(first)->payload : arenaHead;
+}
+
+// copies payload bytes out of the arena
+
+static void read_payload(const UndoDelta *delta, gsize at, void *out, gsize len)
+{
+    memcpy(out, arena + (delta->payload % arenaCap) + at, len);
+}
+
+static void read_run(const UndoDelta *delta, guint index, UndoRun *run)
+{
+    read_payload(delta, delta->textSize + index * sizeof(UndoRun), run, sizeof(UndoRun));
+}
+
+static gsize image_pos(const UndoDelta *delta, guint index)
+{
+    return delta->textSize + delta->runs * sizeof(UndoRun) + index * sizeof(UndoImage);
+}
+
+static void read_image(const UndoDelta *delta, guint index, UndoImage *image)
+{
+    read_payload(delta, image_pos(delta, index), image, sizeof(UndoImage));
+}
+
+static void clear_image(UndoImage *image)
+{
+    g_free(image->hash);
+    if (image->data)
+        g_bytes_unref(image->data);
+}
+
+// releases what a delta holds on to
+
+static void drop_delta(UndoDelta *delta)
+{
+    guint i;
+
+    for (i = 0; i < delta->runs; i++)
+    {
+        UndoRun run;
+
+        read_run(delta, i, &run);
+        g_object_unref(run.tag);
+    }
+
+    for (i = 0; i < delta->images; i++)
+    {
+        UndoImage image;
+
+        read_image(delta, i, &image);
+        clear_image(&image);
+    }
+}
+
+// drops the oldest undo step
+
+static void evict_step(void)
+{
+    do
+    {
+        drop_delta(delta_at(first++));
+    } while (first < last && !delta_at(first)->group);
+
+    evicted++;
+
+    if (applied < first)
+        applied = first;
+}
+
+// drops everything which could be redone, called when a new change makes it unreachable
+
+static void truncate_redo(void)
+{
+    while (last > applied)
+        drop_delta(delta_at(--last));
+
+    arenaHead = last > first ? delta_at(last - 1)->payload + delta_at(last - 1)->size : arena_tail();
+}
+
+// makes room for a payload, dropping the oldest steps if the arena is full. A payload never wraps around
+// the end of the arena, the bytes skipped are freed with the step before. Returns the position or
+// G_MAXUINT64 if the payload is bigger than the whole arena.
+
+static guint64 reserve_payload(gsize size)
+{
+    guint64 pos = arenaHead;
+
+    if (size > arenaCap)
+        return G_MAXUINT64;
+
+    if (pos % arenaCap + size > arenaCap)
+        pos += arenaCap - pos % arenaCap;
+
+    while (first < last && pos + size - arena_tail() > arenaCap)
+        evict_step();
+
+    // with nothing left the skipped bytes need not be kept either
+
+    if (first == last)
+        arenaHead = pos;
+
+    return pos;
+}
+
+// adds a delta with room for its payload, returning NULL if it cannot be recorded. Anything which could be
+// redone is dropped first.
+
+static UndoDelta *add_delta(guint8 type, guint32 offset, guint32 length, gsize textSize, guint runs,
+                            guint images, gboolean group)
+{
+    gsize size = textSize + runs * sizeof(UndoRun) + images * sizeof(UndoImage);
+    UndoDelta *delta;
+    guint64 pos;
+
+    truncate_redo();
+
+    pos = reserve_payload(size);
+    if (pos == G_MAXUINT64)
+    {
+        // a change too large to keep makes the steps before it meaningless as well
+
+        undo_clear();
+        return NULL;
+    }
+
+    while (last - first >= deltaCap)
+        evict_step();
+
+    delta = delta_at(last++);
+    applied = last;
+
+    delta->type = type;
+    delta->group = group || newGroup || first == last - 1;
+    delta->images = images;
+    delta->offset = offset;
+    delta->length = length;
+    delta->runs = runs;
+    delta->textSize = textSize;
+    delta->size = size;
+    delta->payload = pos;
+
+    arenaHead = pos + size;
+    newGroup = FALSE;
+
+    return delta;
+}
+
+static void write_payload(UndoDelta *delta, gsize at, const void *data, gsize len)
+{
+    memcpy(arena + (delta->payload % arenaCap) + at, data, len);
+}
+
+static void write_run(UndoDelta *delta, guint index, guint32 start, guint32 end, GtkTextTag *tag)
+{
+    UndoRun run = { start, end, g_object_ref(tag) };
+
+    write_payload(delta, delta->textSize + index * sizeof(UndoRun), &run, sizeof(run));
+}
+
+// stores an image in a delta, taking its own references
+
+static void write_image(UndoDelta *delta, guint index, const UndoImage *image)
+{
+    UndoImage copy = *image;
+
+    copy.hash = g_strdup(image->hash);
+    if (copy.data)
+        g_bytes_ref(copy.data);
+
+    write_payload(delta, image_pos(delta, index), &copy, sizeof(copy));
+}
+
+// fills in an image from the one shown at an anchor, leaving it a placeholder if there is nothing to keep
+
+static void find_image(GtkTextIter *iter, UndoImage *image)
+{
+    GtkTextChildAnchor *anchor = gtk_text_iter_get_child_anchor(iter);
+    FileioImage found;
+
+    image->hash = NULL;
+    image->data = NULL;
+
+    if (anchor && images_find(anchor, &found))
+    {
+        image->width = found.width;
+        image->height = found.height;
+        image->hash = found.hash;
+        image->data = found.data;
+    }
+}
+
+// true when an edit should be added to the history
+
+static gboolean recording(void)
+{
+    return !replaying && !fileio_inserting();
+}
+
+// true if an edit follows the one before it quickly enough to be part of the same burst of typing
+
+static gboolean in_burst(void)
+{
+    gint64 now = g_get_monotonic_time();
+    gboolean quick = now - lastEditTime < UNDO_COALESCE_US;
+
+    lastEditTime = now;
+
+    return quick;
+}
+
+// tries to add typed text to the insert recorded just before it, so a burst of typing is one step and one
+// delta. Typing carries on a word, a space followed by more text starts a new step.
+
+static gboolean coalesce_insert(guint32 offset, const gchar *text, gint len, guint32 chars)
+{
+    UndoDelta *delta = last > first ? delta_at(last - 1) : NULL;
+    gboolean quick = in_burst();
+    gchar prev;
+
+    if (!delta || applied != last || delta->type != UNDO_INSERT || delta->offset + delta->length != offset || !quick
+        || chars != 1 || text[0] == '\n' || delta->images)
+        return FALSE;
+
+    read_payload(delta, delta->textSize - 1, &prev, 1);
+    if (g_ascii_isspace(prev) && !g_ascii_isspace(text[0]))
+        return FALSE;
+
+    // the payload can only grow in place if nothing follows it and it does not reach the end of the arena
+
+    if (delta->payload + delta->size != arenaHead || delta->payload % arenaCap + delta->size + len > arenaCap
+        || arenaHead + len - arena_tail() > arenaCap)
+    {
+        UndoDelta *next;
+
+        newGroup = FALSE;
+        next = add_delta(UNDO_INSERT, offset, chars, len, 0, 0, FALSE);
+        if (next)
+            write_payload(next, 0, text, len);
+
+        return TRUE;
+    }
+
+    write_payload(delta, delta->textSize, text, len);
+    delta->textSize += len;
+    delta->size += len;
+    delta->length += chars;
+    arenaHead += len;
+
+    return TRUE;
+}
+
+static void on_insert_text(GtkTextBuffer *buff, GtkTextIter *location, gchar *text, gint len, gpointer data)
+{
+    guint32 offset = gtk_text_iter_get_offset(location);
+    guint32 chars = g_utf8_strlen(text, len);
+    UndoDelta *delta;
+
+    if (!recording() || !len)
+        return;
+
+    if (coalesce_insert(offset, text, len, chars))
+    {
+        newGroup = FALSE;
+        return;
+    }
+
+    delta = add_delta(UNDO_INSERT, offset, chars, len, 0, 0, actionDepth == 0);
+    if (delta)
+        write_payload(delta, 0, text, len);
+}
+
+// collects the runs of each saved tag inside a range, as offsets relative to its start
+
+static GArray *collect_runs(GtkTextIter *start, GtkTextIter *end)
+{
+    GArray *runs = g_array_new(FALSE, FALSE, sizeof(UndoRun));
+    GtkTextIter iter = *start;
+    gint base = gtk_text_iter_get_offset(start);
+
+    while (gtk_text_iter_compare(&iter, end) < 0)
+    {
+        GSList *tags = gtk_text_iter_get_tags(&iter), *l;
+        GtkTextIter next = iter;
+
+        if (!gtk_text_iter_forward_to_tag_toggle(&next, NULL) || gtk_text_iter_compare(&next, end) > 0)
+            next = *end;
+
+        for (l = tags; l; l = l->next)
+        {
+            UndoRun run = { gtk_text_iter_get_offset(&iter) - base, gtk_text_iter_get_offset(&next) - base, l->data };
+
+            if (!fileio_tag_excluded(run.tag))
+                g_array_append_val(runs, run);
+        }
+
+        g_slist_free(tags);
+        iter = next;
+    }
+
+    return runs;
+}
+
+// true if a single character delete carries on from the one before it, by backspacing or deleting forwards,
+// so a burst of either is undone as one step
+
+static gboolean continues_delete(guint32 offset, guint32 length)
+{
+    UndoDelta *delta = last > first ? delta_at(last - 1) : NULL;
+    gboolean quick = in_burst();
+
+    return delta && quick && applied == last && length == 1 && delta->type == UNDO_DELETE && delta->length == 1
+           && (offset + 1 == delta->offset || offset == delta->offset);
+}
+
+// collects the images in the text of a range, as offsets relative to its start. Only the placeholders need
+// looking at, each found by searching the text already copied out. Images past the most a delta can count
+// come back as placeholders.
+
+static GArray *collect_images(GtkTextBuffer *buff, const gchar *text, guint32 base)
+{
+    GArray *images = g_array_new(FALSE, FALSE, sizeof(UndoImage));
+    const gchar *from = text, *hit;
+    guint32 offset = 0;
+
+    while (images->len < G_MAXUINT16 && (hit = strstr(from, UNDO_OBJECT_CHAR)))
+    {
+        UndoImage image = { 0 };
+        GtkTextIter iter;
+
+        offset += g_utf8_pointer_to_offset(from, hit);
+        gtk_text_buffer_get_iter_at_offset(buff, &iter, base + offset);
+        find_image(&iter, &image);
+
+        if (image.hash)
+        {
+            image.offset = offset;
+            g_array_append_val(images, image);
+        }
+
+        from = hit + strlen(UNDO_OBJECT_CHAR);
+        offset++;
+    }
+
+    return images;
+}
+
+// an image anchor counts as one character, so it is kept as an insert of U+FFFC for the offsets of the
+// deltas after it to hold. The image itself is not known yet, a paste is still to be encoded and a placed
+// image is given its data after the anchor, so it is recorded when undo takes it out again.
+
+static void on_insert_child_anchor(GtkTextBuffer *buff, GtkTextIter *location, GtkTextChildAnchor *anchor,
+                                   gpointer data)
+{
+    UndoImage image = { 0 };
+    UndoDelta *delta;
+
+    if (!recording())
+        return;
+
+    delta = add_delta(UNDO_INSERT, gtk_text_iter_get_offset(location), 1, strlen(UNDO_OBJECT_CHAR), 0, 1,
+                      actionDepth == 0);
+    if (delta)
+    {
+        write_payload(delta, 0, UNDO_OBJECT_CHAR, delta->textSize);
+        write_image(delta, 0, &image);
+    }
+}
+
+static void on_delete_range(GtkTextBuffer *buff, GtkTextIter *start, GtkTextIter *end, gpointer data)
+{
+    guint32 offset = gtk_text_iter_get_offset(start);
+    guint32 length = gtk_text_iter_get_offset(end) - offset;
+    gchar *text;
+    GArray *runs, *images;
+    UndoDelta *delta;
+    gboolean burst;
+    guint i;
+
+    if (!recording() || !length)
+        return;
+
+    burst = continues_delete(offset, length);
+    if (burst)
+        newGroup = FALSE;
+
+    text = gtk_text_buffer_get_slice(buff, start, end, TRUE);
+    runs = collect_runs(start, end);
+    images = collect_images(buff, text, offset);
+
+    delta = add_delta(UNDO_DELETE, offset, length, strlen(text), runs->len, images->len, actionDepth == 0 && !burst);
+
+    if (delta)
+    {
+        write_payload(delta, 0, text, delta->textSize);
+        for (i = 0; i < runs->len; i++)
+        {
+            UndoRun *run = &g_array_index(runs, UndoRun, i);
+            write_run(delta, i, run->start, run->end, run->tag);
+        }
+        for (i = 0; i < images->len; i++)
+            write_image(delta, i, &g_array_index(images, UndoImage, i));
+    }
+
+    g_array_unref(images);
+    g_array_unref(runs);
+    g_free(text);
+}
+
+// records the parts of a range a tag change will actually change, those without the tag for an apply and
+// those with it for a remove
+
+static void record_tag(guint8 type, GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end)
+{
+    GArray *runs;
+    GtkTextIter iter = *start;
+    gboolean applying = type == UNDO_APPLY_TAG;
+    UndoDelta *delta;
+    guint i;
+
+    if (!recording() || fileio_tag_excluded(tag) || gtk_text_iter_equal(start, end))
+        return;
+
+    runs = g_array_new(FALSE, FALSE, sizeof(UndoRun));
+
+    while (gtk_text_iter_compare(&iter, end) < 0)
+    {
+        GtkTextIter next = iter;
+        gboolean has = gtk_text_iter_has_tag(&iter, tag);
+
+        if (!gtk_text_iter_forward_to_tag_toggle(&next, tag) || gtk_text_iter_compare(&next, end) > 0)
+            next = *end;
+
+        if (has != applying)
+        {
+            UndoRun run = { gtk_text_iter_get_offset(&iter), gtk_text_iter_get_offset(&next), tag };
+            g_array_append_val(runs, run);
+        }
+
+        iter = next;
+    }
+
+    if (runs->len)
+    {
+        delta = add_delta(type, gtk_text_iter_get_offset(start), 0, 0, runs->len, 0, actionDepth == 0);
+
+        for (i = 0; delta && i < runs->len; i++)
+        {
+            UndoRun *run = &g_array_index(runs, UndoRun, i);
+            write_run(delta, i, run->start, run->end, run->tag);
+        }
+    }
+
+    g_array_unref(runs);
+}
+
+static void on_apply_tag(GtkTextBuffer *buff, GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end, gpointer data)
+{
+    record_tag(UNDO_APPLY_TAG, tag, start, end);
+}
+
+static void on_remove_tag(GtkTextBuffer *buff, GtkTextTag *tag, GtkTextIter *start, GtkTextIter *end,
+                          gpointer data)
+{
+    record_tag(UNDO_REMOVE_TAG, tag, start, end);
+}
+
+// everything done inside one user action is undone together
+
+static void on_begin_user_action(GtkTextBuffer *buff, gpointer data)
+{
+    if (actionDepth++ == 0)
+        newGroup = TRUE;
+}
+
+static void on_end_user_action(GtkTextBuffer *buff, gpointer data)
+{
+    if (actionDepth > 0)
+        actionDepth--;
+}
+
+// returns a tag to apply for a run, putting it back in the table if it was removed since
+
+static GtkTextTag *resolve_tag(GtkTextTag *tag)
+{
+    GtkTextTagTable *table = gtk_text_buffer_get_tag_table(undoBuff);
+    gchar *name = NULL;
+    GtkTextTag *found;
+
+    g_object_get(tag, "name", &name, NULL);
+    if (!name)
+        return tag;
+
+    found = gtk_text_tag_table_lookup(table, name);
+    if (!found)
+    {
+        gtk_text_tag_table_add(table, tag);
+        found = tag;
+    }
+
+    g_free(name);
+
+    return found;
+}
+
+// applies or removes the runs of a delta, relative to base
+
+static void set_runs(const UndoDelta *delta, gint base, gboolean apply)
+{
+    guint i;
+
+    for (i = 0; i < delta->runs; i++)
+    {
+        GtkTextIter start, end;
+        UndoRun run;
+
+        read_run(delta, i, &run);
+        gtk_text_buffer_get_iter_at_offset(undoBuff, &start, base + run.start);
+        gtk_text_buffer_get_iter_at_offset(undoBuff, &end, base + run.end);
+
+        if (apply)
+            gtk_text_buffer_apply_tag(undoBuff, resolve_tag(run.tag), &start, &end);
+        else
+            gtk_text_buffer_remove_tag(undoBuff, resolve_tag(run.tag), &start, &end);
+    }
+}
+
+// puts an image back at an iter through the image store, which is left after it
+
+static void place_image(GtkTextIter *at, const UndoImage *image)
+{
+    FileioImage place = { image->hash, image->width, image->height, image->data };
+
+    if (image->hash)
+        images_place(undoBuff, at, &place);
+    else
+        gtk_text_buffer_insert(undoBuff, at, UNDO_OBJECT_CHAR, strlen(UNDO_OBJECT_CHAR));
+}
+
+// inserts the text of a delta back at its offset, with its images in place of their placeholders
+
+static void insert_text(const UndoDelta *delta)
+{
+    GtkTextIter at;
+    gchar *text = g_malloc(delta->textSize);
+    const gchar *from = text, *hit;
+    guint32 done = 0;
+    guint i;
+
+    read_payload(delta, 0, text, delta->textSize);
+    gtk_text_buffer_get_iter_at_offset(undoBuff, &at, delta->offset);
+
+    for (i = 0; i < delta->images; i++)
+    {
+        UndoImage image;
+
+        read_image(delta, i, &image);
+        hit = g_utf8_offset_to_pointer(from, image.offset - done);
+
+        gtk_text_buffer_insert(undoBuff, &at, from, hit - from);
+        place_image(&at, &image);
+
+        from = hit + strlen(UNDO_OBJECT_CHAR);
+        done = image.offset + 1;
+    }
+
+    gtk_text_buffer_insert(undoBuff, &at, from, text + delta->textSize - from);
+    g_free(text);
+}
+
+// records what the images of an insert are before undo takes them out, so redo can put them back
+
+static void capture_images(UndoDelta *delta)
+{
+    guint i;
+
+    for (i = 0; i < delta->images; i++)
+    {
+        UndoImage image;
+        GtkTextIter iter;
+
+        read_image(delta, i, &image);
+        clear_image(&image);
+
+        gtk_text_buffer_get_iter_at_offset(undoBuff, &iter, delta->offset + image.offset);
+        find_image(&iter, &image);
+        write_image(delta, i, &image);
+    }
+}
+
+static void delete_text(const UndoDelta *delta)
+{
+    GtkTextIter start, end;
+
+    gtk_text_buffer_get_iter_at_offset(undoBuff, &start, delta->offset);
+    gtk_text_buffer_get_iter_at_offset(undoBuff, &end, delta->offset + delta->length);
+    gtk_text_buffer_delete(undoBuff, &start, &end);
+}
+
+// plays a delta forwards or backwards, returning the offset the cursor should move to
+
+static gint play_delta(UndoDelta *delta, gboolean forwards)
+{
+    switch (delta->type)
+    {
+    case UNDO_INSERT:
+        if (forwards)
+        {
+            insert_text(delta);
+            return delta->offset + delta->length;
+        }
+        capture_images(delta);
+        delete_text(delta);
+        return delta->offset;
+
+    case UNDO_DELETE:
+        if (forwards)
+        {
+            delete_text(delta);
+            return delta->offset;
+        }
+        insert_text(delta);
+        set_runs(delta, delta->offset, TRUE);
+        return delta->offset + delta->length;
+
+    case UNDO_APPLY_TAG:
+    case UNDO_REMOVE_TAG:
+        set_runs(delta, 0, (delta->type == UNDO_APPLY_TAG) == forwards);
+        return delta->offset;
+    }
+
+    return delta->offset;
+}
+
+static void place_cursor(gint offset)
+{
+    GtkTextIter iter;
+
+    gtk_text_buffer_get_iter_at_offset(undoBuff, &iter, offset);
+    gtk_text_buffer_place_cursor(undoBuff, &iter);
+}
+
+// undoes the most recent step, the work is proportional to the size of the step and not the document
+
+gboolean undo_undo(void)
+{
+    TRACE_SCOPE(TRACE_SPAN, "undo_undo");
+
+    gint cursor = 0;
+
+    if (!undoBuff || applied == first)
+        return FALSE;
+
+    replaying = TRUE;
+    gtk_text_buffer_begin_user_action(undoBuff);
+
+    do
+    {
+        cursor = play_delta(delta_at(--applied), FALSE);
+    } while (applied > first && !delta_at(applied)->group);
+
+    gtk_text_buffer_end_user_action(undoBuff);
+    replaying = FALSE;
+
+    place_cursor(cursor);
+    lastEditTime = 0;
+
+    return TRUE;
+}
+
+// redoes the step most recently undone
+
+gboolean undo_redo(void)
+{
+    TRACE_SCOPE(TRACE_SPAN, "undo_redo");
+
+    gint cursor = 0;
+
+    if (!undoBuff || applied == last)
+        return FALSE;
+
+    replaying = TRUE;
+    gtk_text_buffer_begin_user_action(undoBuff);
+
+    do
+    {
+        cursor = play_delta(delta_at(applied++), TRUE);
+    } while (applied < last && !delta_at(applied)->group);
+
+    gtk_text_buffer_end_user_action(undoBuff);
+    replaying = FALSE;
+
+    place_cursor(cursor);
+    lastEditTime = 0;
+
+    return TRUE;
+}
+
+// forgets the whole history, as when another document is loaded
+
+void undo_clear(void)
+{
+    while (last > first)
+        drop_delta(delta_at(--last));
+
+    first = applied = last;
+    newGroup = TRUE;
+    lastEditTime = 0;
+}
+
+// reports how much memory the history holds and how many steps it has either way
+
+void undo_stats(UndoStats *stats)
+{
+    guint64 i;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!undoBuff)
+        return;
+
+    stats->bytes = (arenaHead - arena_tail()) + (last - first) * sizeof(UndoDelta);
+    stats->capacity = arenaCap + deltaCap * sizeof(UndoDelta);
+    stats->deltas = last - first;
+    stats->evicted = evicted;
+
+    for (i = first; i < last; i++)
+    {
+        if (!delta_at(i)->group)
+            continue;
+
+        if (i < applied)
+            stats->undoSteps++;
+        else
+            stats->redoSteps++;
+    }
+}
+
+// starts recording the changes made to a buffer, using at most capacity bytes. The rings are allocated up
+// front but the system only backs the pages the history actually reaches.
+
+void undo_attach(GtkTextBuffer *buff, gsize capacity)
+{
+    undoBuff = buff;
+    deltaCap = MAX(capacity / UNDO_DELTA_SHARE / sizeof(UndoDelta), 64);
+    arenaCap = MAX(capacity - deltaCap * sizeof(UndoDelta), 4096);
+    deltas = g_new(UndoDelta, deltaCap);
+    arena = g_malloc(arenaCap);
+    first = applied = last = arenaHead = 0;
+    newGroup = TRUE;
+
+    handlers[0] = g_signal_connect(buff, "insert-text", G_CALLBACK(on_insert_text), NULL);
+    handlers[1] = g_signal_connect(buff, "delete-range", G_CALLBACK(on_delete_range), NULL);
+    handlers[2] = g_signal_connect(buff, "apply-tag", G_CALLBACK(on_apply_tag), NULL);
+    handlers[3] = g_signal_connect(buff, "remove-tag", G_CALLBACK(on_remove_tag), NULL);
+    handlers[4] = g_signal_connect(buff, "begin-user-action", G_CALLBACK(on_begin_user_action), NULL);
+    handlers[5] = g_signal_connect(buff, "end-user-action", G_CALLBACK(on_end_user_action), NULL);
+    handlers[6] = g_signal_connect(buff, "insert-child-anchor", G_CALLBACK(on_insert_child_anchor), NULL);
+}
+
+// stops recording and frees the history
+
+void undo_detach(void)
+{
+    UndoStats stats;
+    guint i;
+
+    if (!undoBuff)
+        return;
+
+    undo_stats(&stats);
+    DEB("Undo history: %zu of %zu bytes, %u deltas, %u undo and %u redo steps, %lu steps evicted\n",
+        stats.bytes, stats.capacity, stats.deltas, stats.undoSteps, stats.redoSteps, (unsigned long) stats.evicted);
+
+    for (i = 0; i < G_N_ELEMENTS(handlers); i++)
+        g_signal_handler_disconnect(undoBuff, handlers[i]);
+
+    undo_clear();
+    g_free(deltas);
+    g_free(arena);
+    undoBuff = NULL;
+}
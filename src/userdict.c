@@ -0,0 +1,287 @@
+/* Copyright (C) Benjamin James Read, 2022 - All Rights Reserved
+ * Unauthorized copying of this file, via any medium is strictly prohibited
+ * Proprietary and confidential
+ * Written by Benjamin Read <benjamin-read@hotmail.co.uk>, January 2022
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "userdict.h"
+#include "debugmsg.h"
+
+// The file is a fixed header, an index of word offsets in sorted word order and a blob of length prefixed
+// words. Opening it is only a mapping however many words it holds and a lookup is a binary search of the
+// index. Everything is in host byte order, the byte order mark lets a file from another machine be rejected.
+
+#define USERDICT_MAGIC "BUKUDIC"
+#define USERDICT_VERSION 1
+#define USERDICT_BOM 0x01020304u
+
+// words are stored with a one byte length, longer ones are dropped when writing
+
+#define USERDICT_MAX_WORD 255
+
+typedef struct
+{
+    char magic[8];
+    uint32_t bom;
+    uint32_t version;
+    uint32_t wordCount;
+    uint32_t reserved;
+    uint64_t indexOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+} UserDictHeader;
+
+struct UserDict
+{
+    void *base;
+    size_t size;
+    const UserDictHeader *header;
+    const uint32_t *index;
+    const unsigned char *strings;
+};
+
+// orders words bytewise, a word sorts before any longer word it starts
+
+static int compare_words(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int ret = memcmp(a, b, alen < blen ? alen : blen);
+
+    if (ret)
+        return ret;
+
+    return alen < blen ? -1 : alen > blen;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const UserDictWord *wa = a;
+    const UserDictWord *wb = b;
+
+    return compare_words(wa->word, wa->len, wb->word, wb->len);
+}
+
+// maps a personal dictionary, returns NULL if the file is missing or is not one this build can read
+
+UserDict *userdict_open(const char *path)
+{
+    UserDict *dict;
+    struct stat st;
+    void *base;
+    const UserDictHeader *header;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(UserDictHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+        return NULL;
+
+    header = base;
+
+    if (memcmp(header->magic, USERDICT_MAGIC, sizeof(USERDICT_MAGIC)) != 0 || header->bom != USERDICT_BOM
+        || header->version != USERDICT_VERSION
+        || header->indexOffset + (uint64_t) header->wordCount * sizeof(uint32_t) > (uint64_t) st.st_size
+        || header->stringsOffset + header->stringsSize > (uint64_t) st.st_size)
+    {
+        DEB("%s is not a usable personal dictionary\n", path);
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    dict = malloc(sizeof(UserDict));
+    if (!dict)
+    {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    dict->base = base;
+    dict->size = st.st_size;
+    dict->header = header;
+    dict->index = (const uint32_t *) ((const char *) base + header->indexOffset);
+    dict->strings = (const unsigned char *) base + header->stringsOffset;
+
+    return dict;
+}
+
+// unmaps a personal dictionary
+
+void userdict_close(UserDict *dict)
+{
+    if (!dict)
+        return;
+
+    munmap(dict->base, dict->size);
+    free(dict);
+}
+
+// returns the number of words in a personal dictionary
+
+size_t userdict_count(const UserDict *dict)
+{
+    return dict->header->wordCount;
+}
+
+// returns the i'th word in sorted order, which is not nul terminated, or NULL if the file is damaged there
+
+const char *userdict_word(const UserDict *dict, size_t i, size_t *len)
+{
+    uint32_t offset = dict->index[i];
+
+    if (offset >= dict->header->stringsSize || offset + 1 + dict->strings[offset] > dict->header->stringsSize)
+        return NULL;
+
+    *len = dict->strings[offset];
+
+    return (const char *) dict->strings + offset + 1;
+}
+
+// returns true if the word is in the dictionary exactly as given
+
+bool userdict_contains(const UserDict *dict, const char *word, size_t len)
+{
+    size_t lo = 0, hi = dict->header->wordCount;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2, mlen;
+        const char *entry = userdict_word(dict, mid, &mlen);
+        int cmp;
+
+        if (!entry)
+            return false;
+
+        cmp = compare_words(entry, mlen, word, len);
+        if (cmp == 0)
+            return true;
+
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return false;
+}
+
+// flushes the directory holding path so a rename into it survives a crash, failure only loses durability
+
+static void sync_dir(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir;
+    int fd;
+
+    if (!slash)
+        dir = strdup(".");
+    else if (slash == path)
+        dir = strdup("/");
+    else
+        dir = strndup(path, slash - path);
+
+    if (!dir)
+        return;
+
+    fd = open(dir, O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+// writes a personal dictionary holding the given words, which are sorted in place and may hold duplicates.
+// The file is written next to path, flushed to disk and renamed into place, so a crash leaves the old file
+// or the new one and a mapping of the old one stays valid.
+
+bool userdict_write(const char *path, UserDictWord *words, size_t count)
+{
+    UserDictHeader header;
+    uint32_t *index = malloc((count ? count : 1) * sizeof(uint32_t));
+    size_t i, tmplen = strlen(path) + 5, stringsSize = 0;
+    uint32_t wordCount = 0;
+    char *tmp = malloc(tmplen);
+    FILE *out;
+    bool ret = false;
+
+    if (!index || !tmp)
+        goto out;
+
+    qsort(words, count, sizeof(UserDictWord), compare_entries);
+
+    for (i = 0; i < count; i++)
+    {
+        if (words[i].len == 0 || words[i].len > USERDICT_MAX_WORD
+            || (i && compare_entries(&words[i], &words[i - 1]) == 0))
+            continue;
+
+        index[wordCount++] = stringsSize;
+        stringsSize += words[i].len + 1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, USERDICT_MAGIC, sizeof(USERDICT_MAGIC));
+    header.bom = USERDICT_BOM;
+    header.version = USERDICT_VERSION;
+    header.wordCount = wordCount;
+    header.indexOffset = sizeof(UserDictHeader);
+    header.stringsOffset = header.indexOffset + (uint64_t) wordCount * sizeof(uint32_t);
+    header.stringsSize = stringsSize;
+
+    snprintf(tmp, tmplen, "%s.tmp", path);
+    out = fopen(tmp, "wb");
+    if (!out)
+        goto out;
+
+    ret = fwrite(&header, sizeof(header), 1, out) == 1
+        && fwrite(index, sizeof(uint32_t), wordCount, out) == wordCount;
+
+    // the strings follow in the same order, skipping what the index skipped
+
+    for (i = 0; ret && i < count; i++)
+    {
+        unsigned char len = words[i].len;
+
+        if (words[i].len == 0 || words[i].len > USERDICT_MAX_WORD
+            || (i && compare_entries(&words[i], &words[i - 1]) == 0))
+            continue;
+
+        ret = fwrite(&len, 1, 1, out) == 1 && fwrite(words[i].word, 1, len, out) == len;
+    }
+
+    ret = ret && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    ret = (fclose(out) == 0) && ret;
+
+    if (ret)
+        ret = (rename(tmp, path) == 0);
+    if (!ret)
+        remove(tmp);
+    else
+        sync_dir(path);
+
+out:
+    free(index);
+    free(tmp);
+
+    return ret;
+}